@@ -1,6 +1,13 @@
 #version {{ver}} core
 //#version 440 core
-uniform mat4 MVP;
+layout(std140) uniform Camera // Shared with the cloud shader, see PointCloudWin::CameraBlock
+{
+   mat4 MVP;
+   mat4 MV;
+   mat4 P;
+   float maxDistance;
+   float pointSize;
+};
 layout(location = 0) in vec3 vPosition;
 layout(location = 1) in vec3 vColor;
 
@@ -1,20 +1,51 @@
 #version {{ver}} core
+{{defines}}
 //#version 440 core
-uniform mat4 MV;
-uniform mat4 P;
-uniform float pointSize;
+layout(std140) uniform Camera // Updated once per frame, see PointCloudWin::CameraBlock
+{
+   mat4 MVP;
+   mat4 MV;
+   mat4 P;
+   float maxDistance;
+   float pointSize;
+};
 //uniform vec3 location;
-uniform float maxDistance;
+uniform float lighting; // 1 to shade using the normal, 0 for distance only
+uniform vec3 bboxMin;   // position = bboxMin + vPacked.xyz*bboxScale
+uniform vec3 bboxScale;
 
-layout(location = 0) in vec4 vPosition;
+#ifdef VERTEX_PULLING
+// PointCloudData::PackedVertex as 3 uints: x | y << 16, z | normal << 16, rgba8, fetched by gl_VertexID
+layout(std430, binding = 0) readonly buffer Vertices { uint vertices[]; };
+#else
+// x, y, z quantized to 16 bits over the bounding box, w = octahedral encoded unoriented normal (8 bits u, 8 bits v)
+layout(location = 0) in uvec4 vPacked;
 layout(location = 1) in vec4 vColor;
+#endif
 smooth out vec4 colour;
 
 vec4 close_color, far_color;
 const vec4 eye_Position = vec4(0, 0, 0, 1); // location gets transformed to origin by MV
+const float ambient = 0.25;
+
+vec3 oct_decode(uint enc)
+{
+   vec2 e = vec2(float(enc & 0xFFu), float(enc >> 8u)) / 255.0 * 2.0 - 1.0;
+   vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+   if (n.z < 0.0)
+      n.xy = (1.0 - abs(n.yx)) * vec2((n.x >= 0.0) ? 1.0 : -1.0, (n.y >= 0.0) ? 1.0 : -1.0);
+   return normalize(n);
+}
 
 void main()
 {
+#ifdef VERTEX_PULLING
+   uint i = uint(gl_VertexID);
+   uint w0 = vertices[3u*i], w1 = vertices[3u*i + 1u];
+   uvec4 vPacked = uvec4(w0 & 0xFFFFu, w0 >> 16u, w1 & 0xFFFFu, w1 >> 16u);
+   vec4 vColor = unpackUnorm4x8(vertices[3u*i + 2u]);
+#endif
+   vec4 vPosition = vec4(bboxMin + vec3(vPacked.xyz)*bboxScale, 1.0);
    vec4 position = MV * vPosition;
 //   vec4 eye_Position =  MV * vec4(location, 1.0);
    float d = distance(eye_Position, position);
@@ -23,6 +54,13 @@ void main()
 //   gl_PointSize = 200.0 / d;
    gl_Position = P * position;
    close_color = vColor;
-   far_color = vColor / 4;
+   far_color = vec4(vColor.rgb / 4, vColor.a); // distance darkens rgb only, alpha is the point's coverage
    colour = mix(close_color, far_color, scale);
+   if (lighting > 0.5)
+   {
+      // Headlight Lambert term, abs because PCA normals are not oriented. MV is rigid so mat3(MV) is the normal matrix.
+      vec3 N = normalize(mat3(MV) * oct_decode(vPacked.w));
+      float lambert = abs(dot(N, normalize(-position.xyz)));
+      colour.rgb *= ambient + (1.0 - ambient)*lambert;
+   }
 }
@@ -0,0 +1,104 @@
+#version {{ver}} core
+// GPU chunk culling (see PointCloudWin::set_gpu_culling). One invocation per chunk tests the chunk bounds against
+// the frustum and, when occlusion is set, against the maximum depth pyramid of the previous frame (Hi-Z), applies
+// the level of detail and appends a DrawArraysIndirectCommand for a visible chunk.
+layout(local_size_x = 64) in;
+
+struct Chunk
+{
+   vec4 lo; // bounds minimum, w = estimated mean point spacing
+   vec4 hi; // bounds maximum
+   uint first;
+   uint count;
+   uint pad0, pad1;
+};
+struct DrawArraysIndirectCommand
+{
+   uint count;
+   uint instanceCount;
+   uint first;
+   uint baseInstance;
+};
+
+layout(std430, binding = 0) readonly buffer Chunks { Chunk chunks[]; };
+layout(std430, binding = 1) writeonly buffer Commands { DrawArraysIndirectCommand commands[]; };
+layout(std430, binding = 2) buffer Count { uint drawCount; };
+
+uniform uint chunkCount;
+uniform vec4 planes[6];      // ax + by + cz + d >= 0 inside
+uniform vec3 eye;
+uniform float pixelsPerUnit; // pixels per world unit at distance 1
+uniform float lodError;      // projected point spacing in pixels, 0 for no level of detail
+uniform float fraction;      // of the points of each chunk to draw (less than 1 while interacting)
+uniform int occlusion;
+uniform mat4 hizMVP;         // view projection of the frame the pyramid was built from
+uniform sampler2D hiz;       // level 0 is half the viewport size
+uniform vec2 viewport;
+uniform int hizLevels;
+
+bool is_outside(vec3 lo, vec3 hi)
+{
+   for (int p = 0; p < 6; p++)
+   {
+      // The corner furthest along the plane normal
+      vec3 corner = mix(lo, hi, greaterThanEqual(planes[p].xyz, vec3(0.0)));
+      if (dot(planes[p].xyz, corner) + planes[p].w < 0.0)
+         return true;
+   }
+   return false;
+}
+
+bool is_occluded(vec3 lo, vec3 hi)
+{
+   vec2 rmin = vec2(1.0), rmax = vec2(-1.0);
+   float zmin = 1.0;
+   for (int i = 0; i < 8; i++)
+   {
+      vec3 corner = vec3(((i & 1) != 0) ? hi.x : lo.x, ((i & 2) != 0) ? hi.y : lo.y, ((i & 4) != 0) ? hi.z : lo.z);
+      vec4 clip = hizMVP * vec4(corner, 1.0);
+      if (clip.w <= 0.0)
+         return false; // crosses the eye plane
+      vec3 ndc = clip.xyz / clip.w;
+      rmin = min(rmin, ndc.xy);
+      rmax = max(rmax, ndc.xy);
+      zmin = min(zmin, ndc.z);
+   }
+   rmin = clamp(rmin*0.5 + 0.5, 0.0, 1.0) * viewport;
+   rmax = clamp(rmax*0.5 + 0.5, 0.0, 1.0) * viewport;
+   // Level whose texels (2^(level+1) pixels) are at least as large as the rectangle, so it covers at most 2x2
+   float size = max(max(rmax.x - rmin.x, rmax.y - rmin.y), 1.0);
+   int level = clamp(int(ceil(log2(size))) - 1, 0, hizLevels - 1);
+   ivec2 texels = textureSize(hiz, level);
+   ivec2 t0 = clamp(ivec2(rmin) >> (level + 1), ivec2(0), texels - 1);
+   ivec2 t1 = clamp(ivec2(rmax) >> (level + 1), ivec2(0), texels - 1);
+   float depth = max(max(texelFetch(hiz, t0, level).r, texelFetch(hiz, ivec2(t1.x, t0.y), level).r),
+                     max(texelFetch(hiz, ivec2(t0.x, t1.y), level).r, texelFetch(hiz, t1, level).r));
+   return (zmin*0.5 + 0.5 > depth);
+}
+
+void main()
+{
+   uint c = gl_GlobalInvocationID.x;
+   if (c >= chunkCount)
+      return;
+   Chunk chunk = chunks[c];
+   if ( (is_outside(chunk.lo.xyz, chunk.hi.xyz)) || ( (occlusion != 0) && (is_occluded(chunk.lo.xyz, chunk.hi.xyz)) ) )
+      return;
+   uint n = chunk.count;
+   float spacing = chunk.lo.w;
+   if ( (lodError > 0.0) && (spacing > 0.0) )
+   {
+      // Same as PointCloudWin::cull_chunks: keep (projected spacing / error)^2 of the points at the nearest point
+      float distance = length(max(max(chunk.lo.xyz - eye, eye - chunk.hi.xyz), vec3(0.0)));
+      if (distance > 0.0)
+      {
+         float ratio = (spacing*pixelsPerUnit / distance) / lodError;
+         if (ratio < 1.0)
+            n = max(1u, uint(ceil(float(n)*ratio*ratio)));
+      }
+   }
+   if (fraction < 1.0)
+      n = min(n, max(1u, uint(ceil(float(n)*fraction))));
+   uint i = atomicAdd(drawCount, 1u);
+   commands[i] = DrawArraysIndirectCommand(n, 1u, chunk.first, 0u);
+}
@@ -0,0 +1,25 @@
+#version {{ver}} core
+// One level of the maximum depth pyramid used for occlusion culling: each texel is the maximum of the 2x2 source
+// texels it covers (3 wide or high at the odd edge of the source).
+layout(local_size_x = 8, local_size_y = 8) in;
+
+uniform sampler2D source; // the depth buffer copy for level 0, otherwise the previous level
+uniform int sourceLevel;
+layout(r32f) writeonly uniform image2D destination;
+
+void main()
+{
+   ivec2 size = imageSize(destination);
+   ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+   if (any(greaterThanEqual(p, size)))
+      return;
+   ivec2 source_size = textureSize(source, sourceLevel);
+   ivec2 last = source_size - 1;
+   ivec2 extent = ivec2(((p.x == size.x - 1) && ((source_size.x & 1) != 0)) ? 3 : 2,
+                        ((p.y == size.y - 1) && ((source_size.y & 1) != 0)) ? 3 : 2);
+   float depth = 0.0;
+   for (int y = 0; y < extent.y; y++)
+      for (int x = 0; x < extent.x; x++)
+         depth = max(depth, texelFetch(source, min(p*2 + ivec2(x, y), last), sourceLevel).r);
+   imageStore(destination, p, vec4(depth));
+}
@@ -0,0 +1,16 @@
+#version {{ver}} core
+// Weighted blended order independent transparency accumulation (McGuire and Bavoil 2013), used with
+// cloud/vertex.glsl. Drawn with additive blending into accumulation (RGBA16F) and multiplicative blending into
+// revealage (R16F) targets, see fragment.glsl for the composite.
+smooth in vec4 colour;
+
+layout(location = 0) out vec4 accumulation;
+layout(location = 1) out float revealage;
+void main()
+{
+   float a = colour.a;
+   // Depth weight so nearer points dominate, from the paper's gl_FragCoord.z variant.
+   float w = clamp(pow(min(1.0, a*10.0) + 0.01, 3.0)*1e8*pow(1.0 - gl_FragCoord.z*0.9, 3.0), 1e-2, 3e3);
+   accumulation = vec4(colour.rgb*a, a)*w;
+   revealage = a;
+}
@@ -0,0 +1,18 @@
+#version {{ver}} core
+// Composites the weighted blended transparency targets (see accumulate.glsl) over the opaque image, drawn with
+// glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA).
+uniform sampler2D accumulationTexture;
+uniform sampler2D revealageTexture;
+
+layout(location = 0) out vec4 FragColor;
+void main()
+{
+   ivec2 pixel = ivec2(gl_FragCoord.xy);
+   float revealage = texelFetch(revealageTexture, pixel, 0).r;
+   if (revealage >= 0.9999)
+      discard; // no transparent points cover the pixel
+   vec4 accumulation = texelFetch(accumulationTexture, pixel, 0);
+   if (isinf(max(max(abs(accumulation.r), abs(accumulation.g)), abs(accumulation.b))))
+      accumulation.rgb = vec3(accumulation.a); // half float overflow
+   FragColor = vec4(accumulation.rgb / max(accumulation.a, 1e-5), 1.0 - revealage);
+}
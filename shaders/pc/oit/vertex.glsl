@@ -0,0 +1,7 @@
+#version {{ver}} core
+// Full screen triangle for the transparency composite, drawn with an empty VAO.
+void main()
+{
+   vec2 p = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+   gl_Position = vec4(p*2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,87 @@
+#version {{ver}} core
+{{defines}}
+// Compute point rasterizer: one invocation per point, one pixel per point. Workgroup y selects the visible chunk.
+// With ATOMIC64 depth (high 32 bits) and colour (low 32 bits) are packed into one 64 bit atomicMin, otherwise
+// pass 0 resolves the depth with a 32 bit atomicMin and pass 1 writes the colour of the points that won.
+layout(local_size_x = 256) in;
+
+layout(std140) uniform Camera // see PointCloudWin::CameraBlock
+{
+   mat4 MVP;
+   mat4 MV;
+   mat4 P;
+   float maxDistance;
+   float pointSize;
+};
+uniform float lighting;
+uniform vec3 bboxMin;
+uniform vec3 bboxScale;
+uniform ivec2 viewport;
+uniform int pass;
+
+// PointCloudData::PackedVertex as 3 uints: x | y << 16, z | normal << 16, rgba8
+layout(std430, binding = 0) readonly buffer Vertices { uint vertices[]; };
+layout(std430, binding = 1) readonly buffer Ranges { ivec2 ranges[]; }; // first, count per visible chunk
+#ifdef ATOMIC64
+layout(std430, binding = 2) buffer Framebuffer { uint64_t framebuffer[]; };
+#else
+layout(std430, binding = 2) buffer Depth { uint depth[]; };
+layout(std430, binding = 3) buffer Color { uint color[]; };
+#endif
+
+const float ambient = 0.25;
+
+vec3 oct_decode(uint enc)
+{
+   vec2 e = vec2(float(enc & 0xFFu), float(enc >> 8u)) / 255.0 * 2.0 - 1.0;
+   vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+   if (n.z < 0.0)
+      n.xy = (1.0 - abs(n.yx)) * vec2((n.x >= 0.0) ? 1.0 : -1.0, (n.y >= 0.0) ? 1.0 : -1.0);
+   return normalize(n);
+}
+
+// Same shading as cloud/vertex.glsl
+vec4 shade(vec4 position, uint w1, uint w2)
+{
+   vec4 vColor = unpackUnorm4x8(w2);
+   float d = length(position.xyz);
+   float scale = clamp(1.0 - (d / maxDistance), 0.1, 1.0);
+   vec4 colour = vec4(mix(vColor.rgb, vColor.rgb / 4, scale), vColor.a);
+   if (lighting > 0.5)
+   {
+      vec3 N = normalize(mat3(MV) * oct_decode(w1 >> 16u));
+      float lambert = abs(dot(N, normalize(-position.xyz)));
+      colour.rgb *= ambient + (1.0 - ambient)*lambert;
+   }
+   return colour;
+}
+
+void main()
+{
+   ivec2 range = ranges[gl_WorkGroupID.y];
+   uint local = gl_WorkGroupID.x * gl_WorkGroupSize.x + gl_LocalInvocationID.x;
+   if (local >= uint(range.y))
+      return;
+   uint i = uint(range.x) + local;
+   uint w0 = vertices[3u*i], w1 = vertices[3u*i + 1u], w2 = vertices[3u*i + 2u];
+   vec3 p = bboxMin + vec3(float(w0 & 0xFFFFu), float(w0 >> 16u), float(w1 & 0xFFFFu))*bboxScale;
+   vec4 position = MV * vec4(p, 1.0);
+   vec4 clip = P * position;
+   if (clip.w <= 0.0)
+      return;
+   vec3 ndc = clip.xyz / clip.w;
+   if (any(greaterThan(abs(ndc), vec3(1.0))))
+      return;
+   ivec2 pixel = min(ivec2((ndc.xy*0.5 + 0.5)*vec2(viewport)), viewport - 1);
+   uint index = uint(pixel.y*viewport.x + pixel.x);
+   uint z = floatBitsToUint(ndc.z*0.5 + 0.5); // positive floats order as uints
+#ifdef ATOMIC64
+   uint c = packUnorm4x8(shade(position, w1, w2));
+   atomicMin(framebuffer[index], (uint64_t(z) << 32) | uint64_t(c));
+#else
+   if (pass == 0)
+      atomicMin(depth[index], z);
+   else if (depth[index] == z)
+      color[index] = packUnorm4x8(shade(position, w1, w2));
+#endif
+}
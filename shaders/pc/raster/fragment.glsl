@@ -0,0 +1,30 @@
+#version {{ver}} core
+{{defines}}
+// Copies the compute rasterizer framebuffer (see compute.glsl) to the bound framebuffer, including depth so that
+// the result composites with geometry drawn normally.
+uniform ivec2 viewport;
+#ifdef ATOMIC64
+layout(std430, binding = 2) readonly buffer Framebuffer { uint64_t framebuffer[]; };
+#else
+layout(std430, binding = 2) readonly buffer Depth { uint depth[]; };
+layout(std430, binding = 3) readonly buffer Color { uint color[]; };
+#endif
+
+layout(location = 0) out vec4 FragColor;
+void main()
+{
+   ivec2 pixel = ivec2(gl_FragCoord.xy);
+   uint index = uint(pixel.y*viewport.x + pixel.x);
+#ifdef ATOMIC64
+   uint64_t v = framebuffer[index];
+   uint z = uint(v >> 32);
+   uint c = uint(v & 0xFFFFFFFFUL);
+#else
+   uint z = depth[index];
+   uint c = color[index];
+#endif
+   if (z == 0xFFFFFFFFu)
+      discard;
+   FragColor = unpackUnorm4x8(c);
+   gl_FragDepth = uintBitsToFloat(z);
+}
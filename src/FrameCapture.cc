@@ -0,0 +1,329 @@
+/*
+Copyright (c) 2017 Donald Munro
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+#ifdef USE_GLEW
+#include <GL/glew.h>
+#endif
+#ifdef USE_GLAD
+#include <glad/glad.h>
+#endif
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+
+#include <zlib.h>
+
+#include "FrameCapture.h"
+
+bool FrameCapture::start(const std::string& directory_, const std::string& prefix_, Format format_, unsigned ring,
+                         size_t max_queued_, std::stringstream* errs)
+//--------------------------------------------------------------------------------------------------------------
+{
+   if (is_running)
+   {
+      if (errs) *errs << "Frame capture already running to " << directory;
+      return false;
+   }
+   try
+   {
+      filesystem::create_directories(filesystem::path(directory_));
+   }
+   catch (std::exception& e)
+   {
+      if (errs) *errs << "Error creating frame capture directory " << directory_ << ": " << e.what();
+      return false;
+   }
+   directory = directory_;
+   prefix = prefix_;
+   format = format_;
+   max_queued = std::max<size_t>(max_queued_, 1);
+   slots.clear();
+   slots.resize(std::max(ring, 2u));
+   next_slot = frame_number = frames_captured = frames_dropped = 0;
+   frames_written.store(0);
+   encoder_dropped.store(0);
+   must_stop = false;
+   encoder = std::thread(&FrameCapture::encode, this);
+   is_running = true;
+   return true;
+}
+
+void FrameCapture::capture(GLuint framebuffer, int width, int height, const std::string& name)
+//-------------------------------------------------------------------------------------------
+{
+   if ( (! is_running) || (slots.empty()) || (width <= 0) || (height <= 0) ) return;
+   // Completed readbacks, oldest first. The GPU completes them in order so stop at the first still in flight.
+   const size_t n = slots.size();
+   for (size_t i = 0; i < n; i++)
+   {
+      Slot& slot = slots[(next_slot + i) % n];
+      if ( (slot.fence != nullptr) && (! poll(slot, 0)) )
+         break;
+   }
+   frame_number++;
+   Slot& slot = slots[next_slot];
+   if ( (slot.fence != nullptr) && (is_lossless) )
+      poll(slot, 10000000000UL);
+   if (slot.fence != nullptr)
+   {
+      frames_dropped++; // the GPU is more than the ring behind
+      return;
+   }
+   const size_t size = static_cast<size_t>(width)*height*4;
+   if (slot.buffer == 0)
+      glGenBuffers(1, &slot.buffer);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+   if (slot.size < size)
+   {
+      glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+      slot.size = size;
+   }
+   GLint read_framebuffer = 0;
+   glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_framebuffer);
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+   glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, static_cast<GLuint>(read_framebuffer));
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   slot.frame = frame_number;
+   slot.width = width;
+   slot.height = height;
+   slot.name = name;
+   next_slot = (next_slot + 1) % n;
+}
+
+// Hands the readback in slot to the encoder if its fence has signalled within timeout_ns.
+bool FrameCapture::poll(Slot& slot, GLuint64 timeout_ns)
+//-------------------------------------------------------
+{
+   const GLenum status = glClientWaitSync(slot.fence, (timeout_ns > 0) ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, timeout_ns);
+   if ( (status == GL_TIMEOUT_EXPIRED) || (status == GL_WAIT_FAILED) )
+      return false;
+   glDeleteSync(slot.fence);
+   slot.fence = nullptr;
+   bool is_full;
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (is_lossless)
+         dequeued.wait(lock, [this]() { return (queue.size() < max_queued); });
+      is_full = (queue.size() >= max_queued);
+   }
+   if (is_full)
+   {
+      frames_dropped++; // the encoder is behind
+      return true;
+   }
+   const size_t size = static_cast<size_t>(slot.width)*slot.height*4;
+   Image image{slot.frame, slot.width, slot.height, std::vector<uint8_t>(size), slot.name};
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+   const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+   if (pixels != nullptr)
+   {
+      std::memcpy(image.pixels.data(), pixels, size);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+   }
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   if (pixels == nullptr)
+   {
+      frames_dropped++;
+      return true;
+   }
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(std::move(image));
+   }
+   queued.notify_one();
+   frames_captured++;
+   return true;
+}
+
+void FrameCapture::finish()
+//-------------------------
+{
+   const size_t n = slots.size();
+   for (size_t i = 0; i < n; i++)
+   {
+      Slot& slot = slots[(next_slot + i) % n];
+      if ( (slot.fence != nullptr) && (! poll(slot, 1000000000UL)) )
+      {
+         glDeleteSync(slot.fence);
+         slot.fence = nullptr;
+         frames_dropped++;
+      }
+   }
+   del();
+}
+
+void FrameCapture::del()
+//----------------------
+{
+   for (Slot& slot : slots)
+   {
+      if (slot.fence != nullptr)
+         glDeleteSync(slot.fence);
+      if (slot.buffer != 0)
+         glDeleteBuffers(1, &slot.buffer);
+   }
+   slots.clear();
+}
+
+void FrameCapture::stop()
+//-----------------------
+{
+   if (! is_running) return;
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      must_stop = true;
+   }
+   queued.notify_one();
+   if (encoder.joinable())
+      encoder.join();
+   is_running = false;
+   std::cout << "Frame capture to " << directory << ": " << frames_written.load() << " frames written, "
+             << dropped() << " dropped" << std::endl;
+}
+
+void FrameCapture::encode()
+//-------------------------
+{
+   while (true)
+   {
+      Image image;
+      {
+         std::unique_lock<std::mutex> lock(mutex);
+         queued.wait(lock, [this]() { return ( (must_stop) || (! queue.empty()) ); });
+         if (queue.empty())
+            break; // stopping and everything queued has been written
+         image = std::move(queue.front());
+         queue.pop_front();
+      }
+      dequeued.notify_one();
+      const char* extension = (format == Format::PNG) ? "png" : "pam";
+      std::string filename;
+      if (image.name.empty())
+      {
+         char name[32];
+         std::snprintf(name, sizeof(name), "_%06zu.%s", image.frame, extension);
+         filename = prefix + name;
+      }
+      else
+         filename = image.name + "." + extension;
+      const std::string path = (filesystem::path(directory) / filesystem::path(filename)).string();
+      const bool ok = (format == Format::PNG) ? write_png(image, path) : write_pam(image, path);
+      if (ok)
+         frames_written++;
+      else
+         encoder_dropped++;
+   }
+}
+
+namespace
+{
+   void put32(std::string& out, uint32_t v)
+   {
+      out.push_back(static_cast<char>(v >> 24)); out.push_back(static_cast<char>(v >> 16));
+      out.push_back(static_cast<char>(v >> 8)); out.push_back(static_cast<char>(v));
+   }
+
+   void png_chunk(std::ofstream& ofs, const char* type, const uint8_t* data, size_t length)
+   {
+      std::string header;
+      put32(header, static_cast<uint32_t>(length));
+      header.append(type, 4);
+      uLong crc = crc32(0L, reinterpret_cast<const Bytef*>(type), 4);
+      if (length > 0)
+         crc = crc32(crc, data, static_cast<uInt>(length));
+      std::string trailer;
+      put32(trailer, static_cast<uint32_t>(crc));
+      ofs.write(header.data(), header.size());
+      if (length > 0)
+         ofs.write(reinterpret_cast<const char*>(data), length);
+      ofs.write(trailer.data(), trailer.size());
+   }
+}
+
+bool FrameCapture::write_png(const Image& image, const std::string& path)
+//-----------------------------------------------------------------------
+{
+   // Rows top first, each with the Sub filter (the difference from the pixel to the left), which compresses
+   // rendered images much better than no filter for little cost.
+   const size_t stride = static_cast<size_t>(image.width)*4;
+   std::vector<uint8_t> filtered((stride + 1)*image.height);
+   for (int y = 0; y < image.height; y++)
+   {
+      const uint8_t* row = image.pixels.data() + (image.height - 1 - y)*stride;
+      uint8_t* out = filtered.data() + y*(stride + 1);
+      out[0] = 1;
+      std::memcpy(out + 1, row, 4);
+      for (size_t x = 4; x < stride; x++)
+         out[x + 1] = static_cast<uint8_t>(row[x] - row[x - 4]);
+   }
+   uLongf compressed_size = compressBound(static_cast<uLong>(filtered.size()));
+   std::vector<uint8_t> compressed(compressed_size);
+   if (compress2(compressed.data(), &compressed_size, filtered.data(), static_cast<uLong>(filtered.size()),
+                 Z_BEST_SPEED) != Z_OK)
+   {
+      std::cerr << "Error compressing frame " << path << std::endl;
+      return false;
+   }
+   std::ofstream ofs(path, std::ios::binary);
+   if (! ofs.good())
+   {
+      std::cerr << "Error opening " << path << std::endl;
+      return false;
+   }
+   static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+   ofs.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+   std::string ihdr;
+   put32(ihdr, static_cast<uint32_t>(image.width));
+   put32(ihdr, static_cast<uint32_t>(image.height));
+   const char ihdr_rest[] = { 8, 6, 0, 0, 0 }; // 8 bit RGBA, deflate, adaptive filtering, no interlace
+   ihdr.append(ihdr_rest, sizeof(ihdr_rest));
+   png_chunk(ofs, "IHDR", reinterpret_cast<const uint8_t*>(ihdr.data()), ihdr.size());
+   png_chunk(ofs, "IDAT", compressed.data(), compressed_size);
+   png_chunk(ofs, "IEND", nullptr, 0);
+   return ofs.good();
+}
+
+// Netpbm PAM: a short text header followed by the uncompressed RGBA rows, top first.
+bool FrameCapture::write_pam(const Image& image, const std::string& path)
+//-----------------------------------------------------------------------
+{
+   std::ofstream ofs(path, std::ios::binary);
+   if (! ofs.good())
+   {
+      std::cerr << "Error opening " << path << std::endl;
+      return false;
+   }
+   ofs << "P7\nWIDTH " << image.width << "\nHEIGHT " << image.height
+       << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+   const size_t stride = static_cast<size_t>(image.width)*4;
+   for (int y = image.height - 1; y >= 0; y--)
+      ofs.write(reinterpret_cast<const char*>(image.pixels.data() + y*stride), stride);
+   return ofs.good();
+}
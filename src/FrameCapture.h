@@ -0,0 +1,121 @@
+/*
+Copyright (c) 2017 Donald Munro
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+/*
+ * Asynchronous frame capture. Frames are read back into a ring of pixel buffer objects, each guarded by a fence,
+ * and copied out only once the GPU has finished writing them, so the render loop never waits for a readback. The
+ * copies are written to disk as numbered PNG (zlib) or raw PAM files by an encoder thread.
+ */
+#ifndef FIBERGL_FRAMECAPTURE_H
+#define FIBERGL_FRAMECAPTURE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "OGLUtils.h"
+
+class FrameCapture
+//================
+{
+public:
+   enum class Format { PNG, RAW };
+
+   FrameCapture() = default;
+   FrameCapture(const FrameCapture&) = delete;
+   FrameCapture& operator=(const FrameCapture&) = delete;
+   // Stops the encoder thread after writing the queued frames. GL objects must have been released with del.
+   ~FrameCapture() { stop(); }
+
+   /**
+    * Start the encoder thread writing frames to directory (created if necessary) as <prefix>_<frame>.png or .pam.
+    * @param ring - Number of pixel buffer objects; readbacks older than this many frames are dropped rather than
+    * waited for.
+    * @param max_queued - Frames waiting for the encoder beyond which new frames are dropped.
+    */
+   bool start(const std::string& directory, const std::string& prefix, Format format =Format::PNG, unsigned ring =3,
+              size_t max_queued =8, std::stringstream* errs =nullptr);
+
+   /**
+    * Queue a readback of the colour buffer of framebuffer (0 for the default framebuffer, read before swapping)
+    * and hand any earlier readbacks that have completed to the encoder. Never waits for the GPU. Must be called
+    * with the same context current every time.
+    * @param name - File name (without extension) in the capture directory, instead of <prefix>_<frame>.
+    */
+   void capture(GLuint framebuffer, int width, int height, const std::string& name ="");
+
+   /**
+    * If true capture waits for the oldest readback when the ring is full and for the encoder when max_queued
+    * frames are waiting, instead of dropping the frame. For batch rendering where every frame must be written.
+    */
+   void set_lossless(bool is_lossless_) { is_lossless = is_lossless_; }
+
+   // Wait for the outstanding readbacks and hand them to the encoder (context current), then release GL objects.
+   void finish();
+   void del();
+   // Stop the encoder thread once it has written the queued frames (no context needed).
+   void stop();
+
+   bool running() const { return is_running; }
+   size_t captured() const { return frames_captured; }
+   size_t written() const { return frames_written.load(); }
+   size_t dropped() const { return frames_dropped + encoder_dropped.load(); }
+
+private:
+   struct Image
+   {
+      size_t frame;
+      int width, height;
+      std::vector<uint8_t> pixels; // RGBA8, bottom row first as read by glReadPixels
+      std::string name;
+   };
+   struct Slot
+   {
+      GLuint buffer = 0;
+      GLsync fence = nullptr;
+      size_t size = 0, frame = 0;
+      int width = 0, height = 0;
+      std::string name;
+   };
+
+   std::string directory, prefix;
+   Format format = Format::PNG;
+   std::vector<Slot> slots;
+   size_t next_slot = 0, frame_number = 0, frames_captured = 0, frames_dropped = 0, max_queued = 8;
+   bool is_running = false, is_lossless = false;
+   std::thread encoder;
+   std::mutex mutex;
+   std::condition_variable queued, dequeued;
+   std::deque<Image> queue;
+   bool must_stop = false;
+   std::atomic<size_t> frames_written{0}, encoder_dropped{0};
+
+   bool poll(Slot& slot, GLuint64 timeout_ns);
+   void encode();
+   bool write_png(const Image& image, const std::string& path);
+   bool write_pam(const Image& image, const std::string& path);
+};
+#endif //FIBERGL_FRAMECAPTURE_H
@@ -27,15 +27,440 @@ SOFTWARE.
 #include <iostream>
 #include "sstream"
 #include <cstring>
+#include <cstdlib>
 #include <fstream>
 #include <memory>
 #include <limits>
 #include <thread>
 #include <exception>
 #include <algorithm>
+#include <cmath>
+#include <cctype>
 
 namespace oglfiber
 {
+   bool OGLFiberExecutor::headless_requested = false;
+   std::string OGLFiberExecutor::share_group_requested;
+
+   OGLFiberExecutor::OGLFiberExecutor()
+   //----------------------------------
+   {
+      const char* env = std::getenv("FIBERGL_HEADLESS");
+      is_headless_mode = ( (headless_requested) || ( (env != nullptr) && (std::strcmp(env, "1") == 0) ) );
+      if (is_headless_mode)
+      {
+         init_headless();
+         return;
+      }
+      if (! glfwInit())
+      {
+         std::cerr <<  "Error initializing glfw" << std::endl;
+         throw std::runtime_error("Error initializing glfw");
+      }
+      glfwSetErrorCallback(glfw_error);
+   }
+
+   OGLFiberExecutor::~OGLFiberExecutor()
+   //-----------------------------------
+   {
+      // The windows and share group root contexts are destroyed before GLFW or EGL is terminated.
+      windows.clear();
+      share_groups.clear();
+      if (! is_headless_mode)
+         glfwTerminate();
+#ifdef FIBERGL_EGL
+      else if (egl_display != EGL_NO_DISPLAY)
+         eglTerminate(egl_display);
+#endif
+   }
+
+   void OGLFiberExecutor::init_headless()
+   //------------------------------------
+   {
+#ifdef FIBERGL_EGL
+      // The Mesa surfaceless platform needs no display server or GPU (llvmpipe); otherwise use the default display.
+      const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+      if ( (client_extensions != nullptr) && (std::strstr(client_extensions, "EGL_MESA_platform_surfaceless") != nullptr) )
+      {
+         PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+               (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+         if (get_platform_display != nullptr)
+            egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+      }
+      if (egl_display == EGL_NO_DISPLAY)
+         egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+      EGLint major = 0, minor = 0;
+      if ( (egl_display == EGL_NO_DISPLAY) || (! eglInitialize(egl_display, &major, &minor)) )
+      {
+         std::cerr << "Error initializing EGL for headless rendering (" << std::hex << eglGetError() << std::dec
+                   << ")" << std::endl;
+         throw std::runtime_error("Error initializing EGL");
+      }
+      const char* extensions = eglQueryString(egl_display, EGL_EXTENSIONS);
+      is_surfaceless = ( (extensions != nullptr) && (std::strstr(extensions, "EGL_KHR_surfaceless_context") != nullptr) );
+      std::cout << "Headless EGL " << major << "." << minor << " " << eglQueryString(egl_display, EGL_VENDOR)
+                << ((is_surfaceless) ? " (surfaceless)" : " (pbuffer)") << std::endl;
+#else
+      std::cerr << "Headless rendering requires building with EGL (FIBERGL_EGL)" << std::endl;
+      throw std::runtime_error("Headless rendering requires building with EGL");
+#endif
+   }
+
+   std::shared_ptr<OGLShareGroup> OGLFiberExecutor::share_group(const std::string& name)
+   //------------------------------------------------------------------------------------
+   {
+      auto it = share_groups.find(name);
+      if (it != share_groups.end())
+         return it->second;
+      return nullptr;
+   }
+
+   std::shared_ptr<OGLShareGroup> OGLFiberExecutor::join_share_group()
+   //-----------------------------------------------------------------
+   {
+      if (share_group_requested.empty())
+         return nullptr;
+      std::shared_ptr<OGLShareGroup>& group = share_groups[share_group_requested];
+      if (! group)
+      {
+         group = std::make_shared<OGLShareGroup>(share_group_requested);
+#ifdef FIBERGL_EGL
+         group->egl_display = egl_display;
+#endif
+      }
+      return group;
+   }
+
+   OGLShareGroup::~OGLShareGroup()
+   //-----------------------------
+   {
+#ifdef FIBERGL_EGL
+      if (egl_root != EGL_NO_CONTEXT)
+         eglDestroyContext(egl_display, egl_root);
+#endif
+   }
+
+   void OGLShareGroup::purge(std::unordered_map<std::string, std::weak_ptr<const GLuint>>& objects)
+   //----------------------------------------------------------------------------------------------
+   {
+      for (auto it = objects.begin(); it != objects.end(); )
+      {
+         if (it->second.expired())
+            it = objects.erase(it);
+         else
+            ++it;
+      }
+   }
+
+   // Called with mutex held.
+   std::shared_ptr<const GLuint> OGLShareGroup::shader(const std::string& source, GLenum type, GLenum& err,
+                                                       std::stringstream *errbuf)
+   //----------------------------------------------------------------------------------------------------------
+   {
+      const std::string key = std::to_string(type) + ":" + source;
+      std::weak_ptr<const GLuint>& entry = shaders[key];
+      std::shared_ptr<const GLuint> shader = entry.lock();
+      if (shader)
+      {
+         counts.shared_shaders++;
+         return shader;
+      }
+      const GLuint name = oglutil::compile_shader(source, type, err, errbuf);
+      if (name == 0)
+      {
+         shaders.erase(key);
+         return nullptr;
+      }
+      shader = std::shared_ptr<const GLuint>(new GLuint(name), [](const GLuint* p)
+      {
+         glDeleteShader(*p);
+         delete p;
+      });
+      counts.shaders++;
+      entry = shader;
+      return shader;
+   }
+
+   // Called with mutex held.
+   std::shared_ptr<const GLuint> OGLShareGroup::link(const std::string& key,
+                                                     const std::vector<std::shared_ptr<const GLuint>>& stages,
+                                                     GLenum& err, std::stringstream *errbuf)
+   //------------------------------------------------------------------------------------------------------------
+   {
+      oglutil::clearGLErrors();
+      const GLuint name = glCreateProgram();
+      if (name == 0)
+      {
+         if (errbuf != nullptr)
+            *errbuf << "Error creating shader program.";
+         return nullptr;
+      }
+      for (const std::shared_ptr<const GLuint>& stage : stages)
+         glAttachShader(name, *stage);
+      if ( (! oglutil::isGLOk(err, errbuf)) || (! oglutil::link_shader(name, err, errbuf)) )
+      {
+         glDeleteProgram(name);
+         return nullptr;
+      }
+      // The deleter holds the shaders so that other programs using the same sources can be linked from them.
+      std::vector<std::shared_ptr<const GLuint>> owners(stages);
+      std::shared_ptr<const GLuint> program(new GLuint(name), [owners](const GLuint* p)
+      {
+         glDeleteProgram(*p);
+         delete p;
+      });
+      counts.programs++;
+      programs[key] = program;
+      return program;
+   }
+
+   std::shared_ptr<const GLuint> OGLShareGroup::program(const std::string& vertex_source,
+                                                        const std::string& fragment_source, GLenum& err,
+                                                        std::stringstream *errbuf,
+                                                        const std::string& geometry_source,
+                                                        const std::string& tess_control_source,
+                                                        const std::string& tess_eval_source)
+   //--------------------------------------------------------------------------------------------------------
+   {
+      const std::pair<const std::string*, GLenum> sources[] = { { &vertex_source, GL_VERTEX_SHADER },
+                                                                { &tess_control_source, GL_TESS_CONTROL_SHADER },
+                                                                { &tess_eval_source, GL_TESS_EVALUATION_SHADER },
+                                                                { &geometry_source, GL_GEOMETRY_SHADER },
+                                                                { &fragment_source, GL_FRAGMENT_SHADER } };
+      std::string key;
+      for (const auto& source : sources)
+         key += std::to_string(source.first->size()) + ":" + *source.first;
+      std::lock_guard<std::mutex> lock(mutex);
+      purge(programs);
+      purge(shaders);
+      auto it = programs.find(key);
+      std::shared_ptr<const GLuint> program = (it != programs.end()) ? it->second.lock() : nullptr;
+      if (program)
+      {
+         counts.shared_programs++;
+         err = GL_NO_ERROR;
+         return program;
+      }
+      std::vector<std::shared_ptr<const GLuint>> stages;
+      for (const auto& source : sources)
+      {
+         if (source.first->empty()) continue;
+         std::shared_ptr<const GLuint> stage = shader(*source.first, source.second, err, errbuf);
+         if (! stage)
+            return nullptr;
+         stages.push_back(stage);
+      }
+      return link(key, stages, err, errbuf);
+   }
+
+   std::shared_ptr<const GLuint> OGLShareGroup::compute_program(const std::string& compute_source, GLenum& err,
+                                                                std::stringstream *errbuf)
+   //---------------------------------------------------------------------------------------------------------
+   {
+      const std::string key = "compute:" + compute_source;
+      std::lock_guard<std::mutex> lock(mutex);
+      purge(programs);
+      purge(shaders);
+      auto it = programs.find(key);
+      std::shared_ptr<const GLuint> program = (it != programs.end()) ? it->second.lock() : nullptr;
+      if (program)
+      {
+         counts.shared_programs++;
+         err = GL_NO_ERROR;
+         return program;
+      }
+      std::shared_ptr<const GLuint> stage = shader(compute_source, GL_COMPUTE_SHADER, err, errbuf);
+      if (! stage)
+         return nullptr;
+      return link(key, { stage }, err, errbuf);
+   }
+
+   std::shared_ptr<const GLuint> OGLShareGroup::buffer(const void* data, size_t size)
+   //---------------------------------------------------------------------------------
+   {
+      const std::string key(static_cast<const char*>(data), size);
+      std::lock_guard<std::mutex> lock(mutex);
+      purge(buffers);
+      std::weak_ptr<const GLuint>& entry = buffers[key];
+      std::shared_ptr<const GLuint> buffer = entry.lock();
+      if (buffer)
+      {
+         counts.shared_buffers++;
+         return buffer;
+      }
+      oglutil::clearGLErrors();
+      GLuint name = 0;
+      glGenBuffers(1, &name);
+      glBindBuffer(GL_ARRAY_BUFFER, name);
+      glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      GLenum err;
+      std::stringstream errs;
+      if (! oglutil::isGLOk(err, &errs))
+      {
+         std::cerr << "Error creating shared buffer in group " << group_name << ": " << errs.str() << std::endl;
+         glDeleteBuffers(1, &name);
+         buffers.erase(key);
+         return nullptr;
+      }
+      buffer = std::shared_ptr<const GLuint>(new GLuint(name), [](const GLuint* p)
+      {
+         glDeleteBuffers(1, p);
+         delete p;
+      });
+      counts.buffers++;
+      entry = buffer;
+      return buffer;
+   }
+
+   OGLShareGroup::Stats OGLShareGroup::stats()
+   //-----------------------------------------
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      return counts;
+   }
+
+   OGLFiberWindow::~OGLFiberWindow()
+   //-------------------------------
+   {
+      std::cout << "Destroy OGLFiberWindow " << name << std::endl;
+#ifdef FIBERGL_EGL
+      if (is_headless)
+      {
+         EGLDisplay display = OGLFiberExecutor::instance().egl_display;
+         if (egl_surface != EGL_NO_SURFACE)
+            eglDestroySurface(display, egl_surface);
+         if (egl_context != EGL_NO_CONTEXT)
+            eglDestroyContext(display, egl_context);
+      }
+#endif
+   }
+
+   const void* OGLFiberWindow::context_handle()
+   //------------------------------------------
+   {
+#ifdef FIBERGL_EGL
+      if (is_headless)
+         return egl_context;
+#endif
+      return window.get();
+   }
+
+   void OGLFiberWindow::make_current()
+   //---------------------------------
+   {
+#ifdef FIBERGL_EGL
+      if (is_headless)
+      {
+         eglBindAPI(EGL_OPENGL_API); // per thread state
+         eglMakeCurrent(OGLFiberExecutor::instance().egl_display, egl_surface, egl_surface, egl_context);
+         return;
+      }
+#endif
+      glfwMakeContextCurrent(window.get());
+   }
+
+   void OGLFiberWindow::release_current()
+   //------------------------------------
+   {
+#ifdef FIBERGL_EGL
+      if (is_headless)
+      {
+         eglMakeCurrent(OGLFiberExecutor::instance().egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+         return;
+      }
+#endif
+      glfwMakeContextCurrent(nullptr);
+   }
+
+   bool OGLFiberWindow::should_close()
+   //---------------------------------
+   {
+      if (is_headless)
+         return false; // ends when the executor stops
+      return glfwWindowShouldClose(window.get());
+   }
+
+   bool OGLFiberWindow::create_headless(std::stringstream* errs)
+   //-----------------------------------------------------------
+   {
+      is_headless = true;
+#ifdef FIBERGL_EGL
+      OGLFiberExecutor& executor = OGLFiberExecutor::instance();
+      if ( (width <= 0) || (height <= 0) )
+      {
+         if (errs)
+            *errs << "Headless window " << name << " requires a width and height" << std::endl;
+         return false;
+      }
+      eglBindAPI(EGL_OPENGL_API);
+      // Rendering is into framebuffer objects, the pbuffer (if any) is only there to make the context current.
+      const EGLint config_attributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+                                           EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8,
+                                           EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE };
+      EGLConfig config;
+      EGLint configs = 0;
+      if ( (! eglChooseConfig(executor.egl_display, config_attributes, &config, 1, &configs)) || (configs < 1) )
+      {
+         if (errs)
+            *errs << "No EGL OpenGL config for headless window " << name << std::endl;
+         return false;
+      }
+#ifdef GL_ERROR_POLL
+      const EGLint context_flags = EGL_CONTEXT_OPENGL_DEBUG_BIT_KHR;
+#else
+      const EGLint context_flags = 0;
+#endif
+      const EGLint context_attributes[] = { EGL_CONTEXT_MAJOR_VERSION_KHR, ogl_major,
+                                            EGL_CONTEXT_MINOR_VERSION_KHR, ogl_minor,
+                                            EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR,
+                                            EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+                                            EGL_CONTEXT_FLAGS_KHR, context_flags, EGL_NONE };
+      EGLContext share_context = EGL_NO_CONTEXT;
+      if (group)
+      {
+         if (group->egl_root == EGL_NO_CONTEXT)
+         {
+            group->egl_root = eglCreateContext(executor.egl_display, config, EGL_NO_CONTEXT, context_attributes);
+            if (group->egl_root == EGL_NO_CONTEXT)
+            {
+               if (errs)
+                  *errs << "Error creating EGL root context for share group " << group->name() << " ("
+                        << std::hex << eglGetError() << std::dec << ")" << std::endl;
+               return false;
+            }
+         }
+         share_context = group->egl_root;
+      }
+      egl_context = eglCreateContext(executor.egl_display, config, share_context, context_attributes);
+      if (egl_context == EGL_NO_CONTEXT)
+      {
+         if (errs)
+            *errs << "Error creating EGL OpenGL " << ogl_major << "." << ogl_minor << " context for " << name
+                  << " (" << std::hex << eglGetError() << std::dec << ")" << std::endl;
+         return false;
+      }
+      if (! executor.is_surfaceless)
+      {
+         const EGLint pbuffer_attributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+         egl_surface = eglCreatePbufferSurface(executor.egl_display, config, pbuffer_attributes);
+         if (egl_surface == EGL_NO_SURFACE)
+         {
+            if (errs)
+               *errs << "Error creating EGL pbuffer for " << name << std::endl;
+            eglDestroyContext(executor.egl_display, egl_context);
+            egl_context = EGL_NO_CONTEXT;
+            return false;
+         }
+      }
+      return true;
+#else
+      if (errs)
+         *errs << "Headless rendering requires building with EGL (FIBERGL_EGL)" << std::endl;
+      return false;
+#endif
+   }
+
    void OGLFiberExecutor::glfw_error(int err, const char* errmess)
    //--------------------------------------------------------------
    {
@@ -51,33 +476,501 @@ namespace oglfiber
    void OGLFiberWindow::run()
    //-----------------------------------------
    {
-      GLFWwindow* win = window.get();
-      TimeType last_timestamp = std::chrono::high_resolution_clock::now();
-      while (! glfwWindowShouldClose(win))
+      TimeType deadline = std::chrono::steady_clock::now(), last_frame = deadline;
+      bool was_rendered = false;
+      while (! should_close())
       {
          if ( (parent != nullptr) && (parent->is_stopping()) )
             break;
+         if ( (is_capture_stop) && (capture) )
+            end_capture();
+
+         const TimeType frame_start = std::chrono::steady_clock::now();
+         if (! is_pooled)
+            dispatch_events();
+         if (is_resize_pending)
+            resize();
+         const bool is_rendered = ( (! is_on_demand) || (is_dirty.exchange(false)) );
+         if (is_rendered)
+         {
+            std::unique_lock<std::mutex> events_lock = OGLFiberExecutor::lock_events(this);
+            make_current();
+            if (is_profiling)
+               profiler.begin_frame();
+            is_offscreen = begin_render();
+            if (! on_render())
+            {
+               release_current();
+               if (events_lock.owns_lock())
+                  events_lock.unlock();
+               end_capture();
+               if (parent != nullptr)
+                  parent->stop();
+               return;
+            }
+            if (is_offscreen)
+               end_render();
+            if (is_profiling)
+               profiler.end_frame();
+            if (capture)
+               capture->capture((is_headless) ? render_target() : 0, width, height);
+            if (events_lock.owns_lock())
+               events_lock.unlock(); // not held while the swap waits
+            if (is_headless)
+               glFlush();
+            else
+               glfwSwapBuffers(window.get());
+            release_current();
+         }
+         if (is_pacing_reset)
+         {
+            pacing = PacingStats();
+            interval_m2 = 0;
+            is_pacing_reset = false;
+            was_rendered = false;
+            deadline = frame_start;
+         }
+         if (is_rendered)
+         {
+            const double late_ms = std::chrono::duration<double, std::milli>(frame_start - deadline).count();
+            pacing.max_late_ms = std::max(pacing.max_late_ms, late_ms);
+            if (was_rendered)
+            {
+               const double interval_ms = std::chrono::duration<double, std::milli>(frame_start - last_frame).count();
+               const double delta = interval_ms - pacing.mean_interval_ms;
+               pacing.frames++;
+               pacing.mean_interval_ms += delta / pacing.frames;
+               interval_m2 += delta*(interval_ms - pacing.mean_interval_ms);
+               pacing.jitter_ms = std::sqrt(interval_m2 / pacing.frames);
+            }
+            last_frame = frame_start;
+         }
+         was_rendered = is_rendered;
+         // Events are polled by the executor's fiber (see OGLFiberExecutor::run), which wakes an idle window when
+         // it has an event for it.
+         if ( (is_on_demand) && (! is_dirty.load()) )
+         {
+            wait_redraw();
+            // The wait is not a missed frame, pacing restarts from when the window next has something to render.
+            deadline = std::chrono::steady_clock::now();
+            was_rendered = false;
+            continue;
+         }
+         pace(deadline, is_rendered);
+      }
+      end_capture();
+      OGLFiberExecutor::instance().running--;
+   }
 
-         glfwMakeContextCurrent(win);
-         TimeType timestamp = std::chrono::high_resolution_clock::now();
-         if (! on_render())
+   // Advances deadline to the start of the next frame and sleeps until it. Deadlines are a whole number of periods
+   // from the first, so the sleep absorbs the time spent rendering and late frames do not accumulate drift. Periods
+   // that have already passed when a rendered frame ends are skipped rather than rendered late back to back.
+   void OGLFiberWindow::pace(TimeType& deadline, bool is_rendered)
+   //-------------------------------------------------------------
+   {
+      long period_ns = frame_period_ns();
+      if (period_ns == 0)
+      {
+         if (is_rendered)
          {
-            if (parent != nullptr)
-               parent->stop();
+            // Paced by the vertical blank wait in the swap
+            deadline = std::chrono::steady_clock::now();
+            boost::this_fiber::yield();
             return;
          }
-         glfwSwapBuffers(win);
-         glfwMakeContextCurrent(nullptr);
+         period_ns = 1000000000L / refresh_hz; // nothing to swap, check again next refresh
+      }
+      const std::chrono::nanoseconds period(period_ns);
+      deadline += period;
+      const TimeType now = std::chrono::steady_clock::now();
+      if (now - deadline >= period)
+      {
+         const auto missed = (now - deadline) / period;
+         deadline += missed*period;
+         if (is_rendered)
+            pacing.skipped += static_cast<size_t>(missed);
+      }
+      if (deadline > now)
+         boost::this_fiber::sleep_until(deadline);
+      else
+         boost::this_fiber::yield();
+   }
+
+   // The period of frame deadlines: the frame rate, limited to the refresh rate for vsync windows paced by the
+   // executor, or 0 for the window on a thread whose buffer swap waits for the vertical blank unless the frame
+   // rate is lower than the refresh rate (see OGLFiberExecutor::configure_presentation).
+   long OGLFiberWindow::frame_period_ns()
+   //------------------------------------
+   {
+      if (! is_refresh_paced)
+         return fps_ns;
+      const long refresh_ns = 1000000000L / refresh_hz;
+      if (is_vsync_leader)
+         return (fps_ns > refresh_ns) ? fps_ns : 0;
+      return std::max(fps_ns, refresh_ns);
+   }
+
+   // Calls on_resized for a resize deferred by the executor's size callback (see is_pooled).
+   void OGLFiberWindow::resize()
+   //---------------------------
+   {
+      std::lock_guard<std::mutex> lock(event_mutex);
+      is_resize_pending = false;
+      make_current();
+      on_resized(width, height);
+      release_current();
+   }
+
+   // Queues an event from a GLFW callback. Consecutive cursor movements and resizes are merged as only the last
+   // position or size matters.
+   void OGLFiberWindow::queue_event(const WindowEvent& event)
+   //--------------------------------------------------------
+   {
+      if ( (! event_queue.empty()) && (event_queue.back().type == event.type) &&
+           ( (event.type == WindowEvent::CURSOR) || (event.type == WindowEvent::SIZE) ) )
+         event_queue.back() = event;
+      else
+         event_queue.push_back(event);
+   }
+
+   // Calls the handlers for the queued events, from the window's fiber or for a window rendering on a pool thread
+   // from the event pump holding event_mutex, so handlers can call GLFW functions that are restricted to the main
+   // thread (eg glfwSetCursor).
+   void OGLFiberWindow::dispatch_events()
+   //------------------------------------
+   {
+      if (event_queue.empty())
+         return;
+      dispatched_events.swap(event_queue);
+      for (const WindowEvent& event : dispatched_events)
+      {
+         switch (event.type)
+         {
+            case WindowEvent::KEY:
+               key_queue.emplace(event.a, event.b, event.c, event.d);
+               if (key_queue.size() > OGLFiberExecutor::MAX_KEYBUF_SIZE)
+                  key_queue.pop();
+               break;
+            case WindowEvent::SIZE:
+               width = event.a;
+               height = event.b;
+               if (is_pooled)
+                  is_resize_pending = true; // the context may be current on the window's thread
+               else
+               {
+                  make_current();
+                  on_resized(width, height);
+                  release_current();
+               }
+               break;
+            case WindowEvent::FOCUS:
+               on_focus(event.a == GLFW_TRUE);
+               break;
+            case WindowEvent::CURSOR:
+               onCursorUpdate(event.x, event.y);
+               break;
+            case WindowEvent::BUTTON:
+               on_mouse_click(event.a, event.b, event.c);
+               break;
+            case WindowEvent::SCROLL:
+               on_mouse_scroll(event.x, event.y);
+               break;
+         }
+      }
+      dispatched_events.clear();
+   }
+
+   // Blocks the window's fiber until request_redraw is called or an event that does not need a redraw (cursor
+   // movement) is queued for it to dispatch, checking for close and stop() every IDLE_WAIT_SECONDS.
+   void OGLFiberWindow::wait_redraw()
+   //--------------------------------
+   {
+      std::unique_lock<boost::fibers::mutex> lock(wake_mutex);
+      const std::chrono::milliseconds timeout(static_cast<long>(OGLFiberExecutor::IDLE_WAIT_SECONDS*1000));
+      wake_condition.wait_for(lock, timeout, [this]()
+      {
+         return ( (is_dirty.load()) || ( (! is_pooled) && (! event_queue.empty()) ) ||
+                  ( (parent != nullptr) && (parent->is_stopping()) ) );
+      });
+   }
+
+   bool OGLFiberWindow::start_capture(const std::string& directory, FrameCapture::Format format)
+   //------------------------------------------------------------------------------------------
+   {
+      if (capturing())
+      {
+         std::cerr << "Window " << name << " is already capturing" << std::endl;
+         return false;
+      }
+      std::string prefix = (name.empty()) ? "frame" : name;
+      std::replace_if(prefix.begin(), prefix.end(), [](char ch) { return (! std::isalnum(ch)); }, '_');
+      std::unique_ptr<FrameCapture> frame_capture(new FrameCapture);
+      std::stringstream errs;
+      if (! frame_capture->start(directory, prefix, format, 3, 8, &errs))
+      {
+         std::cerr << errs.str() << std::endl;
+         return false;
+      }
+      is_capture_stop = false;
+      capture = std::move(frame_capture);
+      request_redraw();
+      return true;
+   }
+
+   // Writes the outstanding frames and stops the encoder. Called with no context current.
+   void OGLFiberWindow::end_capture()
+   //--------------------------------
+   {
+      is_capture_stop = false;
+      if (! capture) return;
+      make_current();
+      capture->finish();
+      release_current();
+      capture->stop();
+      capture.reset();
+   }
+
+   // Upscales the offscreen target to the window with a full screen triangle.
+   static const char* OFFSCREEN_VERTEX_GLSL = R"(#version 330 core
+uniform vec2 uvScale;
+out vec2 uv;
+void main()
+{
+   vec2 p = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+   uv = p*uvScale;
+   gl_Position = vec4(p*2.0 - 1.0, 0.0, 1.0);
+}
+)";
+
+   static const char* OFFSCREEN_FRAGMENT_GLSL = R"(#version 330 core
+uniform sampler2D image;
+uniform vec2 uvMax;
+in vec2 uv;
+out vec4 color;
+void main()
+{
+   color = texture(image, min(uv, uvMax)); // do not filter in texels outside the rendered area
+}
+)";
+
+   bool OGLFiberWindow::begin_render()
+   //---------------------------------
+   {
+      // Headless windows always render offscreen, at full resolution as there is nothing to upscale to.
+      const bool is_dynamic = ( (resolution_target_ms > 0) && (! is_headless) );
+      if ( ( (! is_dynamic) && (! is_headless) ) || (offscreen_failed) || (width <= 0) || (height <= 0) )
+      {
+         render_width = width;
+         render_height = height;
+         return false;
+      }
+      if ( (! offscreen_unit) || (offscreen_width != width) || (offscreen_height != height) )
+      {
+         if (! init_offscreen())
+         {
+            std::cerr << ((is_headless) ? "No offscreen framebuffer for headless window "
+                                        : "Dynamic resolution disabled for ") << name << std::endl;
+            offscreen_failed = true;
+            render_width = width;
+            render_height = height;
+            glViewport(0, 0, width, height);
+            return false;
+         }
+      }
+      render_scale = (is_dynamic) ? std::max(std::min(render_scale, 1.0f), min_resolution_scale) : 1.0f;
+      render_width = std::max(static_cast<int>(std::lround(width*render_scale)), 1);
+      render_height = std::max(static_cast<int>(std::lround(height*render_scale)), 1);
+      glBindFramebuffer(GL_FRAMEBUFFER, offscreen_unit("FBO_TARGET"));
+      glViewport(0, 0, render_width, render_height);
+      // GL_TIMESTAMP rather than GL_TIME_ELAPSED, which subclasses may use and cannot be nested.
+      if ( (is_dynamic) && (! frame_query_pending[frame_query]) )
+         glQueryCounter(frame_queries[frame_query][0], GL_TIMESTAMP);
+      return true;
+   }
+
+   void OGLFiberWindow::end_render()
+   //-------------------------------
+   {
+      if (is_headless)
+         return; // the frame stays in render_target()
+      if (! frame_query_pending[frame_query])
+      {
+         glQueryCounter(frame_queries[frame_query][1], GL_TIMESTAMP);
+         frame_query_pending[frame_query] = true;
+      }
+      frame_query = (frame_query + 1) % FRAME_QUERY_RING;
+      update_render_scale();
+
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      glViewport(0, 0, width, height);
+      const GLboolean is_depth = glIsEnabled(GL_DEPTH_TEST), is_blend = glIsEnabled(GL_BLEND);
+      glDisable(GL_DEPTH_TEST);
+      glDisable(GL_BLEND);
+      offscreen_unit.activate();
+      glUniform2f(offscreen_unit.uniform("uvScale"), static_cast<float>(render_width)/offscreen_width,
+                  static_cast<float>(render_height)/offscreen_height);
+      glUniform2f(offscreen_unit.uniform("uvMax"), (render_width - 0.5f)/offscreen_width,
+                  (render_height - 0.5f)/offscreen_height);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, offscreen_unit("TEX_COLOR"));
+      glBindVertexArray(offscreen_unit("VAO_UPSCALE"));
+      glDrawArrays(GL_TRIANGLES, 0, 3);
+      glBindVertexArray(0);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glUseProgram(0);
+      if (is_depth) glEnable(GL_DEPTH_TEST);
+      if (is_blend) glEnable(GL_BLEND);
+   }
+
+   void OGLFiberWindow::update_render_scale()
+   //----------------------------------------
+   {
+      // Oldest query in the ring; not waited on if the GPU has not finished with it yet.
+      const size_t oldest = frame_query;
+      if (! frame_query_pending[oldest]) return;
+      GLint is_available = GL_FALSE;
+      glGetQueryObjectiv(frame_queries[oldest][1], GL_QUERY_RESULT_AVAILABLE, &is_available);
+      if (is_available == GL_FALSE) return;
+      GLuint64 start = 0, end = 0;
+      glGetQueryObjectui64v(frame_queries[oldest][0], GL_QUERY_RESULT, &start);
+      glGetQueryObjectui64v(frame_queries[oldest][1], GL_QUERY_RESULT, &end);
+      frame_query_pending[oldest] = false;
+      const float ms = (end - start) / 1000000.0f;
+      if ( (ms <= 0) || (end < start) ) return;
+      // Cost is roughly proportional to pixels, ie the square of the scale. Move part of the way to the
+      // estimate as the measurement is a few frames old, and ignore small changes to avoid oscillating.
+      const float estimate = render_scale*std::sqrt(resolution_target_ms/ms);
+      float scale = render_scale + 0.5f*(estimate - render_scale);
+      scale = std::max(std::min(scale, 1.0f), min_resolution_scale);
+      if (std::fabs(scale - render_scale) >= 0.02f)
+         render_scale = scale;
+   }
+
+   bool OGLFiberWindow::init_offscreen()
+   //-----------------------------------
+   {
+      oglutil::clearGLErrors();
+      if (! offscreen_unit)
+      {
+         GLenum err = link_program(offscreen_unit, OFFSCREEN_VERTEX_GLSL, OFFSCREEN_FRAGMENT_GLSL, &offscreen_unit.log);
+         if (! offscreen_unit)
+         {
+            std::cerr << "Error linking upscale shaders: " << err << ": " << offscreen_unit.log.str() << std::endl;
+            offscreen_unit.del();
+            return false;
+         }
+         offscreen_unit.resolve_uniforms();
+         offscreen_unit.activate();
+         glUniform1i(offscreen_unit.uniform("image"), 0);
+         glUseProgram(0);
+         glGenVertexArrays(1, &offscreen_unit("VAO_UPSCALE"));
+         glGenQueries(FRAME_QUERY_RING*2, &frame_queries[0][0]);
+         std::fill(frame_query_pending, frame_query_pending + FRAME_QUERY_RING, false);
+      }
+      if (offscreen_unit("FBO_TARGET") != 0)
+      {
+         glDeleteFramebuffers(1, &offscreen_unit("FBO_TARGET"));
+         glDeleteTextures(1, &offscreen_unit("TEX_COLOR"));
+         glDeleteRenderbuffers(1, &offscreen_unit("RBO_DEPTH"));
+      }
+      // Allocated at the window size so that changing the scale only changes the viewport.
+      offscreen_width = width;
+      offscreen_height = height;
+      glGenTextures(1, &offscreen_unit("TEX_COLOR"));
+      glBindTexture(GL_TEXTURE_2D, offscreen_unit("TEX_COLOR"));
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glGenRenderbuffers(1, &offscreen_unit("RBO_DEPTH"));
+      glBindRenderbuffer(GL_RENDERBUFFER, offscreen_unit("RBO_DEPTH"));
+      glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+      glBindRenderbuffer(GL_RENDERBUFFER, 0);
+      glGenFramebuffers(1, &offscreen_unit("FBO_TARGET"));
+      glBindFramebuffer(GL_FRAMEBUFFER, offscreen_unit("FBO_TARGET"));
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, offscreen_unit("TEX_COLOR"), 0);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER,
+                                offscreen_unit("RBO_DEPTH"));
+      const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      GLenum err;
+      std::stringstream errs;
+      if ( (status != GL_FRAMEBUFFER_COMPLETE) || (! oglutil::isGLOk(err, &errs)) )
+      {
+         std::cerr << "Error creating offscreen framebuffer (status " << std::hex << status << std::dec << "): "
+                   << errs.str() << std::endl;
+         offscreen_unit.del();
+         glDeleteQueries(FRAME_QUERY_RING*2, &frame_queries[0][0]);
+         return false;
+      }
+      return true;
+   }
+
+   void OGLFiberWindow::request_redraw()
+   //-----------------------------------
+   {
+      if (is_dirty.exchange(true))
+         return;
+      wake();
+      if ( (parent != nullptr) && (parent->is_waiting.load()) )
+         glfwPostEmptyEvent();
+   }
+
+   void OGLFiberWindow::wake()
+   //-------------------------
+   {
+      {
+         // Locked so the notification cannot fall between wait_redraw checking its condition and waiting.
+         std::lock_guard<boost::fibers::mutex> lock(wake_mutex);
+      }
+      wake_condition.notify_all();
+   }
+
+   bool OGLFiberExecutor::is_idle()
+   //------------------------------
+   {
+      for (const std::shared_ptr<OGLFiberWindow>& window : windows)
+      {
+         if ( (! window->is_on_demand) || (window->is_dirty.load()) )
+            return false;
+      }
+      return (! windows.empty());
+   }
+
+   void OGLFiberExecutor::wait_events()
+   //----------------------------------
+   {
+      // is_waiting is set before checking again so that a request_redraw from another thread in between posts an
+      // empty event and the wait returns immediately.
+      if (is_headless_mode)
+      {
+         boost::this_fiber::sleep_for(std::chrono::milliseconds(static_cast<long>(IDLE_WAIT_SECONDS*1000)));
+         return;
+      }
+      is_waiting.store(true);
+      if ( (is_idle()) && (! must_stop.load()) )
+         glfwWaitEventsTimeout(IDLE_WAIT_SECONDS);
+      else
          glfwPollEvents();
-         last_timestamp = timestamp;
-         long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(timestamp - last_timestamp).count();
-         long dozetime = fps_ns - elapsed;
-         if (dozetime > 0)
-            boost::this_fiber::sleep_for(std::chrono::nanoseconds(dozetime));
-         else
-            boost::this_fiber::yield();
+      is_waiting.store(false);
+   }
+
+   // Event polling interval: the shortest frame period of the windows that are rendering (the refresh period for
+   // those paced by the vertical blank wait), at most MAX_TICK_NS.
+   long OGLFiberExecutor::tick_ns()
+   //------------------------------
+   {
+      long tick = MAX_TICK_NS;
+      for (const std::shared_ptr<OGLFiberWindow>& window : windows)
+      {
+         if ( (window->is_on_demand) && (! window->is_dirty.load()) )
+            continue;
+         const long period = window->frame_period_ns();
+         tick = std::min(tick, (period > 0) ? period : 1000000000L / window->refresh_hz);
       }
-      OGLFiberExecutor::instance().running--;
+      return tick;
    }
 
    //Stuff that must be done on the main thread
@@ -85,6 +978,8 @@ namespace oglfiber
    //----------------------------------------------------------
    {
       window->parent = this;
+      if (window->is_headless)
+         return; // no events
       std::stringstream errs;
       if (! window->window)
       {
@@ -100,7 +995,13 @@ namespace oglfiber
       glfwSetMouseButtonCallback(win, glfw_on_button);
       glfwSetScrollCallback(win, glfw_on_scroll_wheel);
       glfwGetFramebufferSize(win, &window->width, &window->height);
+      // Windowed mode windows are assumed to be on the primary monitor.
+      GLFWmonitor* monitor = (window->monitor != nullptr) ? window->monitor : glfwGetPrimaryMonitor();
+      const GLFWvidmode* mode = (monitor != nullptr) ? glfwGetVideoMode(monitor) : nullptr;
+      if ( (mode != nullptr) && (mode->refreshRate > 0) )
+         window->refresh_hz = mode->refreshRate;
       glfwSetWindowCloseCallback(win, &glfw_on_close);
+      glfwSetWindowRefreshCallback(win, &glfw_on_refresh);
    }
 
    bool OGLFiberExecutor::start(std::initializer_list<OGLFiberWindow *> windows_, bool is_threaded)
@@ -136,51 +1037,112 @@ namespace oglfiber
 
    std::unordered_map<GLFWwindow*, OGLFiberWindow*> OGLFiberExecutor::window_lookup;
 
-   void OGLFiberExecutor::run()
-   //---------------------------
+   void OGLFiberExecutor::initialize(OGLFiberWindow* window)
+   //------------------------------------------------------
    {
-      for (const std::shared_ptr<OGLFiberWindow>& window : windows)
-      {
-         GLFWwindow* win = window->window.get();
-         glfwMakeContextCurrent(win);
+      GLFWwindow* win = window->window.get();
+      window->make_current();
 #ifdef USE_GLEW
-         if (glewInit() != GLEW_OK)
-         {
-            std::cerr <<  "Error initializing GLEW" << std::endl;
-            throw std::runtime_error("Error initializing GLEW");
-         }
+      const GLenum glew_status = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+      // GLEW built for GLX loads the GL entry points and then fails looking for a GLX display
+      const bool is_glew_ok = ( (glew_status == GLEW_OK) ||
+                                ( (is_headless_mode) && (glew_status == GLEW_ERROR_NO_GLX_DISPLAY) ) );
+#else
+      const bool is_glew_ok = (glew_status == GLEW_OK);
+#endif
+      if (! is_glew_ok)
+      {
+         std::cerr <<  "Error initializing GLEW" << std::endl;
+         throw std::runtime_error("Error initializing GLEW");
+      }
 #endif
 #ifdef USE_GLAD
-         if (!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress))
-         {
-            std::cerr << "Error initializing GLAD" << std::endl;
-            throw std::runtime_error("Error initializing GLAD");
-         }
+#ifdef FIBERGL_EGL
+      GLADloadproc loader = (is_headless_mode) ? (GLADloadproc) eglGetProcAddress : (GLADloadproc) glfwGetProcAddress;
+#else
+      GLADloadproc loader = (GLADloadproc) glfwGetProcAddress;
 #endif
-         std::cout << "OpenGL: " << ((const char *)glGetString(GL_VENDOR)) << " "
-                   << ((const char *)glGetString(GL_RENDERER)) << " "
-                   << ((const char *)glGetString(GL_VERSION)) << " (GLSL "
-                   << ((const char *)glGetString(GL_SHADING_LANGUAGE_VERSION)) << ")\n";
-         window->on_initialize(win);
-         window->on_resized(window->width, window->height);
-         glfwMakeContextCurrent(nullptr);
+      if (! gladLoadGLLoader(loader))
+      {
+         std::cerr << "Error initializing GLAD" << std::endl;
+         throw std::runtime_error("Error initializing GLAD");
+      }
+#endif
+      std::cout << "OpenGL: " << ((const char *)glGetString(GL_VENDOR)) << " "
+                << ((const char *)glGetString(GL_RENDERER)) << " "
+                << ((const char *)glGetString(GL_VERSION)) << " (GLSL "
+                << ((const char *)glGetString(GL_SHADING_LANGUAGE_VERSION)) << ")\n";
+#ifdef GL_ERROR_POLL
+      const bool is_synchronous_debug = true;
+#else
+      const bool is_synchronous_debug = false;
+#endif
+      if (! oglutil::enable_debug_output(window->name.c_str(), is_synchronous_debug))
+         std::cerr << "OpenGL debug output not supported, GL errors will not be reported for " << window->name
+                   << std::endl;
+      window->on_initialize(win);
+      window->on_resized(window->width, window->height);
+      window->release_current();
+   }
 
+   void OGLFiberExecutor::run()
+   //---------------------------
+   {
+      if ( (pool_size > 1) && (windows.size() > 1) )
+      {
+         run_pool();
+         return;
+      }
+      std::vector<OGLFiberWindow*> thread_windows;
+      for (const std::shared_ptr<OGLFiberWindow>& window : windows)
+      {
+         initialize(window.get());
+         thread_windows.push_back(window.get());
+      }
+      configure_presentation(thread_windows);
+      for (const std::shared_ptr<OGLFiberWindow>& window : windows)
+      {
          boost::fibers::fiber* pfiber = new boost::fibers::fiber(std::bind(&OGLFiberWindow::run, window));
          std::shared_ptr<boost::fibers::fiber> fiber(pfiber);
-         fiber->detach();
          fibers.push_back(fiber);
 
    //      fibers.emplace_back(std::bind(&OGLWindow::run, window));
       }
 
+      // This fiber is the event pump. It polls once per tick and the callbacks queue each event for its window,
+      // which dispatches it from its own fiber before it next renders.
       must_stop.store(false);
+      TimeType tick = std::chrono::steady_clock::now();
       while (! must_stop.load())
-         boost::this_fiber::sleep_for(std::chrono::milliseconds(300));
+      {
+         if ( (is_headless_mode) || (is_idle()) )
+         {
+            wait_events();
+            boost::this_fiber::yield(); // let the windows woken by the events dispatch them
+            tick = std::chrono::steady_clock::now();
+            continue;
+         }
+         glfwPollEvents();
+         tick += std::chrono::nanoseconds(tick_ns());
+         const TimeType now = std::chrono::steady_clock::now();
+         if (tick < now)
+            tick = now;
+         boost::this_fiber::sleep_until(tick);
+      }
+      // Windows idle in wait_redraw are woken so every window ends its capture before on_exit.
       for (const std::shared_ptr<OGLFiberWindow>& window : windows)
       {
-         glfwSetWindowShouldClose(window->window.get(), GLFW_TRUE);
-         boost::this_fiber::yield();
+         if (window->window)
+            glfwSetWindowShouldClose(window->window.get(), GLFW_TRUE);
+         window->wake();
+      }
+      for (const std::shared_ptr<boost::fibers::fiber>& fiber : fibers)
+      {
+         if (fiber->joinable())
+            fiber->join();
       }
+      fibers.clear();
       for (const std::shared_ptr<OGLFiberWindow>& window : windows)
       {
          window->on_exit();
@@ -188,6 +1150,127 @@ namespace oglfiber
       }
    }
 
+   // Windows of a share group stay together, otherwise each window goes to the thread with the fewest windows.
+   std::vector<std::vector<OGLFiberWindow*>> OGLFiberExecutor::assign_threads()
+   //--------------------------------------------------------------------------
+   {
+      std::vector<std::vector<OGLFiberWindow*>> units;
+      std::unordered_map<const OGLShareGroup*, size_t> group_unit;
+      for (const std::shared_ptr<OGLFiberWindow>& window : windows)
+      {
+         const OGLShareGroup* group = window->share_group();
+         if (group == nullptr)
+         {
+            units.push_back({ window.get() });
+            continue;
+         }
+         auto it = group_unit.find(group);
+         if (it == group_unit.end())
+         {
+            group_unit[group] = units.size();
+            units.push_back({ window.get() });
+         }
+         else
+            units[it->second].push_back(window.get());
+      }
+      std::stable_sort(units.begin(), units.end(),
+                       [](const std::vector<OGLFiberWindow*>& a, const std::vector<OGLFiberWindow*>& b)
+                       { return a.size() > b.size(); });
+      std::vector<std::vector<OGLFiberWindow*>> threads(std::min<size_t>(pool_size, units.size()));
+      for (const std::vector<OGLFiberWindow*>& unit : units)
+      {
+         auto least = std::min_element(threads.begin(), threads.end(),
+                                       [](const std::vector<OGLFiberWindow*>& a, const std::vector<OGLFiberWindow*>& b)
+                                       { return a.size() < b.size(); });
+         least->insert(least->end(), unit.begin(), unit.end());
+      }
+      return threads;
+   }
+
+   void OGLFiberExecutor::run_pool()
+   //--------------------------------
+   {
+      // Initialised here, as GLFW input functions (eg glfwSetInputMode in on_initialize) must be called on the
+      // main thread, then each window renders on its thread with the context released here.
+      for (const std::shared_ptr<OGLFiberWindow>& window : windows)
+      {
+         initialize(window.get());
+         window->is_pooled = true;
+      }
+      must_stop.store(false);
+      const std::vector<std::vector<OGLFiberWindow*>> assigned = assign_threads();
+      for (const std::vector<OGLFiberWindow*>& thread_windows : assigned)
+      {
+         configure_presentation(thread_windows);
+         pool.emplace_back([thread_windows]()
+         {
+            std::vector<boost::fibers::fiber> window_fibers;
+            for (OGLFiberWindow* window : thread_windows)
+               window_fibers.emplace_back(&OGLFiberWindow::run, window);
+            for (boost::fibers::fiber& fiber : window_fibers)
+               fiber.join();
+         });
+      }
+      std::cout << "Rendering " << windows.size() << " windows on " << pool.size() << " threads" << std::endl;
+
+      // Events are dispatched here as they arrive, stop() posts an empty event to end the wait.
+      while (! must_stop.load())
+      {
+         if (is_headless_mode)
+            boost::this_fiber::sleep_for(std::chrono::milliseconds(static_cast<long>(IDLE_WAIT_SECONDS*1000)));
+         else
+            glfwWaitEventsTimeout(IDLE_WAIT_SECONDS);
+         for (const std::shared_ptr<OGLFiberWindow>& window : windows)
+         {
+            if (! window->event_queue.empty())
+            {
+               std::unique_lock<std::mutex> lock = lock_events(window.get());
+               window->dispatch_events();
+            }
+         }
+      }
+      for (const std::shared_ptr<OGLFiberWindow>& window : windows)
+      {
+         if (window->window)
+            glfwSetWindowShouldClose(window->window.get(), GLFW_TRUE);
+         window->wake();
+      }
+      for (std::thread& thread : pool)
+         thread.join();
+      pool.clear();
+      for (const std::shared_ptr<OGLFiberWindow>& window : windows)
+         window->on_exit();
+   }
+
+   // The first vsync window on the thread waits for the vertical blank when it swaps, so the thread's other vsync
+   // windows, which render in the time between, can swap without waiting and be paced at the refresh rate (see
+   // OGLFiberWindow::frame_period_ns). Called on the executor's thread with no context current.
+   void OGLFiberExecutor::configure_presentation(const std::vector<OGLFiberWindow*>& thread_windows)
+   //----------------------------------------------------------------------------------------------
+   {
+      bool has_leader = false;
+      for (OGLFiberWindow* window : thread_windows)
+      {
+         if (window->is_headless)
+            continue;
+         window->is_vsync_leader = ( (window->is_vsync) && (is_vsync_pacing) && (! has_leader) );
+         window->is_refresh_paced = ( (window->is_vsync) && (is_vsync_pacing) );
+         has_leader = ( (has_leader) || (window->is_vsync_leader) );
+         window->interval = ( (window->is_vsync) && ( (window->is_vsync_leader) || (! is_vsync_pacing) ) ) ? 1 : 0;
+         window->make_current();
+         glfwSwapInterval(window->interval);
+         window->release_current();
+      }
+   }
+
+   std::unique_lock<std::mutex> OGLFiberExecutor::lock_events(OGLFiberWindow* window)
+   //--------------------------------------------------------------------------------
+   {
+      if (window->is_pooled)
+         return std::unique_lock<std::mutex>(window->event_mutex);
+      return std::unique_lock<std::mutex>();
+   }
+
    void OGLFiberExecutor::glfw_on_key(GLFWwindow* win, int key, int scancode, int action, int modifier)
    //---------------------------------------------------------------------------------------------------
    {
@@ -195,9 +1278,8 @@ namespace oglfiber
       if (it != window_lookup.end())
       {
          OGLFiberWindow* window = it->second;
-         window->key_queue.emplace(key, scancode, action, modifier);
-         if (window->key_queue.size() > MAX_KEYBUF_SIZE)
-            window->key_queue.pop();
+         window->queue_event(WindowEvent(WindowEvent::KEY, key, scancode, action, modifier));
+         window->request_redraw();
       }
    }
 
@@ -209,11 +1291,8 @@ namespace oglfiber
       {
          OGLFiberWindow* window = it->second;
          //glfwGetFramebufferSize(win, &window.width, &window.height);
-         window->width = width;
-         window->height = height;
-         glfwMakeContextCurrent(win);
-         window->on_resized(width, height);
-         glfwMakeContextCurrent(nullptr);
+         window->queue_event(WindowEvent(WindowEvent::SIZE, width, height));
+         window->request_redraw();
       }
    }
 
@@ -224,6 +1303,14 @@ namespace oglfiber
       executor.must_stop.store(true);
    }
 
+   void OGLFiberExecutor::glfw_on_refresh(GLFWwindow *win)
+   //------------------------------------------------------
+   {
+      auto it = window_lookup.find(win);
+      if (it != window_lookup.end())
+         it->second->request_redraw();
+   }
+
    void OGLFiberExecutor::glfw_on_focus(GLFWwindow* win, int has_focus)
    //------------------------------------------------------------------
    {
@@ -231,7 +1318,8 @@ namespace oglfiber
       if (it != window_lookup.end())
       {
          OGLFiberWindow* window = it->second;
-         window->on_focus(has_focus == GLFW_TRUE);
+         window->queue_event(WindowEvent(WindowEvent::FOCUS, has_focus));
+         window->request_redraw();
       }
    }
 
@@ -242,7 +1330,9 @@ namespace oglfiber
       if (it != window_lookup.end())
       {
          OGLFiberWindow* window = it->second;
-         window->onCursorUpdate(xpos, ypos);
+         window->queue_event(WindowEvent(WindowEvent::CURSOR, xpos, ypos));
+         if (! window->is_pooled)
+            window->wake(); // dispatched by the window's fiber even if it is idle
       }
    }
 
@@ -253,7 +1343,8 @@ namespace oglfiber
       if (it != window_lookup.end())
       {
          OGLFiberWindow* window = it->second;
-         window->on_mouse_click(button, action, mods);
+         window->queue_event(WindowEvent(WindowEvent::BUTTON, button, action, mods));
+         window->request_redraw();
       }
    }
 
@@ -264,18 +1355,27 @@ namespace oglfiber
       if (it != window_lookup.end())
       {
          OGLFiberWindow* window = it->second;
-         window->on_mouse_scroll(xoffset, yoffset);
+         window->queue_event(WindowEvent(WindowEvent::SCROLL, xoffset, yoffset));
+         window->request_redraw();
       }
    }
 
    bool OGLFiberWindow::create(std::stringstream* errs)
    //---------------------------------------------
    {
+      group = OGLFiberExecutor::instance().join_share_group();
+      if (OGLFiberExecutor::instance().is_headless())
+         return create_headless(errs);
       glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, ogl_major);
       glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, ogl_minor);
       glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
       glfwWindowHint(GLFW_RESIZABLE, ((resizable) ? GL_TRUE : GL_FALSE));
       glfwWindowHint(GLFW_SAMPLES, 4);
+#ifdef GL_ERROR_POLL
+      glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
+#else
+      glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_FALSE);
+#endif
       const std::string title = ((name.empty()) ? "" : name);
       const GLFWvidmode* mode;
       if (monitor != nullptr)
@@ -288,14 +1388,17 @@ namespace oglfiber
       }
       else
          mode = nullptr;
+      GLFWwindow* share = nullptr;
+      if ( (group) && ((share = share_root(errs)) == nullptr) )
+         return false;
       GLFWwindow* win = nullptr;
       if ( (width > 0) && (height > 0) )
-         win = glfwCreateWindow(width, height, title.c_str(), monitor, nullptr);
+         win = glfwCreateWindow(width, height, title.c_str(), monitor, share);
       else if (mode != nullptr)
       {
          if (width <= 0) width = mode->width;
          if (height < 0) height = mode->height;
-         win = glfwCreateWindow(width, height, title.c_str(), monitor, nullptr);
+         win = glfwCreateWindow(width, height, title.c_str(), monitor, share);
          glfwSetWindowMonitor(win, monitor, 0, 0, width, height, mode->refreshRate);
       }
       else
@@ -315,4 +1418,85 @@ namespace oglfiber
       }
       return true;
    }
-}
\ No newline at end of file
+
+   // The hidden window whose context the share group's windows share with, created with the current hints.
+   GLFWwindow* OGLFiberWindow::share_root(std::stringstream* errs)
+   //-------------------------------------------------------------
+   {
+      if (! group->root)
+      {
+         glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+         group->root.reset(glfwCreateWindow(1, 1, group->name().c_str(), nullptr, nullptr));
+         glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+         if (! group->root)
+         {
+            if (errs)
+               *errs << "Error creating root context for share group " << group->name() << std::endl;
+            return nullptr;
+         }
+      }
+      return group->root.get();
+   }
+
+   GLenum OGLFiberWindow::link_program(oglutil::OGLProgramUnit& unit, const std::string& vertex_source,
+                                       const std::string& fragment_source, std::stringstream *errbuf,
+                                       const std::string& geometry_source, const std::string& tess_control_source,
+                                       const std::string& tess_eval_source)
+   //-----------------------------------------------------------------------------------------------------------
+   {
+      GLenum err = GL_NO_ERROR;
+      if (! group)
+      {
+         unit.program = oglutil::compile_link_shader(vertex_source, unit.vertex_shader, tess_control_source,
+                                                     unit.tess_control_shader, tess_eval_source,
+                                                     unit.tess_eval_shader, geometry_source, unit.geometry_shader,
+                                                     fragment_source, unit.fragment_shader, err, errbuf);
+         return err;
+      }
+      unit.shared_program = group->program(vertex_source, fragment_source, err, errbuf, geometry_source,
+                                           tess_control_source, tess_eval_source);
+      unit.program = (unit.shared_program) ? *unit.shared_program : GL_FALSE;
+      return err;
+   }
+
+   GLenum OGLFiberWindow::link_compute(oglutil::OGLProgramUnit& unit, const std::string& compute_source,
+                                       std::stringstream *errbuf)
+   //-------------------------------------------------------------------------------------------------
+   {
+      GLenum err = GL_NO_ERROR;
+      if (! group)
+      {
+         unit.program = oglutil::compile_link_compute(compute_source, unit.compute_shader, err, errbuf);
+         return err;
+      }
+      unit.shared_program = group->compute_program(compute_source, err, errbuf);
+      unit.program = (unit.shared_program) ? *unit.shared_program : GL_FALSE;
+      return err;
+   }
+
+   std::shared_ptr<const GLuint> OGLFiberWindow::static_buffer(const void* data, size_t size)
+   //-----------------------------------------------------------------------------------------
+   {
+      if (group)
+         return group->buffer(data, size);
+      oglutil::clearGLErrors();
+      GLuint vbo = 0;
+      glGenBuffers(1, &vbo);
+      glBindBuffer(GL_ARRAY_BUFFER, vbo);
+      glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      GLenum err;
+      std::stringstream errs;
+      if (! oglutil::isGLOk(err, &errs))
+      {
+         std::cerr << "Error creating buffer for " << name << ": " << errs.str() << std::endl;
+         glDeleteBuffers(1, &vbo);
+         return nullptr;
+      }
+      return std::shared_ptr<const GLuint>(new GLuint(vbo), [](const GLuint* p)
+      {
+         glDeleteBuffers(1, p);
+         delete p;
+      });
+   }
+}
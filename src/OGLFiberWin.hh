@@ -37,6 +37,10 @@ SOFTWARE.
 
 #define GLFW_INCLUDE_GLEXT
 #include <GLFW/glfw3.h>
+#ifdef FIBERGL_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include "glm/gtc/matrix_transform.hpp"
@@ -50,8 +54,13 @@ SOFTWARE.
 #include <utility>
 #include <unordered_map>
 #include <queue>
+#include <vector>
 #include <atomic>
 #include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <algorithm>
 
 #ifdef STD_FILESYSTEM
 #include <filesystem>
@@ -69,6 +78,7 @@ namespace filesystem = boost::filesystem;
 #include <boost/fiber/all.hpp>
 
 #include "OGLUtils.h"
+#include "FrameCapture.h"
 
 namespace std
 {
@@ -85,7 +95,7 @@ namespace std
 
 namespace oglfiber
 {
-   using TimeType = std::chrono::_V2::system_clock::time_point;
+   using TimeType = std::chrono::steady_clock::time_point;
 
    class OGLFiberExecutor;
 
@@ -96,6 +106,84 @@ namespace oglfiber
       KeyPress(int key, int scancode, int action, int modifiers) : key(key), scancode(scancode), action(action), modifiers(modifiers) {}
    };
 
+   // A GLFW event queued by the executor's event pump for the window it belongs to (see OGLFiberWindow::dispatch_events).
+   struct WindowEvent
+   {
+      enum Type { KEY, SIZE, FOCUS, CURSOR, BUTTON, SCROLL };
+      Type type;
+      int a, b, c, d; // key, scancode, action, modifiers; width, height; has focus; button, action, modifiers
+      double x, y;    // cursor position or scroll offsets
+
+      WindowEvent(Type type, int a =0, int b =0, int c =0, int d =0) : type(type), a(a), b(b), c(c), d(d), x(0), y(0) {}
+      WindowEvent(Type type, double x, double y) : type(type), a(0), b(0), c(0), d(0), x(x), y(y) {}
+   };
+
+   /**
+    * GL share group joined by the windows created after OGLFiberExecutor::use_share_group. The windows' contexts
+    * share objects with a hidden root context owned by the group (created with the first window's version and
+    * profile), so objects created in one window can be used in all of them. program and buffer deduplicate across
+    * the group: identical shader sources are compiled once and identical programs linked once, and identical data
+    * is uploaded to a single buffer, held as long as a window holds the returned pointer. As uniform values are
+    * program state they are also shared, so windows set the uniforms that differ between them before drawing.
+    * Objects are created in the context current when called and deleted in the one current when the last
+    * reference is released, both of which must belong to the group.
+    */
+   class OGLShareGroup
+   //=================
+   {
+   public:
+      struct Stats
+      {
+         size_t shaders = 0, programs = 0, buffers = 0; // created
+         size_t shared_shaders = 0, shared_programs = 0, shared_buffers = 0; // requests satisfied by an existing one
+      };
+
+      explicit OGLShareGroup(std::string name) : group_name(std::move(name)) {}
+
+      ~OGLShareGroup();
+
+      const std::string& name() const { return group_name; }
+
+      // Program linked from the non-empty sources, or nullptr (with err and errbuf set) on a compile or link error.
+      std::shared_ptr<const GLuint> program(const std::string& vertex_source, const std::string& fragment_source,
+                                            GLenum& err, std::stringstream *errbuf =nullptr,
+                                            const std::string& geometry_source ="",
+                                            const std::string& tess_control_source ="",
+                                            const std::string& tess_eval_source ="");
+
+      std::shared_ptr<const GLuint> compute_program(const std::string& compute_source, GLenum& err,
+                                                    std::stringstream *errbuf =nullptr);
+
+      // GL_STATIC_DRAW buffer holding size bytes of data (intended for small static data, the key is the data).
+      std::shared_ptr<const GLuint> buffer(const void* data, size_t size);
+
+      Stats stats();
+
+      friend class OGLFiberWindow;
+      friend class OGLFiberExecutor;
+
+   private:
+      std::string group_name;
+      std::mutex mutex;
+      std::unordered_map<std::string, std::weak_ptr<const GLuint>> shaders, programs, buffers;
+      Stats counts;
+      std::unique_ptr<GLFWwindow> root{nullptr};
+#ifdef FIBERGL_EGL
+      EGLDisplay egl_display = EGL_NO_DISPLAY;
+      EGLContext egl_root = EGL_NO_CONTEXT;
+#endif
+
+      OGLShareGroup(const OGLShareGroup&)= delete;
+      OGLShareGroup& operator=(const OGLShareGroup&)= delete;
+
+      std::shared_ptr<const GLuint> shader(const std::string& source, GLenum type, GLenum& err,
+                                           std::stringstream *errbuf);
+      std::shared_ptr<const GLuint> link(const std::string& key,
+                                         const std::vector<std::shared_ptr<const GLuint>>& stages, GLenum& err,
+                                         std::stringstream *errbuf);
+      static void purge(std::unordered_map<std::string, std::weak_ptr<const GLuint>>& objects);
+   };
+
    class OGLFiberWindow
    //===================
    {
@@ -119,19 +207,123 @@ namespace oglfiber
          is_good = create(&log);
       }
 
-      ~OGLFiberWindow()
-      {
-         std::cout << "Destroy OGLFiberWindow " << name << std::endl;
-      }
+      ~OGLFiberWindow();
 
       bool good() { return is_good; }
 
       std::string messages() { return log.str(); }
 
-      void frames_per_second(long fps_) { fps = fps_; fps_ns = (1000000000L / (fps >> 1)); }
+      /**
+       * Target frame rate. Frames are started at absolute deadlines fps_ apart, so time spent rendering is not
+       * added to the frame period and a late frame is followed by a shorter wait rather than shifting every
+       * later frame. If a frame overruns by whole periods those frames are skipped (counted in pacing_stats)
+       * instead of being rendered back to back to catch up.
+       */
+      void frames_per_second(long fps_)
+      {
+         fps = std::max(fps_, 1L);
+         fps_ns = 1000000000L / fps;
+         is_pacing_reset = true;
+      }
 
       long frames_per_second() { return fps; }
 
+      /**
+       * Synchronise presentation with the display refresh (the default). The executor sets each window's swap
+       * interval (see OGLFiberExecutor::vsync_pacing): one window with vsync on each thread waits for the vertical
+       * blank in its buffer swap, and the thread's other vsync windows swap without waiting and are paced at the
+       * refresh rate of their monitor (GLFWvidmode::refreshRate), so the windows of a thread share one wait per
+       * refresh instead of each waiting for its own. Their frame rate is the lower of frames_per_second and the
+       * refresh rate. Must be called before the window is started. Ignored for headless windows.
+       */
+      void vsync(bool is_vsync_) { is_vsync = is_vsync_; }
+
+      bool vsync() { return is_vsync; }
+
+      // Swap interval set by the executor when the window was started (-1 before then or when headless).
+      int swap_interval() { return interval; }
+
+      struct PacingStats
+      {
+         size_t frames = 0;           // frames rendered at the frame rate (excludes the first after a pause)
+         size_t skipped = 0;          // deadlines missed because a frame overran
+         double mean_interval_ms = 0; // mean time between the starts of consecutive frames
+         double jitter_ms = 0;        // standard deviation of the interval
+         double max_late_ms = 0;      // latest a frame started after its deadline
+      };
+
+      /**
+       * Frame pacing statistics since the window started or the frame rate or reset_pacing_stats was last set.
+       * Intervals are only measured between consecutively rendered frames, so idle periods of windows that render
+       * on demand do not count as jitter. Call from the window's fiber (eg in on_render).
+       */
+      PacingStats pacing_stats() { return pacing; }
+
+      void reset_pacing_stats() { is_pacing_reset = true; }
+
+      /**
+       * Render on demand: when true on_render and the buffer swap are skipped until the window is marked dirty by
+       * request_redraw, a resize or expose, a focus change or a key, mouse button or scroll event. Cursor movement
+       * does not mark the window dirty, so windows that change their view while dragging, or that animate, call
+       * request_redraw (from on_render to keep animating). An idle window's fiber waits until it is marked dirty
+       * and when every window is idle the executor blocks in glfwWaitEventsTimeout instead of polling.
+       */
+      void render_on_demand(bool on_demand) { is_on_demand = on_demand; request_redraw(); }
+
+      bool render_on_demand() { return is_on_demand; }
+
+      // Mark the window as needing to be rendered. May be called from any thread.
+      void request_redraw();
+
+      /**
+       * Dynamic resolution: when target_ms is greater than 0 on_render draws into an offscreen framebuffer of
+       * render_width x render_height, which is the window size scaled by a factor between min_scale and 1 adapted
+       * to keep the measured GPU time of on_render near target_ms, and the result is upscaled (bilinear) to the
+       * window. The offscreen framebuffer and its viewport are bound before on_render is called, so subclasses
+       * should size resolution dependent work by render_width/render_height, not call glViewport in on_render
+       * and use render_target() instead of framebuffer 0. 0 (the default) to render at the window resolution.
+       */
+      void dynamic_resolution(float target_ms, float min_scale =0.5f)
+      {
+         resolution_target_ms = target_ms;
+         min_resolution_scale = std::max(std::min(min_scale, 1.0f), 0.1f);
+         request_redraw();
+      }
+
+      float resolution_scale() { return ( (resolution_target_ms > 0) ? render_scale : 1.0f ); }
+
+      /**
+       * GPU profiling: when enabled the GPU time of each frame (on_render and the dynamic resolution upscale) is
+       * measured as the region "frame", and subclasses can time passes within it with
+       * oglutil::GPUProfiler::Scope(gpu_profiler(), name). Results are read a few frames later without stalling and
+       * gpu_stats returns rolling statistics for each region. If pipeline_statistics and the context supports them
+       * the vertices, primitives and fragment and compute shader invocations of the last measured frame are
+       * available from gpu_pipeline_stats. Call the accessors from the window's fiber (eg in on_render).
+       */
+      void gpu_profiling(bool enable, bool pipeline_statistics =false)
+      {
+         is_profiling = enable;
+         profiler.pipeline_statistics(pipeline_statistics);
+      }
+
+      bool gpu_profiling() { return is_profiling; }
+
+      std::vector<oglutil::GPUProfiler::Stats> gpu_stats() { return profiler.stats(); }
+
+      oglutil::GPUProfiler::PipelineStats gpu_pipeline_stats() { return profiler.pipeline(); }
+
+      /**
+       * Capture every rendered frame (after any dynamic resolution upscale, before the swap) to numbered files
+       * <window name>_<frame>.png or .pam in directory without stalling the render loop (see FrameCapture).
+       * stop_capture writes the outstanding frames the next time round the window's loop; capture also stops when
+       * the window exits.
+       */
+      bool start_capture(const std::string& directory, FrameCapture::Format format =FrameCapture::Format::PNG);
+
+      void stop_capture() { is_capture_stop = true; request_redraw(); }
+
+      bool capturing() { return ( (capture) && (capture->running()) ); }
+
       virtual void on_initialize(const GLFWwindow*) =0;
 
       virtual void on_resized(int w, int h) =0;
@@ -140,13 +332,48 @@ namespace oglfiber
 
       virtual void on_exit() =0;
 
+      // nullptr for headless windows (see OGLFiberExecutor::use_headless).
       GLFWwindow* GLFW_win() { return window.get(); }
 
+      bool headless() { return is_headless; }
+
+      // Identifies the window's GL context (the GLFW window, or the EGL context for headless windows).
+      const void* context_handle();
+
+      // The share group the window's context belongs to (see OGLFiberExecutor::use_share_group), or nullptr.
+      OGLShareGroup* share_group() { return group.get(); }
+
+      // Identifies the objects the window's context can use: its share group, or the context if not in one.
+      const void* share_handle() { return ( (group) ? static_cast<const void*>(group.get()) : context_handle() ); }
+
       friend class OGLFiberExecutor;
 
    protected:
       bool is_good = false;
       int width =-1, height =-1;
+      // Size of the framebuffer on_render draws to, see dynamic_resolution.
+      int render_width =-1, render_height =-1;
+
+      oglutil::GPUProfiler& gpu_profiler() { return profiler; }
+
+      // Framebuffer bound when on_render is called (0 unless rendering at a dynamic resolution).
+      GLuint render_target() const { return ( (is_offscreen) ? offscreen_unit("FBO_TARGET") : 0 ); }
+
+      /**
+       * Compile and link the non-empty sources into unit (as oglutil::compile_link_shader). In a share group the
+       * program and shaders are taken from the group if another window has already built them (unit then holds
+       * a reference in shared_program and no shader names). Returns the GL error, unit is false on failure.
+       */
+      GLenum link_program(oglutil::OGLProgramUnit& unit, const std::string& vertex_source,
+                          const std::string& fragment_source, std::stringstream *errbuf =nullptr,
+                          const std::string& geometry_source ="", const std::string& tess_control_source ="",
+                          const std::string& tess_eval_source ="");
+
+      GLenum link_compute(oglutil::OGLProgramUnit& unit, const std::string& compute_source,
+                          std::stringstream *errbuf =nullptr);
+
+      // GL_STATIC_DRAW buffer holding data, shared with windows of the share group holding identical data.
+      std::shared_ptr<const GLuint> static_buffer(const void* data, size_t size);
 
       virtual void onCursorUpdate(double xpos, double ypos) {}
       virtual void on_focus(bool has_focus) {}
@@ -160,15 +387,69 @@ namespace oglfiber
       GLFWmonitor* monitor = nullptr;
       std::stringstream log;
       long fps = 50;
-      long fps_ns = (1000000000L / (fps >> 1));
+      long fps_ns = (1000000000L / fps);
+      PacingStats pacing;
+      double interval_m2 = 0; // sum of squared differences from the mean interval (Welford)
+      bool is_pacing_reset = false;
+      bool is_vsync = true, is_refresh_paced = false, is_vsync_leader = false;
+      int interval = -1;
+      long refresh_hz = 60;
+      bool is_on_demand = false;
+      std::atomic_bool is_dirty{true};
+      float resolution_target_ms = 0, min_resolution_scale = 0.5f, render_scale = 1.0f;
+      bool is_offscreen = false, offscreen_failed = false;
+      int offscreen_width = 0, offscreen_height = 0;
+      oglutil::OGLProgramUnit offscreen_unit;
+      static const size_t FRAME_QUERY_RING = 4;
+      GLuint frame_queries[FRAME_QUERY_RING][2] = { { 0 } };
+      bool frame_query_pending[FRAME_QUERY_RING] = { false };
+      size_t frame_query = 0;
+      bool is_profiling = false;
+      oglutil::GPUProfiler profiler;
+      std::unique_ptr<FrameCapture> capture;
+      std::atomic_bool is_capture_stop{false};
       OGLFiberExecutor* parent = nullptr;
+      std::shared_ptr<OGLShareGroup> group;
       std::unique_ptr<GLFWwindow> window{nullptr};
+      bool is_headless = false;
+#ifdef FIBERGL_EGL
+      EGLContext egl_context = EGL_NO_CONTEXT;
+      EGLSurface egl_surface = EGL_NO_SURFACE;
+#endif
       boost::fibers::fiber_specific_ptr<int> last_error;
       boost::fibers::fiber_specific_ptr<std::string> last_error_msg;
       std::queue<KeyPress> key_queue;
+      // Events queued by the executor's callbacks, only accessed on the main thread (see dispatch_events).
+      std::vector<WindowEvent> event_queue, dispatched_events;
+      // With a thread pool (OGLFiberExecutor::thread_pool) events are dispatched on the main thread holding
+      // event_mutex while the window renders on its own thread. Resizes are deferred to the window's thread as
+      // on_resized needs the window's context.
+      bool is_pooled = false;
+      std::mutex event_mutex;
+      std::atomic_bool is_resize_pending{false};
+      // Notified by request_redraw to wake the window's fiber while it waits idle (see render_on_demand).
+      boost::fibers::mutex wake_mutex;
+      boost::fibers::condition_variable wake_condition;
 
       bool create(std::stringstream* errs =nullptr);
+      bool create_headless(std::stringstream* errs);
+      GLFWwindow* share_root(std::stringstream* errs);
+      void make_current();
+      void release_current();
+      bool should_close();
       void run();
+      void resize();
+      void queue_event(const WindowEvent& event);
+      void dispatch_events();
+      void wait_redraw();
+      void wake();
+      void pace(TimeType& deadline, bool is_rendered);
+      long frame_period_ns();
+      bool begin_render();
+      void end_render();
+      bool init_offscreen();
+      void update_render_scale();
+      void end_capture();
    };
 
    class OGLFiberExecutor
@@ -187,7 +468,60 @@ namespace oglfiber
       bool start(std::initializer_list<OGLFiberWindow *> windows_, bool is_threaded =false);
       bool start(std::initializer_list<std::shared_ptr<OGLFiberWindow>> windows_, bool is_threaded =false);
 
-      void stop() { must_stop.store(true); }
+      /**
+       * Render without a display: windows created after this is called get an EGL context (using the Mesa
+       * surfaceless platform when available, eg llvmpipe, otherwise the default EGL display with a pbuffer) instead
+       * of a GLFW window and render into an offscreen framebuffer (render_target()), so existing subclasses run
+       * unchanged in batch jobs and on servers. There are no input events and headless windows only end when the
+       * executor is stopped (eg by on_render returning false). Must be called before the first call to instance(),
+       * as GLFW is then not initialised; setting FIBERGL_HEADLESS=1 in the environment has the same effect.
+       * Requires building with EGL (FIBERGL_EGL).
+       */
+      static void use_headless(bool is_headless) { headless_requested = is_headless; }
+
+      bool is_headless() { return is_headless_mode; }
+
+      /**
+       * Render the windows on a pool of up to threads threads (0 for one per core) instead of as fibers on a
+       * single thread. Each window's fiber, and so its GL context, stays on the thread it is assigned to; windows
+       * in the same share group are assigned to the same thread as they share program state (eg uniform values).
+       * Windows are initialised, and events pumped and their callbacks run, on the thread that runs the executor
+       * (see start), while each pooled window's callbacks are serialized with its rendering. 1 (the default)
+       * runs every window on the executor's thread. Must be called before start.
+       */
+      void thread_pool(unsigned threads)
+      {
+         pool_size = (threads == 0) ? std::max(std::thread::hardware_concurrency(), 1u) : threads;
+      }
+
+      unsigned thread_pool() { return pool_size; }
+
+      /**
+       * true (the default) for windows with vsync (OGLFiberWindow::vsync) to share one vertical blank wait per
+       * thread and be paced at the refresh rate, see OGLFiberWindow::vsync. false to give every vsync window a
+       * swap interval of 1, so each swap waits for a refresh and N windows on a thread share the refresh rate.
+       * Must be called before start.
+       */
+      void vsync_pacing(bool is_pacing) { is_vsync_pacing = is_pacing; }
+
+      bool vsync_pacing() { return is_vsync_pacing; }
+
+      /**
+       * Windows created after this is called join the share group name (created by the executor on first use)
+       * instead of having a context of their own, see OGLShareGroup. An empty name (the default) stops joining.
+       * Windows in a group should use the same OpenGL version and profile.
+       */
+      static void use_share_group(const std::string& name) { share_group_requested = name; }
+
+      // The share group name, or nullptr if no window has joined it.
+      std::shared_ptr<OGLShareGroup> share_group(const std::string& name);
+
+      void stop()
+      {
+         must_stop.store(true);
+         if (! is_headless_mode)
+            glfwPostEmptyEvent();
+      }
       bool is_stopping() { return must_stop.load(); };
       void join()
       {
@@ -198,32 +532,45 @@ namespace oglfiber
                main_fiber.join();
       }
 
+      // True if every window renders on demand and none needs to be rendered.
+      bool is_idle();
+
    private:
       void run();
+      void run_pool();
+      void wait_events();
+      long tick_ns();
+      void initialize(OGLFiberWindow* window);
+      void configure_presentation(const std::vector<OGLFiberWindow*>& thread_windows);
+      std::vector<std::vector<OGLFiberWindow*>> assign_threads();
+      static std::unique_lock<std::mutex> lock_events(OGLFiberWindow* window);
 
       std::thread thread;
       boost::fibers::fiber main_fiber;
       std::vector<std::shared_ptr<OGLFiberWindow>> windows;
       std::vector<std::shared_ptr<boost::fibers::fiber>> fibers;
-      size_t running = 0;
+      std::atomic<size_t> running{0};
+      unsigned pool_size = 1;
+      std::vector<std::thread> pool;
+      bool is_vsync_pacing = true;
       std::atomic_bool must_stop; // atomic so an external thread can also terminate loop
+      std::atomic_bool is_waiting{false}; // blocked in glfwWaitEventsTimeout, see OGLFiberWindow::request_redraw
       OGLFiberWindow* current_window = nullptr;
+      static bool headless_requested;
+      bool is_headless_mode = false;
+      static std::string share_group_requested;
+      std::unordered_map<std::string, std::shared_ptr<OGLShareGroup>> share_groups;
+#ifdef FIBERGL_EGL
+      EGLDisplay egl_display = EGL_NO_DISPLAY;
+      bool is_surfaceless = false;
+#endif
 
-      OGLFiberExecutor()
-      //----------------
-      {
-         if (! glfwInit())
-         {
-            std::cerr <<  "Error initializing glfw" << std::endl;
-            throw std::runtime_error("Error initializing glfw");
-         }
-         glfwSetErrorCallback(glfw_error);
-      }
+      OGLFiberExecutor();
 
-      ~OGLFiberExecutor()
-      {
-         glfwTerminate();
-      }
+      ~OGLFiberExecutor();
+
+      void init_headless();
+      std::shared_ptr<OGLShareGroup> join_share_group();
 
       OGLFiberExecutor(const OGLFiberExecutor&)= delete;
       OGLFiberExecutor(const OGLFiberExecutor&&)= delete;
@@ -238,8 +585,11 @@ namespace oglfiber
       static void glfw_on_scroll_wheel(GLFWwindow* window, double xoffset, double yoffset);
       static void glfw_on_size(GLFWwindow* window, int width, int height);
       static void glfw_on_close(GLFWwindow *);
+      static void glfw_on_refresh(GLFWwindow *);
 
       static const size_t MAX_KEYBUF_SIZE = 100;
+      static constexpr double IDLE_WAIT_SECONDS = 0.25; // bounds the delay in noticing stop() from a fiber
+      static const long MAX_TICK_NS = 100000000L; // longest event polling interval while windows are rendering
 
       friend class OGLFiberWindow;
 
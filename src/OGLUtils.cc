@@ -26,6 +26,7 @@ SOFTWARE.
 #include <sstream>
 #include <memory>
 #include <regex>
+#include <cstring>
 
 #ifdef USE_GLEW
 #include <GL/glew.h>
@@ -60,6 +61,132 @@ namespace oglutil
       return ret;
    }
 
+#ifdef GL_ERROR_POLL
+   bool isFrameOk(const char* where)
+   //-------------------------------
+   {
+      GLenum err;
+      std::stringstream errs;
+      if (isGLOk(err, &errs))
+         return true;
+      std::cerr << where << ": " << err << ": " << errs.str() << std::endl;
+      return false;
+   }
+#endif
+
+   bool has_extension(const char* name)
+   //----------------------------------
+   {
+      GLint count = 0;
+      glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+      for (GLint i = 0; i < count; i++)
+      {
+         const char* extension = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, static_cast<GLuint>(i)));
+         if ( (extension != nullptr) && (std::strcmp(extension, name) == 0) )
+            return true;
+      }
+      return false;
+   }
+
+   static const char* debug_source(GLenum source)
+   //--------------------------------------------
+   {
+      switch (source)
+      {
+         case GL_DEBUG_SOURCE_API:             return "API";
+         case GL_DEBUG_SOURCE_WINDOW_SYSTEM:   return "Window system";
+         case GL_DEBUG_SOURCE_SHADER_COMPILER: return "Shader compiler";
+         case GL_DEBUG_SOURCE_THIRD_PARTY:     return "Third party";
+         case GL_DEBUG_SOURCE_APPLICATION:     return "Application";
+         default:                              return "Other";
+      }
+   }
+
+   static const char* debug_type(GLenum type)
+   //----------------------------------------
+   {
+      switch (type)
+      {
+         case GL_DEBUG_TYPE_ERROR:               return "error";
+         case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated behaviour";
+         case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:  return "undefined behaviour";
+         case GL_DEBUG_TYPE_PORTABILITY:         return "portability";
+         case GL_DEBUG_TYPE_PERFORMANCE:         return "performance";
+         case GL_DEBUG_TYPE_MARKER:              return "marker";
+         default:                                return "other";
+      }
+   }
+
+   static const char* debug_severity(GLenum severity)
+   //------------------------------------------------
+   {
+      switch (severity)
+      {
+         case GL_DEBUG_SEVERITY_HIGH:   return "high";
+         case GL_DEBUG_SEVERITY_MEDIUM: return "medium";
+         case GL_DEBUG_SEVERITY_LOW:    return "low";
+         default:                       return "notification";
+      }
+   }
+
+   static void GLAPIENTRY debug_callback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length,
+                                         const GLchar* message, const void* label)
+   //-----------------------------------------------------------------------------------------------------------
+   {
+      std::cerr << "GL " << debug_source(source) << " " << debug_type(type) << " (" << debug_severity(severity)
+                << ", " << id << ")";
+      if (label != nullptr)
+         std::cerr << " [" << static_cast<const char*>(label) << "]";
+      std::cerr << ": " << std::string(message, (length < 0) ? std::strlen(message) : length) << std::endl;
+   }
+
+   bool enable_debug_output(const char* label, bool synchronous)
+   //-----------------------------------------------------------
+   {
+      GLint major = 0, minor = 0;
+      glGetIntegerv(GL_MAJOR_VERSION, &major);
+      glGetIntegerv(GL_MINOR_VERSION, &minor);
+      if ( ( (major < 4) || ( (major == 4) && (minor < 3) ) ) && (! has_extension("GL_KHR_debug")) )
+         return false;
+      glEnable(GL_DEBUG_OUTPUT);
+      if (synchronous)
+         glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+      else
+         glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+      glDebugMessageCallback(debug_callback, label);
+      if (synchronous)
+      {
+         glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, GL_TRUE);
+         glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, nullptr, GL_FALSE);
+      }
+      else
+      {
+         glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, GL_FALSE);
+         glDebugMessageControl(GL_DONT_CARE, GL_DEBUG_TYPE_ERROR, GL_DONT_CARE, 0, nullptr, GL_TRUE);
+      }
+      return true;
+   }
+
+   // The info log of a shader (is_program false) or program, empty if there is none (GL_INFO_LOG_LENGTH 0).
+   static std::string info_log(GLuint name, bool is_program)
+   //--------------------------------------------------------
+   {
+      GLint length = 0;
+      if (is_program)
+         glGetProgramiv(name, GL_INFO_LOG_LENGTH, &length);
+      else
+         glGetShaderiv(name, GL_INFO_LOG_LENGTH, &length);
+      if (length <= 0)
+         return "";
+      std::vector<GLchar> log(static_cast<size_t>(length) + 1, 0);
+      GLsizei written = 0;
+      if (is_program)
+         glGetProgramInfoLog(name, length, &written, log.data());
+      else
+         glGetShaderInfoLog(name, length, &written, log.data());
+      return std::string(log.data(), static_cast<size_t>(std::max(written, 0)));
+   }
+
    GLuint compile_shader(std::string source, GLenum type, GLenum& err, std::stringstream *errbuf)
    //--------------------------------------------------------------------------------------------
    {
@@ -81,7 +208,10 @@ namespace oglutil
       GLuint handle = glCreateShader(type);
       glShaderSource(handle, 1, (const GLchar **) &p, nullptr);
       if (! isGLOk(err, errbuf))
-         return -1;
+      {
+         glDeleteShader(handle);
+         return 0;
+      }
       glCompileShader(handle);
       // if (! isGLOk(errbuf))
       //    return -1;
@@ -91,24 +221,13 @@ namespace oglutil
       if ( (status[0] == GL_FALSE) || (! compiled) )
       {
          if (errbuf != nullptr)
-            *errbuf << "Compile error: " << std::endl << source;
-         status[0] = 0;
-         glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &status[0]);
-         std::unique_ptr<GLchar> logoutput(new GLchar[status[0]]);
-         GLsizei loglen[1];
-         glGetShaderInfoLog(handle, status[0], &loglen[0], logoutput.get());
-         if (errbuf != nullptr)
-            *errbuf << std::string(logoutput.get());
-         return -1;
+            *errbuf << "Compile error: " << std::endl << source << info_log(handle, false);
+         glDeleteShader(handle);
+         return 0;
       }
       else
       {
-         status[0] = 0;
-         glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &status[0]);
-         std::unique_ptr<GLchar> logoutput(new GLchar[status[0] + 1]);
-         GLsizei loglen[1];
-         glGetShaderInfoLog(handle, status[0], &loglen[0], logoutput.get());
-         std::string logout = std::string(logoutput.get());
+         const std::string logout = info_log(handle, false);
          if (logout.length() > 0)
             std::cout << "Compile Shader:" << std::endl << logout;
       }
@@ -129,24 +248,12 @@ namespace oglutil
       if (status[0] == GL_FALSE)
       {
          if (errbuf != nullptr)
-            *errbuf << "Link error: ";
-         status[0] = 0;
-         glGetProgramiv(program, GL_INFO_LOG_LENGTH, &status[0]);
-         std::unique_ptr<GLchar> logoutput(new GLchar[status[0]]);
-         GLsizei loglen[1];
-         glGetProgramInfoLog(program, status[0], &loglen[0], logoutput.get());
-         if (errbuf != nullptr)
-            *errbuf << std::string(logoutput.get());
+            *errbuf << "Link error: " << info_log(program, true);
          return false;
       }
       else
       {
-         status[0] = 0;
-         glGetProgramiv(program, GL_INFO_LOG_LENGTH, &status[0]);
-         std::unique_ptr<GLchar> logoutput(new GLchar[status[0] + 1]);
-         GLsizei loglen[1];
-         glGetProgramInfoLog(program, status[0], &loglen[0], logoutput.get());
-         std::string logout = logoutput.get();
+         const std::string logout = info_log(program, true);
          if ( (logout.length() > 0) && (errbuf != nullptr) )
             *errbuf << "Shader Link Status: " << logout;
       }
@@ -269,6 +376,34 @@ namespace oglutil
       return program;
    }
 
+   GLuint compile_link_compute(const std::string& compute_source, GLuint& computeShader, GLenum& err,
+                               std::stringstream *errbuf)
+   //------------------------------------------------------------------------------------------------
+   {
+      computeShader = compile_shader(compute_source, GL_COMPUTE_SHADER, err, errbuf);
+      if (computeShader == 0)
+         return 0;
+      clearGLErrors();
+      GLuint program = glCreateProgram();
+      if (program == 0)
+      {
+         if (errbuf != nullptr)
+            *errbuf << "Error creating compute shader program.";
+         glDeleteShader(computeShader);
+         computeShader = 0;
+         return 0;
+      }
+      glAttachShader(program, computeShader);
+      if (! link_shader(program, err, errbuf))
+      {
+         glDeleteProgram(program);
+         glDeleteShader(computeShader);
+         computeShader = 0;
+         return 0;
+      }
+      return program;
+   }
+
    bool load_shaders(const std::string &directory, std::string &vertexShader, std::string &fragmentShader,
                      std::string *geometryShader, std::string *tessControlShader,
                      std::string *tessEvalShader)
@@ -353,11 +488,17 @@ namespace oglutil
    void OGLProgramUnit::del()
    //------------------------
    {
+      if (shared_program)
+      {
+         program = GL_FALSE;
+         shared_program.reset();
+      }
       if (vertex_shader != GL_FALSE) glDeleteShader(vertex_shader);
       if (tess_control_shader != GL_FALSE) glDeleteShader(tess_control_shader);
       if (tess_eval_shader != GL_FALSE) glDeleteShader(tess_eval_shader);
       if (geometry_shader != GL_FALSE) glDeleteShader(geometry_shader);
       if (fragment_shader != GL_FALSE) glDeleteShader(fragment_shader);
+      if (compute_shader != GL_FALSE) glDeleteShader(compute_shader);
       if (program != GL_FALSE) glDeleteProgram(program);
       for(auto it = uints.begin(); it != uints.end(); ++it)
       {
@@ -367,11 +508,368 @@ namespace oglutil
             glDeleteBuffers(1, &it->second);
          else if (k.find("VAO_") != std::string::npos)
             glDeleteVertexArrays(1, &it->second);
+         else if (k.find("UBO_") != std::string::npos)
+            glDeleteBuffers(1, &it->second);
          else if (k.find("TEX_") != std::string::npos)
             glDeleteTextures(1, &it->second);
+         else if (k.find("FBO_") != std::string::npos)
+            glDeleteFramebuffers(1, &it->second);
+         else if (k.find("RBO_") != std::string::npos)
+            glDeleteRenderbuffers(1, &it->second);
       }
-      program = vertex_shader = tess_control_shader = tess_eval_shader = geometry_shader = fragment_shader =GL_FALSE;
+      program = vertex_shader = tess_control_shader = tess_eval_shader = geometry_shader = fragment_shader =
+            compute_shader = GL_FALSE;
       uints.clear();
       ints.clear();
+      locations.clear();
+      is_resolved = false;
+   }
+
+   void OGLProgramUnit::resolve_uniforms()
+   //-------------------------------------
+   {
+      locations.clear();
+      is_resolved = false;
+      if (program == GL_FALSE) return;
+      GLint count = 0, max_length = 0;
+      glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+      glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+      std::unique_ptr<GLchar[]> name(new GLchar[max_length + 1]);
+      for (GLint i = 0; i < count; i++)
+      {
+         GLsizei length = 0;
+         GLint size = 0;
+         GLenum type;
+         glGetActiveUniform(program, static_cast<GLuint>(i), max_length + 1, &length, &size, &type, name.get());
+         std::string uniform_name(name.get(), length);
+         GLint location = glGetUniformLocation(program, uniform_name.c_str());
+         if (location < 0) continue; // member of a uniform block
+         size_t array = uniform_name.find("[0]");
+         if (array != std::string::npos)
+            uniform_name.erase(array);
+         locations[uniform_name] = location;
+      }
+      is_resolved = true;
+   }
+
+   bool OGLProgramUnit::uniform_block(const char* name, GLuint binding)
+   //-------------------------------------------------------------------
+   {
+      GLuint index = glGetUniformBlockIndex(program, name);
+      if (index == GL_INVALID_INDEX)
+         return false;
+      glUniformBlockBinding(program, index, binding);
+      return true;
+   }
+
+   bool StreamBuffer::create(GLenum target_, size_t size, unsigned regions_, std::stringstream *errbuf)
+   //-------------------------------------------------------------------------------------------------
+   {
+      del();
+      if ( (size == 0) || (regions_ == 0) ) return false;
+      target = target_;
+      regions = regions_;
+      GLint alignment = 1;
+      if (target == GL_UNIFORM_BUFFER)
+         glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+      else if (target == GL_SHADER_STORAGE_BUFFER)
+         glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+      if (alignment < 1) alignment = 1;
+      region = ((size + alignment - 1) / alignment) * alignment;
+      const size_t total = region*regions;
+      fences.assign(regions, nullptr);
+      current = regions - 1;
+
+      GLint major = 0, minor = 0;
+      glGetIntegerv(GL_MAJOR_VERSION, &major);
+      glGetIntegerv(GL_MINOR_VERSION, &minor);
+      const bool has_storage = ( (major > 4) || ( (major == 4) && (minor >= 4) ) ||
+                                 (has_extension("GL_ARB_buffer_storage")) );
+      clearGLErrors();
+      glGenBuffers(1, &name);
+      glBindBuffer(target, name);
+      if (has_storage)
+      {
+         const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+         glBufferStorage(target, total, nullptr, flags);
+         mapped = static_cast<char*>(glMapBufferRange(target, 0, total, flags));
+      }
+      else
+      {
+         glBufferData(target, total, nullptr, GL_STREAM_DRAW);
+         staging.reset(new char[region]);
+      }
+      glBindBuffer(target, 0);
+      GLenum err;
+      if ( (! isGLOk(err, errbuf)) || ( (has_storage) && (mapped == nullptr) ) )
+      {
+         if (errbuf != nullptr)
+            *errbuf << "Error creating stream buffer of " << total << " bytes";
+         del();
+         return false;
+      }
+      return true;
+   }
+
+   void StreamBuffer::del()
+   //----------------------
+   {
+      for (GLsync& sync : fences)
+      {
+         if (sync != nullptr)
+            glDeleteSync(sync);
+         sync = nullptr;
+      }
+      fences.clear();
+      if (name != 0)
+      {
+         if (mapped != nullptr)
+         {
+            glBindBuffer(target, name);
+            glUnmapBuffer(target);
+            glBindBuffer(target, 0);
+         }
+         glDeleteBuffers(1, &name);
+      }
+      name = 0;
+      mapped = nullptr;
+      staging.reset();
+      region = 0;
+      regions = current = 0;
+   }
+
+   void* StreamBuffer::map_next()
+   //----------------------------
+   {
+      if (name == 0) return nullptr;
+      current = (current + 1) % regions;
+      GLsync& sync = fences[current];
+      if (sync != nullptr)
+      {
+         GLenum status = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+         while (status == GL_TIMEOUT_EXPIRED)
+            status = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+         glDeleteSync(sync);
+         sync = nullptr;
+      }
+      if (mapped != nullptr)
+         return mapped + current*region;
+      return staging.get();
+   }
+
+   GLintptr StreamBuffer::commit(size_t bytes)
+   //-----------------------------------------
+   {
+      if ( (mapped == nullptr) && (name != 0) && (bytes > 0) )
+      {
+         glBindBuffer(target, name);
+         glBufferSubData(target, offset(), std::min(bytes, region), staging.get());
+         glBindBuffer(target, 0);
+      }
+      return offset();
+   }
+
+   void StreamBuffer::fence()
+   //------------------------
+   {
+      if ( (name == 0) || (mapped == nullptr) ) return;
+      GLsync& sync = fences[current];
+      if (sync != nullptr)
+         glDeleteSync(sync);
+      sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   }
+
+   static const GLenum PIPELINE_TARGETS[] = { GL_VERTICES_SUBMITTED_ARB, GL_PRIMITIVES_SUBMITTED_ARB,
+                                              GL_FRAGMENT_SHADER_INVOCATIONS_ARB, GL_COMPUTE_SHADER_INVOCATIONS_ARB };
+
+   void GPUProfiler::del()
+   //---------------------
+   {
+      for (Frame& frame : frames)
+      {
+         for (const Region& region : frame.regions)
+         {
+            glDeleteQueries(1, &region.start);
+            glDeleteQueries(1, &region.end);
+         }
+         frame.regions.clear();
+         if (frame.pipeline[0] != 0)
+            glDeleteQueries(PIPELINE_QUERIES, frame.pipeline);
+         std::fill(frame.pipeline, frame.pipeline + PIPELINE_QUERIES, 0);
+         frame.is_pending = frame.has_pipeline = false;
+      }
+      if (! free_queries.empty())
+         glDeleteQueries(static_cast<GLsizei>(free_queries.size()), free_queries.data());
+      free_queries.clear();
+      open.clear();
+      is_recording = false;
+   }
+
+   GLuint GPUProfiler::query()
+   //-------------------------
+   {
+      if (free_queries.empty())
+      {
+         free_queries.resize(16);
+         glGenQueries(static_cast<GLsizei>(free_queries.size()), free_queries.data());
+      }
+      GLuint q = free_queries.back();
+      free_queries.pop_back();
+      return q;
+   }
+
+   void GPUProfiler::begin_frame(const char* frame_name)
+   //---------------------------------------------------
+   {
+      if (! is_pipeline_checked)
+      {
+         GLint major = 0, minor = 0;
+         glGetIntegerv(GL_MAJOR_VERSION, &major);
+         glGetIntegerv(GL_MINOR_VERSION, &minor);
+         is_pipeline = ( (is_pipeline_requested) &&
+                         ( (major > 4) || ( (major == 4) && (minor >= 6) ) ||
+                           (has_extension("GL_ARB_pipeline_statistics_query")) ) );
+         is_pipeline_checked = true;
+      }
+      Frame& frame = frames[current];
+      if ( (frame.is_pending) && (! collect(frame)) )
+      {
+         dropped_frames++;
+         is_recording = false;
+         return;
+      }
+      is_recording = true;
+      open.clear();
+      frame.has_pipeline = is_pipeline;
+      if (is_pipeline)
+      {
+         if (frame.pipeline[0] == 0)
+            glGenQueries(PIPELINE_QUERIES, frame.pipeline);
+         for (int i = 0; i < PIPELINE_QUERIES; i++)
+            glBeginQuery(PIPELINE_TARGETS[i], frame.pipeline[i]);
+      }
+      begin(frame_name);
+   }
+
+   void GPUProfiler::end_frame()
+   //---------------------------
+   {
+      if (! is_recording) return;
+      while (! open.empty())
+         end();
+      Frame& frame = frames[current];
+      if (frame.has_pipeline)
+      {
+         for (int i = 0; i < PIPELINE_QUERIES; i++)
+            glEndQuery(PIPELINE_TARGETS[i]);
+      }
+      frame.is_pending = true;
+      is_recording = false;
+      current = (current + 1) % FRAMES;
+      for (Frame& f : frames)
+      {
+         if ( (f.is_pending) && (&f != &frame) )
+            collect(f);
+      }
+   }
+
+   void GPUProfiler::begin(const char* name)
+   //---------------------------------------
+   {
+      if (! is_recording) return;
+      size_t id;
+      auto it = ids.find(name);
+      if (it == ids.end())
+      {
+         // A new pointer may still be a known name (the same literal in another translation unit).
+         id = static_cast<size_t>(std::find(names.begin(), names.end(), name) - names.begin());
+         if (id == names.size())
+         {
+            names.emplace_back(name);
+            history.emplace_back();
+         }
+         ids.emplace(name, id);
+      }
+      else
+         id = it->second;
+      std::vector<Region>& regions = frames[current].regions;
+      regions.push_back(Region{id, query(), 0});
+      glQueryCounter(regions.back().start, GL_TIMESTAMP);
+      open.push_back(regions.size() - 1);
+   }
+
+   void GPUProfiler::end()
+   //---------------------
+   {
+      if ( (! is_recording) || (open.empty()) ) return;
+      Region& region = frames[current].regions[open.back()];
+      open.pop_back();
+      region.end = query();
+      glQueryCounter(region.end, GL_TIMESTAMP);
+   }
+
+   // Reads the results of frame if they are all available, returning false (without waiting) if not.
+   bool GPUProfiler::collect(Frame& frame)
+   //-------------------------------------
+   {
+      // Queries complete in order, so the last ones issued (the pipeline queries, then the end of the frame region
+      // which is the first region) being available implies the others are.
+      GLint is_available = GL_TRUE;
+      if (frame.has_pipeline)
+         glGetQueryObjectiv(frame.pipeline[PIPELINE_QUERIES - 1], GL_QUERY_RESULT_AVAILABLE, &is_available);
+      if ( (is_available == GL_TRUE) && (! frame.regions.empty()) )
+         glGetQueryObjectiv(frame.regions.front().end, GL_QUERY_RESULT_AVAILABLE, &is_available);
+      if (is_available != GL_TRUE)
+         return false;
+      for (const Region& region : frame.regions)
+      {
+         GLuint64 start = 0, end = 0;
+         glGetQueryObjectui64v(region.start, GL_QUERY_RESULT, &start);
+         glGetQueryObjectui64v(region.end, GL_QUERY_RESULT, &end);
+         std::deque<double>& samples = history[region.id];
+         samples.push_back((end >= start) ? (end - start) / 1000000.0 : 0.0);
+         if (samples.size() > WINDOW)
+            samples.pop_front();
+         free_queries.push_back(region.start);
+         free_queries.push_back(region.end);
+      }
+      frame.regions.clear();
+      if (frame.has_pipeline)
+      {
+         GLuint64 counts[PIPELINE_QUERIES] = { 0 };
+         for (int i = 0; i < PIPELINE_QUERIES; i++)
+            glGetQueryObjectui64v(frame.pipeline[i], GL_QUERY_RESULT, &counts[i]);
+         last_pipeline.vertices = counts[0];
+         last_pipeline.primitives = counts[1];
+         last_pipeline.fragment_invocations = counts[2];
+         last_pipeline.compute_invocations = counts[3];
+      }
+      frame.is_pending = false;
+      return true;
+   }
+
+   std::vector<GPUProfiler::Stats> GPUProfiler::stats() const
+   //---------------------------------------------------------
+   {
+      std::vector<Stats> result;
+      for (size_t id = 0; id < names.size(); id++)
+      {
+         const std::deque<double>& samples = history[id];
+         Stats stats;
+         stats.name = names[id];
+         stats.samples = samples.size();
+         if (! samples.empty())
+         {
+            stats.last_ms = samples.back();
+            stats.min_ms = *std::min_element(samples.begin(), samples.end());
+            stats.max_ms = *std::max_element(samples.begin(), samples.end());
+            double total = 0;
+            for (double ms : samples)
+               total += ms;
+            stats.mean_ms = total / samples.size();
+         }
+         result.push_back(stats);
+      }
+      return result;
    }
-}
\ No newline at end of file
+}
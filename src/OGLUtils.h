@@ -26,6 +26,9 @@ SOFTWARE.
 #include <string>
 #include <unordered_map>
 #include <algorithm>
+#include <vector>
+#include <deque>
+#include <memory>
 #ifdef STD_FILESYSTEM
 #include <filesystem>
 namespace filesystem = std::filesystem;
@@ -47,6 +50,33 @@ namespace oglutil
 
    bool isGLOk(GLenum& err, std::stringstream *strst =nullptr);
 
+   /*
+    * Per frame error checks for use in render loops. glGetError synchronises with the driver on many
+    * implementations, so unless GL_ERROR_POLL is defined (CMake defines it for Debug builds or when the
+    * GL_ERROR_POLL option is on) these compile to nothing and errors are only reported by the debug output
+    * callback installed by enable_debug_output.
+    */
+#ifdef GL_ERROR_POLL
+   inline void clearFrameErrors() { clearGLErrors(); }
+   // Returns false after logging any pending errors, prefixed by where, to std::cerr.
+   bool isFrameOk(const char* where);
+#else
+   inline void clearFrameErrors() {}
+   inline bool isFrameOk(const char*) { return true; }
+#endif
+
+   bool has_extension(const char* name);
+
+   /**
+    * Install a GL 4.3/KHR_debug message callback in the current context that logs to std::cerr, prefixed by label
+    * (which must outlive the context). If synchronous the callback runs on the offending GL call (usable from a
+    * debugger) and all but notification messages are reported, otherwise only errors are reported and the driver
+    * may report them asynchronously. Returns false if debug output is not supported.
+    */
+   bool enable_debug_output(const char* label, bool synchronous);
+
+   // Compiles source (or the file it names) as a shader of type. Returns 0 on failure, with the source and info log
+   // in errbuf.
    GLuint compile_shader(std::string source, GLenum type, GLenum& err, std::stringstream *errbuf);
 
    bool link_shader(const GLuint program, GLenum& err, std::stringstream *errbuf = nullptr);
@@ -62,6 +92,10 @@ namespace oglutil
                               const std::string& fragment_source, GLuint& fragmentShader,
                               GLenum& err, std::stringstream *errbuf = nullptr);
 
+   // Compile and link a compute shader program (GL 4.3).
+   GLuint compile_link_compute(const std::string& compute_source, GLuint& computeShader, GLenum& err,
+                               std::stringstream *errbuf = nullptr);
+
    inline std::string emptys(const char *pch) { return ( (pch == nullptr) ? "" : std::string(pch) ); }
 
    bool load_shaders(const std::string& directory, std::string& vertexShader, std::string& fragmentShader,
@@ -72,11 +106,19 @@ namespace oglutil
    //===================
    {
       GLuint program =GL_FALSE, vertex_shader =GL_FALSE, tess_control_shader =GL_FALSE,
-            tess_eval_shader =GL_FALSE, geometry_shader =GL_FALSE, fragment_shader =GL_FALSE;
+            tess_eval_shader =GL_FALSE, geometry_shader =GL_FALSE, fragment_shader =GL_FALSE,
+            compute_shader =GL_FALSE;
       std::stringstream log;
-      // For automatic deletion use VBO_ name for VBOs and TEX_ name for textures
+      // For automatic deletion use VBO_ name for VBOs, UBO_ for uniform buffers, TEX_ name for textures, FBO_ for
+      // framebuffers and RBO_ for renderbuffers
       std::unordered_map<std::string, GLuint> uints;
       std::unordered_map<std::string, GLint> ints;
+      // Uniform locations filled by resolve_uniforms after linking
+      std::unordered_map<std::string, GLint> locations;
+      bool is_resolved = false;
+      // Set when program is held from a share group (see oglfiber::OGLShareGroup), del() then releases the
+      // reference instead of deleting the program.
+      std::shared_ptr<const GLuint> shared_program;
 
       ~OGLProgramUnit() { del(); }
       void del();
@@ -116,7 +158,155 @@ namespace oglutil
 
       operator bool() const { return program != GL_FALSE; }
 
-      GLint uniform(std::string name) { return glGetUniformLocation(program, name.c_str()); }
+      // Cached location after resolve_uniforms (-1 if not an active default block uniform), otherwise queried.
+      GLint uniform(const std::string& name) const
+      //------------------------------------------
+      {
+         if (! is_resolved)
+            return glGetUniformLocation(program, name.c_str());
+         auto it = locations.find(name);
+         if (it != locations.end())
+            return it->second;
+         return -1;
+      }
+
+      // Query the locations of all active uniforms once after linking so uniform() no longer calls the driver.
+      void resolve_uniforms();
+
+      // Assign the named uniform block to binding point, returns false if the program has no such active block.
+      bool uniform_block(const char* name, GLuint binding);
+   };
+
+   /*
+    * Streaming buffer for data written by the CPU every frame. The buffer is split into regions (3 by default)
+    * used round robin. With GL 4.4/ARB_buffer_storage it is created with glBufferStorage and mapped once, persistent
+    * and coherent, and a glFenceSync after the commands reading a region is waited on before the region is written
+    * again, so writes never cause implicit synchronization or reallocation. Otherwise regions are written from a
+    * CPU copy with glBufferSubData.
+    * Usage per frame: p = map_next(); write up to region_size() bytes to p; offset = commit(bytes);
+    * issue the commands reading [offset, offset + bytes); fence().
+    * The owning context must be current for all calls, including the destructor (or call del() earlier).
+    */
+   class StreamBuffer
+   //================
+   {
+   public:
+      StreamBuffer() = default;
+      StreamBuffer(const StreamBuffer&) = delete;
+      StreamBuffer& operator=(const StreamBuffer&) = delete;
+      ~StreamBuffer() { del(); }
+
+      /**
+       * @param target - Binding target (GL_ARRAY_BUFFER, GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER ...). Region
+       * sizes are rounded up to the target's offset alignment for uniform and shader storage buffers.
+       * @param size - Maximum bytes written per frame.
+       */
+      bool create(GLenum target, size_t size, unsigned regions =3, std::stringstream *errbuf =nullptr);
+      void del();
+
+      // Waits (blocking) until the GPU has finished with the next region and returns a pointer to write it.
+      void* map_next();
+      // Makes the bytes written to the current region visible to GL, returns the region's byte offset.
+      GLintptr commit(size_t bytes);
+      // Fence the current region; call after the commands that read it.
+      void fence();
+
+      GLuint buffer() const { return name; }
+      GLintptr offset() const { return static_cast<GLintptr>(current*region); }
+      size_t region_size() const { return region; }
+      bool persistent() const { return mapped != nullptr; }
+      operator bool() const { return name != 0; }
+
+   private:
+      GLenum target = GL_ARRAY_BUFFER;
+      GLuint name = 0;
+      size_t region = 0;
+      unsigned regions = 0, current = 0;
+      char* mapped = nullptr;
+      std::unique_ptr<char[]> staging; // when not persistent
+      std::vector<GLsync> fences;
+   };
+
+   /*
+    * GPU time of named regions of a frame, measured with a pool of GL_TIMESTAMP query pairs (which unlike
+    * GL_TIME_ELAPSED may be nested and used inside code that has its own elapsed time queries). Results are read
+    * up to FRAMES frames later without waiting; a frame whose queries are still in flight when its slot is needed
+    * again is not recorded. Optionally counts pipeline statistics (ARB_pipeline_statistics_query or GL 4.6) for
+    * the whole frame. The context the queries were created in must be current for all calls.
+    */
+   class GPUProfiler
+   //===============
+   {
+   public:
+      // Rolling statistics over the last WINDOW samples of a region.
+      struct Stats
+      {
+         std::string name;
+         size_t samples = 0;
+         double last_ms = 0, mean_ms = 0, min_ms = 0, max_ms = 0;
+      };
+      // Counts for the last collected frame.
+      struct PipelineStats
+      {
+         GLuint64 vertices = 0, primitives = 0, fragment_invocations = 0, compute_invocations = 0;
+      };
+
+      class Scope
+      {
+      public:
+         Scope(GPUProfiler& profiler, const char* name) : profiler(profiler) { profiler.begin(name); }
+         ~Scope() { profiler.end(); }
+         Scope(const Scope&) = delete;
+         Scope& operator=(const Scope&) = delete;
+      private:
+         GPUProfiler& profiler;
+      };
+
+      static const size_t FRAMES = 4, WINDOW = 120;
+
+      GPUProfiler() = default;
+      GPUProfiler(const GPUProfiler&) = delete;
+      GPUProfiler& operator=(const GPUProfiler&) = delete;
+      ~GPUProfiler() { del(); }
+      void del();
+
+      // Request pipeline statistics, used from the next frame if the context supports them.
+      void pipeline_statistics(bool enable) { is_pipeline_requested = enable; is_pipeline_checked = false; }
+      bool pipeline_statistics() const { return is_pipeline; }
+
+      // Start and end a frame; the frame itself is timed as the region named frame_name.
+      void begin_frame(const char* frame_name ="frame");
+      void end_frame();
+      // Nested regions within a frame, ignored outside begin_frame/end_frame or when the frame is not recorded.
+      // Regions are looked up by the address of name, so it must outlive the profiler (a string literal).
+      void begin(const char* name);
+      void end();
+
+      std::vector<Stats> stats() const;
+      PipelineStats pipeline() const { return last_pipeline; }
+      size_t dropped() const { return dropped_frames; }
+
+   private:
+      static const int PIPELINE_QUERIES = 4;
+      struct Region { size_t id; GLuint start, end; };
+      struct Frame
+      {
+         std::vector<Region> regions;
+         GLuint pipeline[PIPELINE_QUERIES] = { 0 };
+         bool is_pending = false, has_pipeline = false;
+      };
+      Frame frames[FRAMES];
+      size_t current = 0, dropped_frames = 0;
+      bool is_recording = false, is_pipeline = false, is_pipeline_requested = false, is_pipeline_checked = false;
+      std::vector<GLuint> free_queries;
+      std::vector<size_t> open;
+      std::unordered_map<const char*, size_t> ids; // by address, no string is built per region per frame
+      std::vector<std::string> names;
+      std::vector<std::deque<double>> history;
+      PipelineStats last_pipeline;
+
+      GLuint query();
+      bool collect(Frame& frame);
    };
 };
 
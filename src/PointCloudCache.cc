@@ -0,0 +1,533 @@
+/*
+Copyright (c) 2017 Donald Munro
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "PointCloudCache.h"
+
+#include <sys/stat.h>
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <functional>
+#include <assert.h>
+
+#include "tinyply.h"
+#include "OGLUtils.h"
+#include "PointCloudUtils.h"
+
+namespace
+{
+   // Interleaved vertex layout used while loading: x, y, z, w, r, g, b, a, nx, ny, nz
+   const size_t VERTEX_FLOATS = 4 + 4 + 3;
+
+   struct float3 { float x, y, z; };
+
+   inline void _push_vertex(GLfloat*& vertices, GLfloat x, GLfloat y, GLfloat z, GLfloat w,
+                            GLfloat r, GLfloat g, GLfloat b, GLfloat a, GLfloat nx, GLfloat ny, GLfloat nz)
+   {
+      *vertices++ = x; *vertices++ = y; *vertices++ = z; *vertices++ = w;
+      *vertices++ = r; *vertices++ = g; *vertices++ = b; *vertices++ = a;
+      *vertices++ = nx; *vertices++ = ny; *vertices++ = nz;
+   }
+
+   // Octahedral normal encoding, 8 bits per component packed into 16 bits (x in the low byte).
+   uint16_t oct_encode(GLfloat nx, GLfloat ny, GLfloat nz)
+   //-----------------------------------------------------
+   {
+      const float l1 = fabsf(nx) + fabsf(ny) + fabsf(nz);
+      if (l1 <= 0) return 0;
+      float u = nx / l1, v = ny / l1;
+      if (nz < 0)
+      {
+         const float ou = u;
+         u = (1.0f - fabsf(v)) * ((ou >= 0) ? 1.0f : -1.0f);
+         v = (1.0f - fabsf(ou)) * ((v >= 0) ? 1.0f : -1.0f);
+      }
+      const auto qu = static_cast<uint16_t>(lroundf((u*0.5f + 0.5f) * 255.0f));
+      const auto qv = static_cast<uint16_t>(lroundf((v*0.5f + 0.5f) * 255.0f));
+      return static_cast<uint16_t>(qu | (qv << 8));
+   }
+
+   inline uint16_t quantize16(GLfloat v, GLfloat min, GLfloat range)
+   {
+      if (range <= 0) return 0;
+      return static_cast<uint16_t>(lroundf(glm::clamp((v - min) / range, 0.0f, 1.0f) * 65535.0f));
+   }
+
+   inline uint8_t quantize8(GLfloat v) { return static_cast<uint8_t>(lroundf(glm::clamp(v, 0.0f, 1.0f) * 255.0f)); }
+
+   void pack_vertices(const GLfloat* vertices, PointCloudData& data)
+   //---------------------------------------------------------------
+   {
+      data.vertices.resize(data.count);
+      const GLfloat* vertices_ptr = vertices;
+      for (size_t i=0; i<data.count; i++, vertices_ptr += VERTEX_FLOATS)
+      {
+         PointCloudData::PackedVertex& v = data.vertices[i];
+         v.x = quantize16(vertices_ptr[0], data.minx, data.rangex);
+         v.y = quantize16(vertices_ptr[1], data.miny, data.rangey);
+         v.z = quantize16(vertices_ptr[2], data.minz, data.rangez);
+         v.r = quantize8(vertices_ptr[4]);
+         v.g = quantize8(vertices_ptr[5]);
+         v.b = quantize8(vertices_ptr[6]);
+         v.a = quantize8(vertices_ptr[7]);
+         v.normal = oct_encode(vertices_ptr[8], vertices_ptr[9], vertices_ptr[10]);
+      }
+   }
+}
+
+std::string PointCloudOptions::key() const
+//----------------------------------------
+{
+   struct stat st;
+   if ( (plyfile.empty()) || (stat(plyfile.c_str(), &st) != 0) )
+      return "";
+   std::stringstream ss;
+   ss << filesystem::canonical(filesystem::path(plyfile)).string() << '|' << st.st_size << '|' << st.st_mtime << '|'
+      << scale << '|' << yz_flip << '|' << mean_center << '|' << lit << '|' << normal_k << '|' << spatial_sort;
+   return ss.str();
+}
+
+void PointCloudCache::normal_cache_directory(const std::string& directory)
+//-----------------------------------------------------------------------
+{
+   std::lock_guard<std::mutex> lock(mutex);
+   normal_directory = directory;
+}
+
+std::string PointCloudCache::normal_cache_directory()
+//---------------------------------------------------
+{
+   std::lock_guard<std::mutex> lock(mutex);
+   return normal_directory;
+}
+
+// Normal cache files for plyfile in the order they are tried: the cache directory (if set) then the side file.
+std::vector<std::string> PointCloudCache::normal_caches(const std::string& plyfile)
+//---------------------------------------------------------------------------------
+{
+   std::vector<std::string> caches;
+   const std::string directory = normal_cache_directory();
+   if (! directory.empty())
+   {
+      const filesystem::path path = filesystem::absolute(filesystem::path(plyfile));
+      std::stringstream name;
+      name << path.stem().string() << '-' << std::hex << std::hash<std::string>()(path.string()) << ".normals";
+      caches.push_back((filesystem::path(directory) / name.str()).string());
+   }
+   caches.push_back(plyfile + ".normals");
+   return caches;
+}
+
+bool PointCloudCache::init_normals(const PointCloudOptions& options, GLfloat* vertices, size_t count)
+//---------------------------------------------------------------------------------------------------
+{
+   PointCloudCache& cache = instance();
+   const std::vector<std::string> caches = cache.normal_caches(options.plyfile);
+   std::vector<float> normals;
+   const uint32_t flags = (options.yz_flip) ? 1 : 0;
+   bool is_cached = false;
+   for (const std::string& file : caches)
+   {
+      if (pcutil::load_normals(file, options.plyfile, count, options.normal_k, flags, normals))
+      {
+         is_cached = true;
+         break;
+      }
+   }
+   if (! is_cached)
+   {
+      auto start = std::chrono::high_resolution_clock::now();
+      pcutil::estimate_normals(vertices, VERTEX_FLOATS, count, normals, options.normal_k);
+      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now()
+                                                                           - start).count();
+      std::cout << "Estimated " << count << " normals for " << options.plyfile << " in " << elapsed << "ms"
+                << std::endl;
+      bool is_saved = false;
+      std::string tried;
+      for (const std::string& file : caches)
+      {
+         // A directory that cannot be created shows up as a failed save below.
+         try
+         {
+            filesystem::create_directories(filesystem::path(file).parent_path());
+         }
+         catch (std::exception&)
+         {
+         }
+         if (pcutil::save_normals(file, options.plyfile, count, options.normal_k, flags, normals))
+         {
+            is_saved = true;
+            break;
+         }
+         const filesystem::path parent = filesystem::path(file).parent_path();
+         tried += (tried.empty() ? "" : " or ") + (parent.empty() ? std::string(".") : parent.string());
+      }
+      if (! is_saved)
+      {
+         std::lock_guard<std::mutex> lock(cache.mutex);
+         if (cache.unwritable_caches.insert(tried).second)
+            std::cerr << "Could not write normal caches to " << tried << ", normals will be estimated on every load"
+                      << " (see PointCloudCache::normal_cache_directory)" << std::endl;
+      }
+   }
+   if (normals.size() != count*3)
+      return false;
+   GLfloat* vertices_ptr = vertices + 8;
+   for (size_t i=0; i<count; i++, vertices_ptr += VERTEX_FLOATS)
+   {
+      vertices_ptr[0] = normals[i*3];
+      vertices_ptr[1] = normals[i*3 + 1];
+      vertices_ptr[2] = normals[i*3 + 2];
+   }
+   return true;
+}
+
+std::shared_ptr<const PointCloudData> PointCloudCache::get(const PointCloudOptions& options)
+//------------------------------------------------------------------------------------------
+{
+   const std::string key = options.key();
+   if (key.empty())
+   {
+      std::cerr << "Could not open pointcloud file " << options.plyfile << std::endl;
+      return nullptr;
+   }
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = clouds.find(key);
+      if (it != clouds.end())
+      {
+         std::shared_ptr<const PointCloudData> data = it->second.lock();
+         if (data)
+            return data;
+      }
+   }
+
+   std::shared_ptr<const PointCloudData> loaded = load(options);
+   if (! loaded)
+      return nullptr;
+
+   std::lock_guard<std::mutex> lock(mutex);
+   for (auto it = clouds.begin(); it != clouds.end(); )
+   {
+      if (it->second.expired())
+         it = clouds.erase(it);
+      else
+         ++it;
+   }
+   std::weak_ptr<const PointCloudData>& entry = clouds[key];
+   std::shared_ptr<const PointCloudData> data = entry.lock();
+   if (data)
+      return data; // Loaded concurrently by another thread
+   entry = loaded;
+   return loaded;
+}
+
+std::shared_ptr<const GLuint> PointCloudCache::vertex_buffer(const std::shared_ptr<const PointCloudData>& data,
+                                                             const void* share_group)
+//--------------------------------------------------------------------------------------------------------------
+{
+   if (! data) return nullptr;
+   std::lock_guard<std::mutex> lock(mutex);
+   for (auto it = buffers.begin(); it != buffers.end(); )
+   {
+      if (it->second.expired())
+         it = buffers.erase(it);
+      else
+         ++it;
+   }
+   std::weak_ptr<const GLuint>& entry = buffers[std::make_pair(share_group, data.get())];
+   std::shared_ptr<const GLuint> buffer = entry.lock();
+   if (buffer)
+      return buffer;
+
+   oglutil::clearGLErrors();
+   GLuint vbo = 0;
+   glGenBuffers(1, &vbo);
+   glBindBuffer(GL_ARRAY_BUFFER, vbo);
+   glBufferData(GL_ARRAY_BUFFER, data->count*sizeof(PointCloudData::PackedVertex), data->vertices.data(),
+                GL_STATIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   GLenum err;
+   std::stringstream errs;
+   errs << "OpenGL error loading pointcloud vertices: ";
+   if (! oglutil::isGLOk(err, &errs))
+   {
+      std::cerr << errs.str().c_str() << std::endl;
+      glDeleteBuffers(1, &vbo);
+      buffers.erase(std::make_pair(share_group, data.get()));
+      return nullptr;
+   }
+   // The deleter holds a reference to the data so the key cannot be reused while the buffer exists.
+   std::shared_ptr<const PointCloudData> owner(data);
+   buffer = std::shared_ptr<const GLuint>(new GLuint(vbo), [owner](const GLuint* p)
+   {
+      glDeleteBuffers(1, p);
+      delete p;
+   });
+   entry = buffer;
+   return buffer;
+}
+
+std::shared_ptr<PointCloudData> PointCloudCache::load(const PointCloudOptions& options)
+//-------------------------------------------------------------------------------------
+{
+   const filesystem::path plyfile(options.plyfile);
+   std::ifstream ifs(plyfile.c_str(), std::ios::binary);
+   if (ifs.fail())
+   {
+      std::cerr << "Could not open pointcloud file " << plyfile.filename() << std::endl;;
+      return nullptr;
+   }
+   std::shared_ptr<PointCloudData> data = std::make_shared<PointCloudData>();
+   data->options = options;
+   tinyply::PlyFile file;
+   std::shared_ptr<tinyply::PlyData> verts, colors, normals;
+   bool is_color_pointcloud = false, is_alpha_pointcloud = false, is_normal_pointcloud = false;
+   try
+   {
+      if (! file.parse_header(ifs))
+      {
+         std::cerr << "Could not parse pointcloud file header for " << plyfile.filename() << std::endl;
+         return nullptr;
+      }
+      for (auto e : file.get_elements())
+      {
+         if (e.name == "vertex")
+         {
+            for (auto p : e.properties)
+            {
+               if ( (p.name == "red") || (p.name == "green") || (p.name == "blue") )
+                  is_color_pointcloud = true;
+               if (p.name == "alpha")
+                  is_alpha_pointcloud = true;
+               if (p.name == "nx")
+                  is_normal_pointcloud = true;
+            }
+         }
+      }
+
+      verts = file.request_properties_from_element("vertex", { "x", "y", "z" });
+      try
+      {
+         if (is_alpha_pointcloud)
+            colors = file.request_properties_from_element("vertex", {"red", "green", "blue", "alpha"});
+         else
+            colors = file.request_properties_from_element("vertex", {"red", "green", "blue"});
+      }
+      catch (const std::exception & e)
+      {
+         is_color_pointcloud = is_alpha_pointcloud = false;
+         std::cerr << "Could not read colors from pointcloud file " << plyfile.filename() << std::endl;
+      }
+      if ( (options.lit) && (is_normal_pointcloud) )
+      {
+         try
+         {
+            normals = file.request_properties_from_element("vertex", {"nx", "ny", "nz"});
+         }
+         catch (const std::exception & e)
+         {
+            is_normal_pointcloud = false;
+            std::cerr << "Could not read normals from pointcloud file " << plyfile.filename() << std::endl;
+         }
+      }
+      file.read(ifs);
+   }
+   catch (const std::exception & e)
+   {
+      std::cerr << "Exception: " << e.what() << " reading ply file " << plyfile.filename() << std::endl;
+      return nullptr;
+   }
+   if ( (! verts) || (verts->count == 0) )
+   {
+      std::stringstream ss;
+      ss << "No vertices in file " << plyfile.filename();
+      std::cerr << ss.str().c_str() << std::endl;
+      return nullptr;
+   }
+   if ( (! colors) || (colors->count == 0) )
+      is_color_pointcloud = is_alpha_pointcloud = false;
+   if ( (! normals) || (normals->count != verts->count) || (normals->t != tinyply::Type::FLOAT32) )
+      is_normal_pointcloud = false;
+
+   const size_t count = verts->count;
+   struct RGB { u_char r,g,b; };
+   struct RGBA { u_char r,g,b,a; };
+   std::vector<GLfloat> Xs, Ys, Zs;
+   auto vertdata = reinterpret_cast<float3 *>(verts->buffer.get());
+   auto normaldata = (is_normal_pointcloud) ? reinterpret_cast<float3 *>(normals->buffer.get()) : nullptr;
+   RGB* RGBdata = nullptr;
+   RGBA* RGBAdata = nullptr;
+   if (is_color_pointcloud)
+   {
+      if (is_alpha_pointcloud)
+         RGBAdata = reinterpret_cast<RGBA *>(colors->buffer.get());
+      else
+         RGBdata = reinterpret_cast<RGB *>(colors->buffer.get());
+   }
+
+   const size_t buffer_size = count*VERTEX_FLOATS;
+   std::unique_ptr<GLfloat[]> vertices(new GLfloat[buffer_size]);
+   GLfloat *vertices_ptr = vertices.get();
+#ifndef NDEBUG
+   GLfloat *vertices_ptr_end = &vertices_ptr[buffer_size];
+#endif
+   const GLfloat flip = (options.yz_flip) ? -1 : 1;
+   const GLfloat scale = options.scale;
+   double totalx = 0, totaly = 0, totalz = 0;
+   double n = 0;
+   if (! options.mean_center)
+   {
+      Xs.resize(count);
+      Ys.resize(count);
+      Zs.resize(count);
+   }
+   float minx = std::numeric_limits<float>::max(), maxx = std::numeric_limits<float>::lowest(),
+         miny = std::numeric_limits<float>::max(), maxy = std::numeric_limits<float>::lowest(),
+         minz = std::numeric_limits<float>::max(), maxz = std::numeric_limits<float>::lowest();
+   GLfloat x, y, z, red =1.0f, green =0, blue =0, alpha =1.0f, nx =0, ny =0, nz =0;
+   for (size_t i=0; i<count; i++)
+   {
+      float3 item = vertdata[i];
+      x = item.x * scale;
+      y = item.y * scale*flip;
+      z = item.z * scale*flip;
+      if ( (is_color_pointcloud) && (i < colors->count) )
+      {
+         if (is_alpha_pointcloud)
+         {
+            red = static_cast<float>(RGBAdata[i].r) / 255.0f;
+            green = static_cast<float>(RGBAdata[i].g) / 255.0f;
+            blue = static_cast<float>(RGBAdata[i].b) / 255.0f;
+            alpha = static_cast<float>(RGBAdata[i].a) / 255.0f;
+         }
+         else
+         {
+            red = static_cast<float>(RGBdata[i].r) / 255.0f;
+            green = static_cast<float>(RGBdata[i].g) / 255.0f;
+            blue = static_cast<float>(RGBdata[i].b) / 255.0f;
+            alpha = 1.0f;
+         }
+      }
+      else
+      {
+         red = alpha = 1.0f;
+         green = blue = 0;
+      }
+      if (normaldata != nullptr)
+      {
+         nx = normaldata[i].x;
+         ny = normaldata[i].y*flip;
+         nz = normaldata[i].z*flip;
+      }
+      _push_vertex(vertices_ptr, x, y, z, 1, red, green, blue, alpha, nx, ny, nz);
+      if (! options.mean_center)
+      {
+         Xs[i] = x;
+         Ys[i] = y;
+         Zs[i] = z;
+      }
+      if (x < minx) minx = x;
+      if (x > maxx) maxx = x;
+      if (y < miny) miny = y;
+      if (y > maxy) maxy = y;
+      if (z < minz) minz = z;
+      if (z > maxz) maxz = z;
+      totalx += x; totaly += y; totalz += z;
+      n++;
+   }
+   assert(vertices_ptr == vertices_ptr_end);
+   data->count = count;
+   data->is_color = is_color_pointcloud;
+   data->is_alpha = is_alpha_pointcloud;
+   data->has_normals = (normaldata != nullptr);
+   if ( (options.lit) && (! data->has_normals) )
+      data->has_normals = init_normals(options, vertices.get(), count);
+   data->minx = minx; data->maxx = maxx; data->miny = miny; data->maxy = maxy; data->minz = minz; data->maxz = maxz;
+   data->rangex = fabsf(maxx - minx); data->rangey = fabsf(maxy - miny); data->rangez = fabsf(maxz - minz);
+   data->max_r = sqrtf(data->rangex*data->rangex + data->rangey*data->rangey + data->rangez*data->rangez);
+   const size_t chunk_points = PointCloudData::CHUNK_POINTS;
+   std::vector<size_t> boundaries;
+   if (options.spatial_sort)
+   {
+      const float mins[3] = { minx, miny, minz }, maxs[3] = { maxx, maxy, maxz };
+      std::vector<uint64_t> codes;
+      std::vector<uint32_t> order = pcutil::morton_order(vertices.get(), VERTEX_FLOATS, count, mins, maxs, 0, &codes);
+      pcutil::permute(vertices.get(), VERTEX_FLOATS, count, order);
+      boundaries = pcutil::morton_chunks(codes, chunk_points);
+   }
+   else
+   {
+      for (size_t start = 0; start < count; start += chunk_points)
+         boundaries.push_back(start);
+      boundaries.push_back(count);
+   }
+   pcutil::permute(vertices.get(), VERTEX_FLOATS, count, pcutil::progressive_order(boundaries));
+   // Bounds are padded by one quantization step as the shader sees the 16 bit quantized positions.
+   const float padx = data->rangex/65535.0f, pady = data->rangey/65535.0f, padz = data->rangez/65535.0f;
+   for (size_t chunk = 0; chunk + 1 < boundaries.size(); chunk++)
+   {
+      const size_t start = boundaries[chunk], end = boundaries[chunk + 1];
+      data->chunk_first.push_back(static_cast<GLint>(start));
+      data->chunk_count.push_back(static_cast<GLsizei>(end - start));
+      float mins[3] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                        std::numeric_limits<float>::max() };
+      float maxs[3] = { std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(),
+                        std::numeric_limits<float>::lowest() };
+      for (const GLfloat* p = &vertices[start*VERTEX_FLOATS]; p < &vertices[end*VERTEX_FLOATS]; p += VERTEX_FLOATS)
+      {
+         for (int a = 0; a < 3; a++)
+         {
+            if (p[a] < mins[a]) mins[a] = p[a];
+            if (p[a] > maxs[a]) maxs[a] = p[a];
+         }
+      }
+      mins[0] -= padx; mins[1] -= pady; mins[2] -= padz;
+      maxs[0] += padx; maxs[1] += pady; maxs[2] += padz;
+      data->chunk_bounds.push_back(mins, maxs);
+      data->chunk_spacing.push_back(pcutil::estimate_spacing(&vertices[start*VERTEX_FLOATS], VERTEX_FLOATS,
+                                                             end - start));
+   }
+   if (options.mean_center)
+   {
+      const auto meanx = static_cast<float>(totalx / n);
+      const auto meany = static_cast<float>(totaly / n);
+      const auto meanz = static_cast<float>(totalz / n);
+      data->centroid = glm::vec3(meanx, meany, meanz);
+   }
+   else
+   {
+      std::nth_element(Xs.begin(), Xs.begin() + Xs.size() / 2, Xs.end());
+      std::nth_element(Ys.begin(), Ys.begin() + Ys.size() / 2, Ys.end());
+      std::nth_element(Zs.begin(), Zs.begin() + Zs.size() / 2, Zs.end());
+      const float medianx = Xs[Xs.size() / 2];
+      const float mediany = Ys[Ys.size() / 2];
+      const float medianz = Zs[Zs.size() / 2];
+      data->centroid = glm::vec3(medianx, mediany, medianz);
+   }
+   pack_vertices(vertices.get(), *data);
+   return data;
+}
@@ -0,0 +1,143 @@
+/*
+Copyright (c) 2017 Donald Munro
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+/*
+ * Process wide cache of loaded point clouds. Point cloud data is keyed by the identity of the ply file
+ * (canonical path, size and modification time) and the load options, and is reference counted so that it is
+ * freed when the last window using it releases it. GPU vertex buffers are additionally keyed by the GL share group
+ * so that windows whose contexts share objects also share the buffers.
+ */
+#ifndef FIBERGL_POINTCLOUDCACHE_H
+#define FIBERGL_POINTCLOUDCACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "OGLFiberWin.hh"
+#include "PointCloudUtils.h"
+
+struct PointCloudOptions
+//======================
+{
+   std::string plyfile;
+   float scale = 1.0f;          // Scale points factor to increase spacing
+   bool yz_flip = false;        // Flip Y positive down, Z forward clouds to the OpenGL coordinate system
+   bool mean_center = true;     // Use the mean (true) or median (false) as the centroid
+   bool lit = true;             // Read or estimate normals
+   int normal_k = 16;           // Neighbours used when estimating normals
+   bool spatial_sort = true;    // Sort into Morton order before upload
+
+   // Cache key, empty if the file does not exist.
+   std::string key() const;
+};
+
+struct PointCloudData
+//===================
+{
+   // GPU vertex layout: position quantized to 16 bits over the bounding box, octahedral encoded normal (8 bits
+   // per component) and RGBA8 color, decoded in the cloud vertex shader.
+   struct PackedVertex
+   {
+      uint16_t x, y, z, normal;
+      uint8_t r, g, b, a;
+   };
+   static constexpr size_t CHUNK_POINTS = 16384; // Maximum points per chunk
+
+   PointCloudOptions options;
+   std::vector<PackedVertex> vertices;
+   size_t count = 0;
+   float minx = 0, maxx = 0, miny = 0, maxy = 0, minz = 0, maxz = 0, rangex = 0, rangey = 0, rangez = 0, max_r = 0;
+   glm::vec3 centroid{0, 0, 0};
+   bool is_color = false, is_alpha = false, has_normals = false;
+   // Spatial chunks (octree cells, see pcutil::morton_chunks) used for frustum culling, with the points of each
+   // chunk in progressive order (see pcutil::progressive_order). If the cloud is not spatially sorted the chunks
+   // are just consecutive runs of points and their bounds overlap.
+   std::vector<GLint> chunk_first;
+   std::vector<GLsizei> chunk_count;
+   pcutil::AABBs chunk_bounds;
+   std::vector<float> chunk_spacing; // Estimated mean point spacing of each chunk (see pcutil::estimate_spacing)
+
+   glm::vec3 position(size_t i) const
+   {
+      const PackedVertex& v = vertices[i];
+      return glm::vec3(minx + v.x*(rangex/65535.0f), miny + v.y*(rangey/65535.0f), minz + v.z*(rangez/65535.0f));
+   }
+};
+
+class PointCloudCache
+//===================
+{
+public:
+   static PointCloudCache& instance()
+   {
+      static PointCloudCache instance;
+      return instance;
+   }
+
+   /**
+    * Returns the cached point cloud for options, loading it if it is not already held by another user.
+    * Returns nullptr (after logging to std::cerr) if the file cannot be loaded. Thread safe; loading is done
+    * without holding the cache lock so two threads asking for the same uncached cloud may both load it, in which
+    * case the first to finish is kept.
+    */
+   std::shared_ptr<const PointCloudData> get(const PointCloudOptions& options);
+
+   /**
+    * Returns the vertex buffer for data in the GL share group identified by share_group, creating and uploading it
+    * in the current context if no window in the group holds it. The buffer is deleted when the last holder
+    * releases it, which must happen with a context of the group current.
+    */
+   std::shared_ptr<const GLuint> vertex_buffer(const std::shared_ptr<const PointCloudData>& data,
+                                               const void* share_group);
+
+   /**
+    * Directory in which normals estimated for clouds without them are cached, created if necessary. The files are
+    * named <ply stem>-<hash of the ply path>.normals so that clouds with the same name do not collide. When empty
+    * (the default), or if the directory cannot be written, they are cached next to the ply file in
+    * <plyfile>.normals. If neither can be written this is reported once per location and the normals are
+    * estimated again whenever the cloud is loaded.
+    */
+   void normal_cache_directory(const std::string& directory);
+
+   std::string normal_cache_directory();
+
+private:
+   std::mutex mutex;
+   std::unordered_map<std::string, std::weak_ptr<const PointCloudData>> clouds;
+   std::map<std::pair<const void*, const PointCloudData*>, std::weak_ptr<const GLuint>> buffers;
+   std::string normal_directory;
+   std::unordered_set<std::string> unwritable_caches; // locations already reported as not writable
+
+   PointCloudCache() = default;
+   PointCloudCache(const PointCloudCache&)= delete;
+   PointCloudCache& operator=(const PointCloudCache&)= delete;
+
+   static std::shared_ptr<PointCloudData> load(const PointCloudOptions& options);
+   static bool init_normals(const PointCloudOptions& options, GLfloat* vertices, size_t count);
+   std::vector<std::string> normal_caches(const std::string& plyfile);
+};
+#endif //FIBERGL_POINTCLOUDCACHE_H
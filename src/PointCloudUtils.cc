@@ -0,0 +1,686 @@
+/*
+Copyright (c) 2017 Donald Munro
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "PointCloudUtils.h"
+
+#include <sys/stat.h>
+
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <array>
+#include <algorithm>
+#include <utility>
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define PCUTIL_SSE 1
+#endif
+
+namespace pcutil
+{
+   unsigned default_threads()
+   //------------------------
+   {
+      unsigned n = std::thread::hardware_concurrency();
+      return (n == 0) ? 4 : n;
+   }
+
+   namespace
+   {
+      // Split [0, count) into contiguous ranges and run fn(thread_no, start, end) for each range on its own thread.
+      template <typename F>
+      void parallel_for(unsigned threads, size_t count, F fn)
+      //-----------------------------------------------------
+      {
+         if (threads <= 1)
+         {
+            fn(0U, static_cast<size_t>(0), count);
+            return;
+         }
+         const size_t per_thread = (count + threads - 1) / threads;
+         std::vector<std::thread> workers;
+         for (unsigned t = 0; t < threads; t++)
+         {
+            const size_t start = t*per_thread, end = std::min(count, start + per_thread);
+            if (start >= end) break;
+            workers.emplace_back(fn, t, start, end);
+         }
+         for (std::thread& worker : workers)
+            worker.join();
+      }
+
+      static const int MAX_K = 64;
+
+      struct Neighbours
+      //===============
+      {
+         int k, size = 0;
+         std::pair<float, uint32_t> heap[MAX_K];
+
+         explicit Neighbours(int k) : k(k) {}
+
+         void clear() { size = 0; }
+
+         float worst() const { return (size < k) ? std::numeric_limits<float>::max() : heap[0].first; }
+
+         void add(float d2, uint32_t i)
+         {
+            if (size < k)
+            {
+               heap[size++] = std::make_pair(d2, i);
+               std::push_heap(heap, heap + size);
+            }
+            else if (d2 < heap[0].first)
+            {
+               std::pop_heap(heap, heap + size);
+               heap[size - 1] = std::make_pair(d2, i);
+               std::push_heap(heap, heap + size);
+            }
+         }
+      };
+
+      // Implicit kd-tree: the node for a range [lo, hi) of index is at mid = lo + (hi - lo)/2 with its split axis
+      // stored in axis[mid]. Ranges of LEAF or fewer points are searched brute force.
+      struct KdTree
+      //===========
+      {
+         const float* pts;
+         size_t stride;
+         std::vector<uint32_t> index;
+         std::vector<uint8_t> axis;
+         static const size_t LEAF = 8;
+
+         KdTree(const float* positions, size_t stride, size_t count, unsigned threads) :
+            pts(positions), stride(stride), index(count), axis(count, 0)
+         {
+            for (size_t i = 0; i < count; i++)
+               index[i] = static_cast<uint32_t>(i);
+            int parallel_depth = 0;
+            while ( (1U << parallel_depth) < threads ) parallel_depth++;
+            build(0, count, parallel_depth);
+         }
+
+         inline const float* point(uint32_t i) const { return &pts[i*stride]; }
+
+         inline float distance2(const float* q, uint32_t i) const
+         {
+            const float* p = point(i);
+            const float dx = q[0] - p[0], dy = q[1] - p[1], dz = q[2] - p[2];
+            return dx*dx + dy*dy + dz*dz;
+         }
+
+         void build(size_t lo, size_t hi, int parallel_depth)
+         //--------------------------------------------------
+         {
+            if ((hi - lo) <= LEAF) return;
+            float mins[3] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                              std::numeric_limits<float>::max() };
+            float maxs[3] = { std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(),
+                              std::numeric_limits<float>::lowest() };
+            for (size_t i = lo; i < hi; i++)
+            {
+               const float* p = point(index[i]);
+               for (int a = 0; a < 3; a++)
+               {
+                  if (p[a] < mins[a]) mins[a] = p[a];
+                  if (p[a] > maxs[a]) maxs[a] = p[a];
+               }
+            }
+            int a = 0;
+            if ((maxs[1] - mins[1]) > (maxs[a] - mins[a])) a = 1;
+            if ((maxs[2] - mins[2]) > (maxs[a] - mins[a])) a = 2;
+            const size_t mid = lo + (hi - lo) / 2;
+            std::nth_element(index.begin() + lo, index.begin() + mid, index.begin() + hi,
+                             [this, a](uint32_t i, uint32_t j) { return point(i)[a] < point(j)[a]; });
+            axis[mid] = static_cast<uint8_t>(a);
+            if (parallel_depth > 0)
+            {
+               std::thread left(&KdTree::build, this, lo, mid, parallel_depth - 1);
+               build(mid + 1, hi, parallel_depth - 1);
+               left.join();
+            }
+            else
+            {
+               build(lo, mid, 0);
+               build(mid + 1, hi, 0);
+            }
+         }
+
+         void knn(const float* q, size_t lo, size_t hi, Neighbours& nn) const
+         //-------------------------------------------------------------------
+         {
+            if ((hi - lo) <= LEAF)
+            {
+               for (size_t i = lo; i < hi; i++)
+                  nn.add(distance2(q, index[i]), index[i]);
+               return;
+            }
+            const size_t mid = lo + (hi - lo) / 2;
+            const uint32_t p = index[mid];
+            const int a = axis[mid];
+            const float diff = q[a] - point(p)[a];
+            nn.add(distance2(q, p), p);
+            if (diff < 0)
+            {
+               knn(q, lo, mid, nn);
+               if ((diff*diff) < nn.worst())
+                  knn(q, mid + 1, hi, nn);
+            }
+            else
+            {
+               knn(q, mid + 1, hi, nn);
+               if ((diff*diff) < nn.worst())
+                  knn(q, lo, mid, nn);
+            }
+         }
+      };
+
+      // Cyclic Jacobi on a symmetric 3x3 matrix, returns the (unit) eigenvector of the smallest eigenvalue.
+      void smallest_eigenvector(double a[3][3], float* normal)
+      //------------------------------------------------------
+      {
+         double v[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+         for (int sweep = 0; sweep < 16; sweep++)
+         {
+            const double off = a[0][1]*a[0][1] + a[0][2]*a[0][2] + a[1][2]*a[1][2];
+            if (off < 1e-30)
+               break;
+            for (int p = 0; p < 2; p++)
+            {
+               for (int q = p + 1; q < 3; q++)
+               {
+                  if (fabs(a[p][q]) < 1e-30)
+                     continue;
+                  const double theta = (a[q][q] - a[p][p]) / (2.0*a[p][q]);
+                  const double t = ((theta >= 0) ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta*theta + 1.0));
+                  const double c = 1.0 / sqrt(t*t + 1.0), s = t*c;
+                  for (int k = 0; k < 3; k++)
+                  {
+                     const double akp = a[k][p], akq = a[k][q];
+                     a[k][p] = c*akp - s*akq;
+                     a[k][q] = s*akp + c*akq;
+                  }
+                  for (int k = 0; k < 3; k++)
+                  {
+                     const double apk = a[p][k], aqk = a[q][k];
+                     a[p][k] = c*apk - s*aqk;
+                     a[q][k] = s*apk + c*aqk;
+                  }
+                  for (int k = 0; k < 3; k++)
+                  {
+                     const double vkp = v[k][p], vkq = v[k][q];
+                     v[k][p] = c*vkp - s*vkq;
+                     v[k][q] = s*vkp + c*vkq;
+                  }
+               }
+            }
+         }
+         int m = 0;
+         if (a[1][1] < a[m][m]) m = 1;
+         if (a[2][2] < a[m][m]) m = 2;
+         const double len = sqrt(v[0][m]*v[0][m] + v[1][m]*v[1][m] + v[2][m]*v[2][m]);
+         if (len > 0)
+         {
+            normal[0] = static_cast<float>(v[0][m] / len);
+            normal[1] = static_cast<float>(v[1][m] / len);
+            normal[2] = static_cast<float>(v[2][m] / len);
+         }
+         else
+            normal[0] = normal[1] = normal[2] = 0;
+      }
+
+      void normals_range(const KdTree& tree, size_t start, size_t end, int k, float* normals)
+      //-------------------------------------------------------------------------------------
+      {
+         Neighbours nn(k);
+         const size_t n = tree.index.size();
+         for (size_t i = start; i < end; i++)
+         {
+            const float* q = tree.point(static_cast<uint32_t>(i));
+            nn.clear();
+            tree.knn(q, 0, n, nn);
+            float* normal = &normals[i*3];
+            if (nn.size < 3)
+            {
+               normal[0] = normal[1] = normal[2] = 0;
+               continue;
+            }
+            double mean[3] = { 0, 0, 0 };
+            for (int j = 0; j < nn.size; j++)
+            {
+               const float* p = tree.point(nn.heap[j].second);
+               mean[0] += p[0]; mean[1] += p[1]; mean[2] += p[2];
+            }
+            mean[0] /= nn.size; mean[1] /= nn.size; mean[2] /= nn.size;
+            double cov[3][3] = { { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 } };
+            for (int j = 0; j < nn.size; j++)
+            {
+               const float* p = tree.point(nn.heap[j].second);
+               const double d[3] = { p[0] - mean[0], p[1] - mean[1], p[2] - mean[2] };
+               for (int r = 0; r < 3; r++)
+                  for (int c = r; c < 3; c++)
+                     cov[r][c] += d[r]*d[c];
+            }
+            cov[1][0] = cov[0][1]; cov[2][0] = cov[0][2]; cov[2][1] = cov[1][2];
+            smallest_eigenvector(cov, normal);
+         }
+      }
+   }
+
+   void estimate_normals(const float* positions, size_t stride, size_t count, std::vector<float>& normals,
+                         int k, unsigned threads)
+   //-------------------------------------------------------------------------------------------------------
+   {
+      normals.assign(count*3, 0.0f);
+      if ( (positions == nullptr) || (count < 3) )
+         return;
+      if (threads == 0) threads = default_threads();
+      k = std::max(3, std::min(k, MAX_K));
+      KdTree tree(positions, stride, count, threads);
+      float* normals_ptr = normals.data();
+      parallel_for(threads, count, [&tree, k, normals_ptr](unsigned, size_t start, size_t end)
+      {
+         normals_range(tree, start, end, k, normals_ptr);
+      });
+   }
+
+   namespace
+   {
+      struct NormalCacheHeader
+      {
+         char magic[4];
+         uint32_t version;
+         uint64_t count;
+         int32_t k;
+         uint32_t flags;
+         uint64_t source_size;
+         int64_t source_mtime;
+      };
+
+      bool cache_header(const std::string& source_file, size_t count, int k, uint32_t flags, NormalCacheHeader& hdr)
+      //-----------------------------------------------------------------------------------------------------------
+      {
+         struct stat st;
+         if (stat(source_file.c_str(), &st) != 0)
+            return false;
+         std::memset(&hdr, 0, sizeof(hdr));
+         std::memcpy(hdr.magic, "FGLN", 4);
+         hdr.version = 1;
+         hdr.count = count;
+         hdr.k = k;
+         hdr.flags = flags;
+         hdr.source_size = static_cast<uint64_t>(st.st_size);
+         hdr.source_mtime = static_cast<int64_t>(st.st_mtime);
+         return true;
+      }
+   }
+
+   bool load_normals(const std::string& cache_file, const std::string& source_file, size_t count, int k,
+                     uint32_t flags, std::vector<float>& normals)
+   //----------------------------------------------------------------------------------------------------
+   {
+      NormalCacheHeader expected, hdr;
+      if (! cache_header(source_file, count, k, flags, expected))
+         return false;
+      std::ifstream ifs(cache_file, std::ios::binary);
+      if (! ifs.good())
+         return false;
+      ifs.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+      if ( (! ifs.good()) || (std::memcmp(&hdr, &expected, sizeof(hdr)) != 0) )
+         return false;
+      normals.resize(count*3);
+      ifs.read(reinterpret_cast<char *>(normals.data()), normals.size()*sizeof(float));
+      if (ifs.gcount() != static_cast<std::streamsize>(normals.size()*sizeof(float)))
+      {
+         normals.clear();
+         return false;
+      }
+      return true;
+   }
+
+   bool save_normals(const std::string& cache_file, const std::string& source_file, size_t count, int k,
+                     uint32_t flags, const std::vector<float>& normals)
+   //----------------------------------------------------------------------------------------------------
+   {
+      NormalCacheHeader hdr;
+      if ( (normals.size() != count*3) || (! cache_header(source_file, count, k, flags, hdr)) )
+         return false;
+      std::ofstream ofs(cache_file, std::ios::binary | std::ios::trunc);
+      if (! ofs.good())
+         return false;
+      ofs.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+      ofs.write(reinterpret_cast<const char *>(normals.data()), normals.size()*sizeof(float));
+      return ofs.good();
+   }
+
+   namespace
+   {
+      inline uint64_t split_by_3(uint64_t v)
+      {
+         v &= 0x1fffff;
+         v = (v | (v << 32)) & 0x1f00000000ffffULL;
+         v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+         v = (v | (v << 8))  & 0x100f00f00f00f00fULL;
+         v = (v | (v << 4))  & 0x10c30c30c30c30c3ULL;
+         v = (v | (v << 2))  & 0x1249249249249249ULL;
+         return v;
+      }
+   }
+
+   uint64_t morton_code(uint32_t x, uint32_t y, uint32_t z)
+   //------------------------------------------------------
+   {
+      return split_by_3(x) | (split_by_3(y) << 1) | (split_by_3(z) << 2);
+   }
+
+   void radix_sort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int key_bits, unsigned threads)
+   //--------------------------------------------------------------------------------------------------------
+   {
+      const size_t n = keys.size();
+      if ( (n < 2) || (values.size() != n) )
+         return;
+      if (threads == 0) threads = default_threads();
+      threads = static_cast<unsigned>(std::max(static_cast<size_t>(1),
+                                               std::min(static_cast<size_t>(threads), n / 65536)));
+      std::vector<uint64_t> keys_tmp(n);
+      std::vector<uint32_t> values_tmp(n);
+      std::vector<std::array<size_t, 256>> histograms(threads);
+      for (int shift = 0; shift < key_bits; shift += 8)
+      {
+         const uint64_t* src_keys = keys.data();
+         parallel_for(threads, n, [&histograms, src_keys, shift](unsigned t, size_t start, size_t end)
+         {
+            std::array<size_t, 256>& histogram = histograms[t];
+            histogram.fill(0);
+            for (size_t i = start; i < end; i++)
+               histogram[(src_keys[i] >> shift) & 0xFF]++;
+         });
+
+         // Offsets per thread per digit such that each thread scatters its range stably after all lower digits
+         // and after the same digit from lower numbered threads.
+         size_t total = 0;
+         bool is_trivial = false;
+         for (int d = 0; d < 256; d++)
+         {
+            size_t digit_total = 0;
+            for (unsigned t = 0; t < threads; t++)
+            {
+               const size_t c = histograms[t][d];
+               histograms[t][d] = total + digit_total;
+               digit_total += c;
+            }
+            if (digit_total == n)
+               is_trivial = true;
+            total += digit_total;
+         }
+         if (is_trivial)
+            continue;
+
+         const uint32_t* src_values = values.data();
+         uint64_t* dst_keys = keys_tmp.data();
+         uint32_t* dst_values = values_tmp.data();
+         parallel_for(threads, n, [&histograms, src_keys, src_values, dst_keys, dst_values, shift]
+                                  (unsigned t, size_t start, size_t end)
+         {
+            std::array<size_t, 256>& offsets = histograms[t];
+            for (size_t i = start; i < end; i++)
+            {
+               const size_t j = offsets[(src_keys[i] >> shift) & 0xFF]++;
+               dst_keys[j] = src_keys[i];
+               dst_values[j] = src_values[i];
+            }
+         });
+         keys.swap(keys_tmp);
+         values.swap(values_tmp);
+      }
+   }
+
+   std::vector<uint32_t> morton_order(const float* positions, size_t stride, size_t count, const float mins[3],
+                                      const float maxs[3], unsigned threads, std::vector<uint64_t>* sorted_codes)
+   //-------------------------------------------------------------------------------------------------------------
+   {
+      std::vector<uint32_t> order(count);
+      std::vector<uint64_t> codes(count);
+      if (threads == 0) threads = default_threads();
+      const float max_q = static_cast<float>((1U << 21) - 1);
+      float inv_range[3];
+      for (int a = 0; a < 3; a++)
+      {
+         const float range = maxs[a] - mins[a];
+         inv_range[a] = (range > 0) ? max_q / range : 0;
+      }
+      parallel_for(threads, count, [&](unsigned, size_t start, size_t end)
+      {
+         uint32_t q[3];
+         for (size_t i = start; i < end; i++)
+         {
+            const float* p = &positions[i*stride];
+            for (int a = 0; a < 3; a++)
+               q[a] = static_cast<uint32_t>(std::min(max_q, std::max(0.0f, (p[a] - mins[a])*inv_range[a])));
+            codes[i] = morton_code(q[0], q[1], q[2]);
+            order[i] = static_cast<uint32_t>(i);
+         }
+      });
+      radix_sort(codes, order, 63, threads);
+      if (sorted_codes != nullptr)
+         sorted_codes->swap(codes);
+      return order;
+   }
+
+   namespace
+   {
+      void split_cell(const std::vector<uint64_t>& codes, size_t start, size_t end, int shift, size_t max_points,
+                      std::vector<size_t>& boundaries)
+      //---------------------------------------------------------------------------------------------------------
+      {
+         if ( (end - start <= max_points) || (shift < 0) )
+         {
+            boundaries.push_back(start);
+            return;
+         }
+         // All codes in [start, end) share the bits above shift so the child octants are consecutive runs. Runs
+         // of consecutive small siblings are merged into one chunk while they fit, larger children are split.
+         size_t child_start = start, run_start = start;
+         for (uint64_t octant = 0; octant < 8; octant++)
+         {
+            auto it = std::partition_point(codes.begin() + child_start, codes.begin() + end,
+                                           [shift, octant](uint64_t code) { return ((code >> shift) & 7) <= octant; });
+            const size_t child_end = static_cast<size_t>(it - codes.begin());
+            if (child_end - child_start > max_points)
+            {
+               if (run_start < child_start)
+                  boundaries.push_back(run_start);
+               split_cell(codes, child_start, child_end, shift - 3, max_points, boundaries);
+               run_start = child_end;
+            }
+            else if (child_end - run_start > max_points)
+            {
+               boundaries.push_back(run_start);
+               run_start = child_start;
+            }
+            child_start = child_end;
+         }
+         if (run_start < end)
+            boundaries.push_back(run_start);
+      }
+   }
+
+   std::vector<size_t> morton_chunks(const std::vector<uint64_t>& sorted_codes, size_t max_points)
+   //---------------------------------------------------------------------------------------------
+   {
+      const size_t count = sorted_codes.size();
+      std::vector<size_t> boundaries;
+      if (max_points == 0) max_points = count;
+      if (count > 0)
+         split_cell(sorted_codes, 0, count, 60, max_points, boundaries);
+      boundaries.push_back(count);
+      return boundaries;
+   }
+
+   std::vector<uint32_t> progressive_order(size_t count, size_t block_size)
+   //----------------------------------------------------------------------
+   {
+      std::vector<size_t> boundaries;
+      if (block_size == 0) block_size = count;
+      for (size_t start = 0; start < count; start += block_size)
+         boundaries.push_back(start);
+      boundaries.push_back(count);
+      return progressive_order(boundaries);
+   }
+
+   std::vector<uint32_t> progressive_order(const std::vector<size_t>& boundaries)
+   //----------------------------------------------------------------------------
+   {
+      std::vector<uint32_t> order;
+      if (boundaries.empty())
+         return order;
+      order.reserve(boundaries.back());
+      for (size_t block = 0; block + 1 < boundaries.size(); block++)
+      {
+         const size_t start = boundaries[block];
+         const size_t n = boundaries[block + 1] - start;
+         int bits = 0;
+         while ((static_cast<size_t>(1) << bits) < n) bits++;
+         const size_t m = static_cast<size_t>(1) << bits;
+         for (size_t j = 0; j < m; j++)
+         {
+            size_t r = 0;
+            for (int b = 0; b < bits; b++)
+               if (j & (static_cast<size_t>(1) << b))
+                  r |= static_cast<size_t>(1) << (bits - 1 - b);
+            if (r < n)
+               order.push_back(static_cast<uint32_t>(start + r));
+         }
+      }
+      return order;
+   }
+
+   void permute(float* data, size_t stride, size_t count, const std::vector<uint32_t>& order)
+   //----------------------------------------------------------------------------------------
+   {
+      if (order.size() != count)
+         return;
+      std::vector<float> copy(data, data + count*stride);
+      for (size_t i = 0; i < count; i++)
+         std::copy_n(&copy[order[i]*stride], stride, &data[i*stride]);
+   }
+
+   float estimate_spacing(const float* positions, size_t stride, size_t count, size_t sample)
+   //---------------------------------------------------------------------------------------
+   {
+      const size_t m = std::min(count, sample);
+      if (m < 2)
+         return 0;
+      double total = 0;
+      for (size_t i = 0; i < m; i++)
+      {
+         const float* p = &positions[i*stride];
+         float nearest = std::numeric_limits<float>::max();
+         for (size_t j = 0; j < m; j++)
+         {
+            if (i == j) continue;
+            const float* q = &positions[j*stride];
+            const float dx = p[0] - q[0], dy = p[1] - q[1], dz = p[2] - q[2];
+            nearest = std::min(nearest, dx*dx + dy*dy + dz*dz);
+         }
+         total += std::sqrt(nearest);
+      }
+      return static_cast<float>((total / m) * std::sqrt(static_cast<double>(m) / count));
+   }
+
+   void AABBs::push_back(const float mins[3], const float maxs[3])
+   //-------------------------------------------------------------
+   {
+      if (count % 4 == 0)
+      {
+         for (std::vector<float>* v : { &minx, &miny, &minz, &maxx, &maxy, &maxz })
+            v->resize(count + 4, 0.0f);
+      }
+      minx[count] = mins[0]; miny[count] = mins[1]; minz[count] = mins[2];
+      maxx[count] = maxs[0]; maxy[count] = maxs[1]; maxz[count] = maxs[2];
+      count++;
+   }
+
+   void frustum_planes(const float* m, float planes[6][4])
+   //-----------------------------------------------------
+   {
+      // Gribb/Hartmann: planes are row 3 +- rows 0 (left/right), 1 (bottom/top) and 2 (near/far).
+      for (int i = 0; i < 6; i++)
+      {
+         const int row = i / 2;
+         const float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+         for (int c = 0; c < 4; c++)
+            planes[i][c] = m[c*4 + 3] + sign*m[c*4 + row];
+         const float length = std::sqrt(planes[i][0]*planes[i][0] + planes[i][1]*planes[i][1] +
+                                        planes[i][2]*planes[i][2]);
+         if (length > 0)
+            for (int c = 0; c < 4; c++)
+               planes[i][c] /= length;
+      }
+   }
+
+   void cull_aabbs(const AABBs& boxes, const float planes[6][4], std::vector<uint32_t>& visible)
+   //-------------------------------------------------------------------------------------------
+   {
+      // A box is outside a plane if its corner furthest along the plane normal is behind it. For each axis that
+      // corner's term a*x is max(a*minx, a*maxx), which avoids selecting on the sign of a.
+#ifdef PCUTIL_SSE
+      for (size_t i = 0; i < boxes.count; i += 4)
+      {
+         const __m128 minx = _mm_loadu_ps(&boxes.minx[i]), miny = _mm_loadu_ps(&boxes.miny[i]),
+                      minz = _mm_loadu_ps(&boxes.minz[i]), maxx = _mm_loadu_ps(&boxes.maxx[i]),
+                      maxy = _mm_loadu_ps(&boxes.maxy[i]), maxz = _mm_loadu_ps(&boxes.maxz[i]);
+         __m128 outside = _mm_setzero_ps();
+         for (int p = 0; p < 6; p++)
+         {
+            const __m128 a = _mm_set1_ps(planes[p][0]), b = _mm_set1_ps(planes[p][1]), c = _mm_set1_ps(planes[p][2]);
+            __m128 d = _mm_add_ps(_mm_max_ps(_mm_mul_ps(a, minx), _mm_mul_ps(a, maxx)),
+                                  _mm_max_ps(_mm_mul_ps(b, miny), _mm_mul_ps(b, maxy)));
+            d = _mm_add_ps(d, _mm_max_ps(_mm_mul_ps(c, minz), _mm_mul_ps(c, maxz)));
+            d = _mm_add_ps(d, _mm_set1_ps(planes[p][3]));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(d, _mm_setzero_ps()));
+         }
+         const int mask = _mm_movemask_ps(outside);
+         for (size_t j = 0; (j < 4) && (i + j < boxes.count); j++)
+            if ((mask & (1 << j)) == 0)
+               visible.push_back(static_cast<uint32_t>(i + j));
+      }
+#else
+      for (size_t i = 0; i < boxes.count; i++)
+      {
+         bool is_outside = false;
+         for (int p = 0; (p < 6) && (! is_outside); p++)
+         {
+            const float d = std::max(planes[p][0]*boxes.minx[i], planes[p][0]*boxes.maxx[i]) +
+                            std::max(planes[p][1]*boxes.miny[i], planes[p][1]*boxes.maxy[i]) +
+                            std::max(planes[p][2]*boxes.minz[i], planes[p][2]*boxes.maxz[i]) + planes[p][3];
+            is_outside = (d < 0);
+         }
+         if (! is_outside)
+            visible.push_back(static_cast<uint32_t>(i));
+      }
+#endif
+   }
+}
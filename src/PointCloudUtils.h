@@ -0,0 +1,132 @@
+/*
+Copyright (c) 2017 Donald Munro
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+/*
+ * CPU side point cloud processing used by PointCloudCache at load time. Nothing in here touches OpenGL so
+ * it can be run on worker threads.
+ */
+#ifndef FIBERGL_POINTCLOUDUTILS_H
+#define FIBERGL_POINTCLOUDUTILS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pcutil
+{
+   // Number of worker threads to use when threads == 0 is passed to the functions below.
+   unsigned default_threads();
+
+   /**
+    * Estimate unoriented per-point normals as the smallest eigenvector of the covariance of the k nearest
+    * neighbours (PCA). Neighbours are found using a kd-tree and the work is split across threads.
+    * @param positions - Pointer to the x coordinate of the first point.
+    * @param stride - Stride between consecutive points in floats (x, y and z are assumed to be consecutive).
+    * @param count - Number of points.
+    * @param normals - Output, resized to 3*count (nx, ny, nz per point).
+    * @param k - Number of neighbours (including the point itself).
+    * @param threads - Number of threads, 0 for default_threads().
+    */
+   void estimate_normals(const float* positions, size_t stride, size_t count, std::vector<float>& normals,
+                         int k =16, unsigned threads =0);
+
+   /**
+    * Read normals previously saved with save_normals. The cache is only accepted if the count, k, flags and the
+    * size and modification time of the source file match.
+    */
+   bool load_normals(const std::string& cache_file, const std::string& source_file, size_t count, int k,
+                     uint32_t flags, std::vector<float>& normals);
+
+   // Returns false (without reporting it) if cache_file cannot be written.
+   bool save_normals(const std::string& cache_file, const std::string& source_file, size_t count, int k,
+                     uint32_t flags, const std::vector<float>& normals);
+
+   // Interleave the low 21 bits of x, y and z into a 63 bit Morton (Z-order) code.
+   uint64_t morton_code(uint32_t x, uint32_t y, uint32_t z);
+
+   /**
+    * Parallel LSD radix sort (8 bits per pass) of keys, applying the same permutation to values. Passes in which
+    * every key has the same digit are skipped.
+    * @param key_bits - Number of significant bits in the keys.
+    */
+   void radix_sort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int key_bits =64,
+                   unsigned threads =0);
+
+   /**
+    * Returns the point order that sorts the points by the Morton code of their positions quantized to 21 bits per
+    * axis over the bounding box mins, maxs.
+    * @param sorted_codes - If not null receives the Morton codes in sorted order.
+    */
+   std::vector<uint32_t> morton_order(const float* positions, size_t stride, size_t count, const float mins[3],
+                                      const float maxs[3], unsigned threads =0,
+                                      std::vector<uint64_t>* sorted_codes =nullptr);
+
+   /**
+    * Split points in Morton order into spatial chunks of at most max_points points. Chunks are octree cells (runs
+    * sharing a Morton code prefix) subdivided until they fit, with consecutive sibling cells merged while the
+    * merged chunk still fits. Returns the chunk boundaries: chunk i is [boundaries[i], boundaries[i+1]).
+    */
+   std::vector<size_t> morton_chunks(const std::vector<uint64_t>& sorted_codes, size_t max_points);
+
+   /**
+    * Returns a progressive order for count points split into contiguous blocks of block_size points: within each
+    * block points are reordered by bit reversed index so that any prefix of a block is a uniform subsample of the
+    * block (assuming the points are in a space filling curve order such as Morton order).
+    */
+   std::vector<uint32_t> progressive_order(size_t count, size_t block_size);
+
+   // As above for variable sized blocks given as boundaries (see morton_chunks).
+   std::vector<uint32_t> progressive_order(const std::vector<size_t>& boundaries);
+
+   /**
+    * Estimate the mean spacing of count points in progressive order (so that any prefix is a uniform subsample)
+    * from the nearest neighbour distances within the first sample points, assuming the points sample a surface
+    * so that spacing scales with 1/sqrt(count).
+    */
+   float estimate_spacing(const float* positions, size_t stride, size_t count, size_t sample =64);
+
+   // Axis aligned boxes as a structure of arrays, padded to a multiple of 4 boxes for cull_aabbs.
+   struct AABBs
+   //==========
+   {
+      std::vector<float> minx, miny, minz, maxx, maxy, maxz;
+      size_t count = 0;
+
+      void push_back(const float mins[3], const float maxs[3]);
+   };
+
+   /**
+    * Extract the 6 frustum planes (a, b, c, d with ax + by + cz + d >= 0 inside) from a column major (OpenGL)
+    * view projection matrix.
+    */
+   void frustum_planes(const float* m, float planes[6][4]);
+
+   /**
+    * Appends the indices of the boxes that intersect (or may intersect) the frustum to visible. Boxes are tested
+    * four at a time using SSE where available.
+    */
+   void cull_aabbs(const AABBs& boxes, const float planes[6][4], std::vector<uint32_t>& visible);
+
+   // Reorder count records of stride floats so that record i of the result is record order[i] of data.
+   void permute(float* data, size_t stride, size_t count, const std::vector<uint32_t>& order);
+}
+#endif //FIBERGL_POINTCLOUDUTILS_H
@@ -29,6 +29,8 @@ SOFTWARE.
 #include <fstream>
 #include <regex>
 #include <algorithm>
+#include <cstddef>
+#include <cstring>
 #ifdef STD_FILESYSTEM
 #include <filesystem>
 namespace filesystem = std::filesystem;
@@ -47,8 +49,8 @@ namespace filesystem = boost::filesystem;
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/quaternion.hpp>
 
-#include "tinyply.h"
 #include "OGLUtils.h"
+#include "PointCloudUtils.h"
 
 //#define BOUNDS_VERTICES 1
 
@@ -111,10 +113,8 @@ void PointCloudWin::on_initialize(const GLFWwindow *win)
    bool is_axes = true;
    if (oglutil::load_shaders(dir.string(), vertex_glsl, fragment_glsl))
    {
-      axes_unit.program = oglutil::compile_link_shader(replace_ver(vertex_glsl.c_str(), glsl_ver),
-                                                       replace_ver(fragment_glsl.c_str(), glsl_ver),
-                                                       axes_unit.vertex_shader, axes_unit.fragment_shader,
-                                                       err, &errs);
+      err = link_program(axes_unit, replace_ver(vertex_glsl.c_str(), glsl_ver),
+                         replace_ver(fragment_glsl.c_str(), glsl_ver), &errs);
       if (axes_unit.program ==  GL_FALSE)
       {
          std::cerr << "Error linking Axis shader program:" << err << ": " << errs.str();
@@ -122,7 +122,8 @@ void PointCloudWin::on_initialize(const GLFWwindow *win)
       }
       else
       {
-         if (axes_unit.uniform("MVP") == -1)
+         axes_unit.resolve_uniforms();
+         if (! axes_unit.uniform_block("Camera", CAMERA_BINDING))
          {
             is_axes = false;
             std::cerr << "Error linking Axis shader program:" << err << ": " << errs.str();
@@ -142,19 +143,22 @@ void PointCloudWin::on_initialize(const GLFWwindow *win)
       is_good = false;
       return;
    }
-   pointcloud_unit.program = oglutil::compile_link_shader(replace_ver(vertex_glsl.c_str(), glsl_ver),
-                                                          replace_ver(fragment_glsl.c_str(), glsl_ver),
-                                                          pointcloud_unit.vertex_shader,
-                                                          pointcloud_unit.fragment_shader,
-                                                          err, &errs);
+   if ( (is_vertex_pulling) && (! is_gl43()) )
+   {
+      std::cerr << "Vertex pulling requires OpenGL 4.3 (GLSL 430), using vertex attributes" << std::endl;
+      is_vertex_pulling = false;
+   }
+   err = link_program(pointcloud_unit, cloud_vertex_source(vertex_glsl), replace_ver(fragment_glsl.c_str(), glsl_ver),
+                      &errs);
    if (pointcloud_unit.program ==  GL_FALSE)
    {
       std::cerr << "Error linking shader program:" << err << ": " << errs.str();
       is_good = false;
       return;
    }
-   if ( (pointcloud_unit.uniform("MV") == -1) || (pointcloud_unit.uniform("P") == -1) ||
-        (pointcloud_unit.uniform("maxDistance") == -1) || (pointcloud_unit.uniform("pointSize") == -1))
+   pointcloud_unit.resolve_uniforms();
+   if ( (! pointcloud_unit.uniform_block("Camera", CAMERA_BINDING)) ||
+        (pointcloud_unit.uniform("bboxMin") == -1) || (pointcloud_unit.uniform("bboxScale") == -1))
    {
       std::cerr << "Error linking shader program:" << err << ": " << errs.str();
       is_good = false;
@@ -167,6 +171,11 @@ void PointCloudWin::on_initialize(const GLFWwindow *win)
       std::cerr << errs.str().c_str() << std::endl;
       exit(1);
    }
+   if (! init_camera_block())
+   {
+      is_good = false;
+      return;
+   }
    initialised_pc = init_pointcloud();
    if (! initialised_pc)
    {
@@ -179,7 +188,9 @@ void PointCloudWin::on_initialize(const GLFWwindow *win)
    else
       initialised_axes = false;
 
-   glfwSetInputMode(GLFW_win(), GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+   glGenQueries(QUERY_RING, draw_queries);
+   if (GLFW_win() != nullptr)
+      glfwSetInputMode(GLFW_win(), GLFW_CURSOR, GLFW_CURSOR_NORMAL);
 //   glfwSetInputMode(GLFW_win(), GLFW_STICKY_MOUSE_BUTTONS, 1);
 }
 
@@ -189,55 +200,98 @@ void PointCloudWin::on_resized(int w, int h)
    width = w;
    height = h;
    glViewport(0, 0, width, height);
+   update_projection();
+}
+
+void PointCloudWin::update_projection()
+//-------------------------------------
+{
+   if ( (width <= 0) || (height <= 0) ) return;
 //      P = glm::infinitePerspective(glm::radians(45.0f), (float)width / (float)height, 0.1f);
-   P = glm::perspective(glm::radians(45.0f), (float)width / (float)height, 0.01f, rangez*3);
+   // The far plane also covers the cloud from the furthest eye distance (max_r*1.5) for clouds thin in z
+   P = glm::perspective(FOVY, (float)width / (float)height, 0.01f, std::max(rangez, max_r)*3);
 //   P = glm::ortho(minx-1, maxx+1, miny-1, maxy+1, 0.01f, rangez*3);
-
 }
 
 bool PointCloudWin::on_render()
 //---------------------
 {
-   oglutil::clearGLErrors();
-   GLenum err;
-   std::stringstream errs;
+   oglutil::clearFrameErrors();
    glEnable(GL_DEPTH_TEST);
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
    glClearColor(0, 0, 0, 1.0);
    glClear(GL_COLOR_BUFFER_BIT);
 
    glm::mat4 MV = glm::lookAt(location, centroid, tangent);//glm::vec3(0, 1, 0));
-   if (initialised_axes)
+   CameraBlock camera;
+   camera.MV = MV;
+   camera.P = P;
+   camera.MVP = P * MV;
+   camera.maxDistance = maxDistance;
+   camera.pointSize = pointSize*resolution_scale();
+   std::memcpy(camera_stream.map_next(), &camera, sizeof(CameraBlock));
+   const GLintptr camera_offset = camera_stream.commit(sizeof(CameraBlock));
+   glBindBufferRange(GL_UNIFORM_BUFFER, CAMERA_BINDING, camera_stream.buffer(), camera_offset, sizeof(CameraBlock));
+   const bool is_axes = ( (initialised_axes) && (is_axes_shown) );
+   bool is_gpu_cull = false;
+   if (is_axes)
    {
+      oglutil::GPUProfiler::Scope timer(gpu_profiler(), "axes");
       axes_unit.activate();
-      glm::mat4 MVP = P * MV;
-      glUniformMatrix4fv(axes_unit.uniform("MVP"), 1, GL_FALSE, &MVP[0][0]);
-      if (! oglutil::isGLOk(err, &errs))
-         std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      if (! oglutil::isGLOk(err, &errs))
-         std::cerr << err << ": " << errs.str().c_str() << std::endl;
       glBindVertexArray(axes_unit("VAO_AXES"));
-      if (! oglutil::isGLOk(err, &errs))
-         std::cerr << err << ": " << errs.str().c_str() << std::endl;
       glDrawArrays(GL_LINES, 0, 6);
       glBindVertexArray(0);
       glUseProgram(0);
    }
    if (initialised_pc)
    {
-      pointcloud_unit.activate();
-      glUniformMatrix4fv(pointcloud_unit.uniform("MV"), 1, GL_FALSE, &MV[0][0]);
-      if (!oglutil::isGLOk(err, &errs)) std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      glUniformMatrix4fv(pointcloud_unit.uniform("P"), 1, GL_FALSE, &P[0][0]);
-      if (!oglutil::isGLOk(err, &errs)) std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      glUniform1f(pointcloud_unit.uniform("maxDistance"), maxDistance);
-      glUniform1f(pointcloud_unit.uniform("pointSize"), pointSize);
+      oglutil::GPUProfiler::Scope timer(gpu_profiler(), "cloud");
+      is_gpu_cull = ( (gpu_culling()) && ( (initialised_cull) || (init_cull()) ) );
+      if (is_gpu_cull)
+         cull_gpu(camera.MVP);
+      const bool is_oit = ( (is_transparency) && (cloud->is_alpha) && (! compute_raster()) && (! oit_failed) &&
+                            ( (initialised_oit) || (init_oit()) ) && (resize_oit()) );
+      if (is_oit)
+      {
+         // The opaque depth (axes) is copied so transparent points behind opaque geometry are rejected.
+         const bool is_depth_copied = ( (is_axes) && (is_oit_depth_blit) );
+         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, composite_unit("FBO_OIT"));
+         if (is_depth_copied)
+            glBlitFramebuffer(0, 0, render_width, render_height, 0, 0, render_width, render_height,
+                              GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+         glBindFramebuffer(GL_FRAMEBUFFER, composite_unit("FBO_OIT"));
+         const GLfloat no_accumulation[] = { 0, 0, 0, 0 }, full_revealage[] = { 1, 0, 0, 0 };
+         glClearBufferfv(GL_COLOR, 0, no_accumulation);
+         glClearBufferfv(GL_COLOR, 1, full_revealage);
+         if (! is_depth_copied)
+            glClear(GL_DEPTH_BUFFER_BIT);
+         glDepthMask(GL_FALSE);
+         glEnable(GL_BLEND);
+         glBlendFunci(0, GL_ONE, GL_ONE);
+         glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+      }
+      oglutil::OGLProgramUnit& cloud_unit = (is_oit) ? oit_unit : pointcloud_unit;
+      // Uniform values are program state, which windows in a share group share with windows showing other clouds.
+      if (share_group() != nullptr)
+         cloud_uniforms(cloud_unit);
+      else
+         cloud_unit.activate();
       glBindVertexArray(pointcloud_unit("VAO_VERTICES"));
+      if (is_vertex_pulling)
+         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VERTEX_BINDING, *cloud_buffer);
       //glPointSize(3);
       glEnable(GL_PROGRAM_POINT_SIZE);
-      glDrawArrays(GL_POINTS, 0, count);
+      if (is_gpu_cull)
+         draw_points_gpu();
+      else
+      {
+         cull_chunks(camera.MVP);
+         draw_points(points_to_draw());
+      }
       glBindVertexArray(0);
       glUseProgram(0);
+      if (is_oit)
+         composite_oit();
 #ifdef PCW_DEBUG_SHADER
       const glm::vec3 close_color = glm::vec3(1, 0, 0);
       const glm::vec3 far_color = glm::vec3(0, 0, 0.25);
@@ -263,18 +317,782 @@ bool PointCloudWin::on_render()
 //      }
    }
 
+   if ( (is_gpu_cull) && (is_occlusion_culling) )
+   {
+      // Occlusion culling against the previous frame's depth may have culled chunks that are visible from this
+      // camera, so draw again with this frame's depth until the camera stops moving.
+      if ( (is_hiz_valid) && (hiz_MVP != camera.MVP) )
+         request_redraw();
+      build_hiz(camera.MVP);
+   }
+   camera_stream.fence();
+   // Keep rendering while interacting when rendering on demand, so that the frame after the interaction ends
+   // draws all the visible points instead of the reduced set.
+   if (is_interacting())
+      request_redraw();
+   oglutil::isFrameOk("PointCloudWin::on_render");
+   return true;
+}
+
+bool PointCloudWin::is_interacting()
+//----------------------------------
+{
+   if (is_dragging) return true;
+   auto since = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() -
+                                                                      last_interaction).count();
+   return (since < INTERACTION_MS);
+}
+
+// Frustum culls the chunks of the cloud against MVP into visible_first/visible_count and applies the level of
+// detail (see set_lod_error) to the number of points of each visible chunk.
+void PointCloudWin::cull_chunks(const glm::mat4& MVP)
+//---------------------------------------------------
+{
+   float planes[6][4];
+   pcutil::frustum_planes(glm::value_ptr(MVP), planes);
+   visible.clear();
+   pcutil::cull_aabbs(cloud->chunk_bounds, planes, visible);
+   visible_first.resize(visible.size());
+   visible_count.resize(visible.size());
+   visible_points = 0;
+   // Pixels per world unit at distance 1
+   const float pixels_per_unit = static_cast<float>(render_height) / (2.0f*tanf(FOVY/2.0f));
+   const pcutil::AABBs& bounds = cloud->chunk_bounds;
+   for (size_t i = 0; i < visible.size(); i++)
+   {
+      const uint32_t chunk = visible[i];
+      const GLsizei n = cloud->chunk_count[chunk];
+      visible_first[i] = cloud->chunk_first[chunk];
+      visible_count[i] = n;
+      const float spacing = cloud->chunk_spacing[chunk];
+      if ( (lod_error_px > 0) && (spacing > 0) )
+      {
+         const float dx = std::max(std::max(bounds.minx[chunk] - location.x, location.x - bounds.maxx[chunk]), 0.0f);
+         const float dy = std::max(std::max(bounds.miny[chunk] - location.y, location.y - bounds.maxy[chunk]), 0.0f);
+         const float dz = std::max(std::max(bounds.minz[chunk] - location.z, location.z - bounds.maxz[chunk]), 0.0f);
+         const float distance = sqrtf(dx*dx + dy*dy + dz*dz);
+         if (distance > 0)
+         {
+            // Spacing grows with 1/sqrt(points) for a surface, so keep (projected spacing / error)^2 of them.
+            const float ratio = (spacing*pixels_per_unit / distance) / lod_error_px;
+            if (ratio < 1)
+               visible_count[i] = std::max(1, static_cast<GLsizei>(ceilf(n*ratio*ratio)));
+         }
+      }
+      visible_points += visible_count[i];
+   }
+}
+
+size_t PointCloudWin::points_to_draw()
+//-----------------------------------
+{
+   if (! is_interacting())
+      return visible_points;
+   size_t n = visible_points;
+   if (point_budget > 0)
+      n = std::min(n, point_budget);
+   if ( (frame_time_target_ms > 0) && (ns_per_point > 0) )
+   {
+      const auto affordable = static_cast<size_t>((frame_time_target_ms*1000000.0) / ns_per_point);
+      n = std::min(n, std::max(affordable, visible.size()));
+   }
+   return n;
+}
+
+// Draws n points as the same fraction of each visible chunk, timed with a ring of GL_TIME_ELAPSED queries
+// that are read back (without waiting) QUERY_RING frames later.
+void PointCloudWin::draw_points(size_t n)
+//---------------------------------------
+{
+   const size_t slot = query_frame % QUERY_RING;
+   glBeginQuery(GL_TIME_ELAPSED, draw_queries[slot]);
+   const GLsizei* counts = visible_count.data();
+   if (n >= visible_points)
+      n = visible_points;
+   else
+   {
+      const double fraction = static_cast<double>(n) / visible_points;
+      n = 0;
+      draw_count.resize(visible.size());
+      for (size_t c = 0; c < visible.size(); c++)
+      {
+         draw_count[c] = std::min(visible_count[c],
+                                  std::max(1, static_cast<GLsizei>(ceil(visible_count[c]*fraction))));
+         n += draw_count[c];
+      }
+      counts = draw_count.data();
+   }
+   if ( (is_compute_raster) && (! raster_failed) && ( (initialised_raster) || (init_raster()) ) )
+      raster_points(counts);
+   else if (n == count)
+      glDrawArrays(GL_POINTS, 0, count);
+   else
+      glMultiDrawArrays(GL_POINTS, visible_first.data(), counts, static_cast<GLsizei>(visible.size()));
+   glEndQuery(GL_TIME_ELAPSED);
+   query_points[slot] = n;
+   query_frame++;
+   update_draw_cost();
+}
+
+bool PointCloudWin::init_raster()
+//-------------------------------
+{
+   if (! is_gl43())
+   {
+      std::cerr << "Compute rasterizer requires OpenGL 4.3 (GLSL 430), using GL_POINTS" << std::endl;
+      raster_failed = true;
+      return false;
+   }
+   is_atomic64 = ( (oglutil::has_extension("GL_NV_shader_atomic_int64")) &&
+                   (oglutil::has_extension("GL_ARB_gpu_shader_int64")) );
+   const std::string defines = (is_atomic64) ? "#extension GL_ARB_gpu_shader_int64 : require\n"
+                                               "#extension GL_NV_shader_atomic_int64 : require\n"
+                                               "#define ATOMIC64 1\n" : "";
+   const std::regex defines_regex(R"(\{\{defines\}\})");
+   filesystem::path dir = shader_directory / filesystem::path("raster");
+   std::string vertex_glsl, fragment_glsl, compute_glsl;
+   std::ifstream ifs((dir / filesystem::path("compute.glsl")).string());
+   if ( (! ifs.good()) || (! oglutil::load_shaders(dir.string(), vertex_glsl, fragment_glsl)) )
+   {
+      std::cerr << "Error loading compute rasterizer shaders from " << dir.string() << std::endl;
+      raster_failed = true;
+      return false;
+   }
+   compute_glsl = std::string( (std::istreambuf_iterator<char>(ifs)), (std::istreambuf_iterator<char>()) );
+   compute_glsl = std::regex_replace(replace_ver(compute_glsl.c_str(), glsl_ver), defines_regex, defines);
+   fragment_glsl = std::regex_replace(replace_ver(fragment_glsl.c_str(), glsl_ver), defines_regex, defines);
+   GLenum err;
+   std::stringstream errs;
+   err = link_compute(raster_unit, compute_glsl, &errs);
+   if (raster_unit)
+      err = link_program(resolve_unit, replace_ver(vertex_glsl.c_str(), glsl_ver), fragment_glsl, &errs);
+   if ( (! raster_unit) || (! resolve_unit) )
+   {
+      std::cerr << "Error linking compute rasterizer shaders: " << err << ": " << errs.str() << std::endl;
+      raster_unit.del();
+      resolve_unit.del();
+      raster_failed = true;
+      return false;
+   }
+   raster_unit.resolve_uniforms();
+   resolve_unit.resolve_uniforms();
+   raster_unit.uniform_block("Camera", CAMERA_BINDING);
+   cloud_uniforms(raster_unit);
+   glUseProgram(0);
+   std::stringstream stream_errs;
+   if (! ranges_stream.create(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(cloud->chunk_first.size(), 1)*2*sizeof(GLint), 3,
+                              &stream_errs))
+   {
+      std::cerr << "Error creating compute rasterizer buffers: " << stream_errs.str() << std::endl;
+      raster_unit.del();
+      resolve_unit.del();
+      raster_failed = true;
+      return false;
+   }
+   glGenBuffers(1, &raster_unit("VBO_DEPTH"));
+   if (! is_atomic64)
+      glGenBuffers(1, &raster_unit("VBO_COLOR"));
+   glGenVertexArrays(1, &resolve_unit("VAO_RESOLVE"));
+   raster_width = raster_height = 0;
+   std::cout << "Compute rasterizer using " << ((is_atomic64) ? "64 bit atomics" : "32 bit depth and colour passes")
+             << std::endl;
+   initialised_raster = true;
+   return true;
+}
+
+bool PointCloudWin::init_oit()
+//----------------------------
+{
+   filesystem::path dir = shader_directory / filesystem::path("oit");
+   std::string vertex_glsl, fragment_glsl, cloud_vertex_glsl, cloud_fragment_glsl;
+   std::ifstream ifs((dir / filesystem::path("accumulate.glsl")).string());
+   if ( (! ifs.good()) || (! oglutil::load_shaders(dir.string(), vertex_glsl, fragment_glsl)) ||
+        (! oglutil::load_shaders((shader_directory / filesystem::path("cloud")).string(), cloud_vertex_glsl,
+                                 cloud_fragment_glsl)) )
+   {
+      std::cerr << "Error loading transparency shaders from " << dir.string() << ", alpha will be ignored" << std::endl;
+      oit_failed = true;
+      return false;
+   }
+   const std::string accumulate_glsl = std::string( (std::istreambuf_iterator<char>(ifs)),
+                                                    (std::istreambuf_iterator<char>()) );
+   GLenum err;
+   std::stringstream errs;
+   err = link_program(oit_unit, cloud_vertex_source(cloud_vertex_glsl), replace_ver(accumulate_glsl.c_str(), glsl_ver),
+                      &errs);
+   if (oit_unit)
+      err = link_program(composite_unit, replace_ver(vertex_glsl.c_str(), glsl_ver),
+                         replace_ver(fragment_glsl.c_str(), glsl_ver), &errs);
+   if ( (! oit_unit) || (! composite_unit) )
+   {
+      std::cerr << "Error linking transparency shaders: " << err << ": " << errs.str() << std::endl;
+      oit_unit.del();
+      composite_unit.del();
+      oit_failed = true;
+      return false;
+   }
+   oit_unit.resolve_uniforms();
+   composite_unit.resolve_uniforms();
+   oit_unit.uniform_block("Camera", CAMERA_BINDING);
+   cloud_uniforms(oit_unit);
+   composite_unit.activate();
+   glUniform1i(composite_unit.uniform("accumulationTexture"), 0);
+   glUniform1i(composite_unit.uniform("revealageTexture"), 1);
+   glUseProgram(0);
+   glGenVertexArrays(1, &composite_unit("VAO_COMPOSITE"));
+   oit_width = oit_height = 0;
+   initialised_oit = true;
+   return true;
+}
+
+// (Re)allocates the transparency targets at the window size, which also covers any lower render resolution, and
+// again when the render target changes as the depth buffer matches its format.
+bool PointCloudWin::resize_oit()
+//------------------------------
+{
+   if ( (oit_width == width) && (oit_height == height) && (oit_target == render_target()) )
+      return true;
+   if (composite_unit("FBO_OIT") != GL_FALSE)
+   {
+      glDeleteFramebuffers(1, &composite_unit("FBO_OIT"));
+      glDeleteTextures(1, &composite_unit("TEX_ACCUMULATION"));
+      glDeleteTextures(1, &composite_unit("TEX_REVEALAGE"));
+      glDeleteRenderbuffers(1, &composite_unit("RBO_DEPTH"));
+   }
+   oglutil::clearGLErrors();
+   const GLenum formats[] = { GL_RGBA16F, GL_R16F };
+   const char* names[] = { "TEX_ACCUMULATION", "TEX_REVEALAGE" };
+   for (int i = 0; i < 2; i++)
+   {
+      glGenTextures(1, &composite_unit(names[i]));
+      glBindTexture(GL_TEXTURE_2D, composite_unit(names[i]));
+      glTexStorage2D(GL_TEXTURE_2D, 1, formats[i], width, height);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+   }
+   glBindTexture(GL_TEXTURE_2D, 0);
+   // The depth blit requires the depth and stencil sizes of the render target, whose default framebuffer format
+   // depends on the platform. Without a depth buffer to copy the depth is cleared instead.
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, render_target());
+   GLenum depth_attachment = GL_NONE;
+   GLenum depth_storage = depth_format(depth_attachment);
+   is_oit_depth_blit = (depth_storage != GL_NONE);
+   if (! is_oit_depth_blit)
+   {
+      depth_storage = GL_DEPTH24_STENCIL8;
+      depth_attachment = GL_DEPTH_STENCIL_ATTACHMENT;
+   }
+   glGenRenderbuffers(1, &composite_unit("RBO_DEPTH"));
+   glBindRenderbuffer(GL_RENDERBUFFER, composite_unit("RBO_DEPTH"));
+   glRenderbufferStorage(GL_RENDERBUFFER, depth_storage, width, height);
+   glBindRenderbuffer(GL_RENDERBUFFER, 0);
+   glGenFramebuffers(1, &composite_unit("FBO_OIT"));
+   glBindFramebuffer(GL_FRAMEBUFFER, composite_unit("FBO_OIT"));
+   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, composite_unit("TEX_ACCUMULATION"), 0);
+   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, composite_unit("TEX_REVEALAGE"), 0);
+   glFramebufferRenderbuffer(GL_FRAMEBUFFER, depth_attachment, GL_RENDERBUFFER, composite_unit("RBO_DEPTH"));
+   const GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+   glDrawBuffers(2, buffers);
+   const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+   glBindFramebuffer(GL_FRAMEBUFFER, render_target());
+   GLenum err;
+   std::stringstream errs;
+   if ( (status != GL_FRAMEBUFFER_COMPLETE) || (! oglutil::isGLOk(err, &errs)) )
+   {
+      std::cerr << "Error creating transparency framebuffer, alpha will be ignored: " << errs.str() << std::endl;
+      oit_unit.del();
+      composite_unit.del();
+      initialised_oit = false;
+      oit_failed = true;
+      return false;
+   }
+   if (is_oit_depth_blit)
+   {
+      // Matching sizes do not guarantee a blittable pair (the internal format of the default framebuffer is not
+      // queryable), so the blit is tried once here rather than failing every frame.
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, composite_unit("FBO_OIT"));
+      glBlitFramebuffer(0, 0, render_width, render_height, 0, 0, render_width, render_height, GL_DEPTH_BUFFER_BIT,
+                        GL_NEAREST);
+      glBindFramebuffer(GL_FRAMEBUFFER, render_target());
+      if (! oglutil::isGLOk(err, &errs))
+      {
+         std::cerr << "Cannot copy depth to the transparency framebuffer, transparent points are not hidden by the axes: "
+                   << errs.str() << std::endl;
+         is_oit_depth_blit = false;
+      }
+   }
+   oit_width = width;
+   oit_height = height;
+   oit_target = render_target();
+   return true;
+}
+
+void PointCloudWin::composite_oit()
+//---------------------------------
+{
+   oglutil::GPUProfiler::Scope timer(gpu_profiler(), "transparency composite");
+   glBindFramebuffer(GL_FRAMEBUFFER, render_target());
+   glDepthMask(GL_TRUE);
+   glDisable(GL_DEPTH_TEST);
+   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+   composite_unit.activate();
+   glActiveTexture(GL_TEXTURE0);
+   glBindTexture(GL_TEXTURE_2D, composite_unit("TEX_ACCUMULATION"));
+   glActiveTexture(GL_TEXTURE1);
+   glBindTexture(GL_TEXTURE_2D, composite_unit("TEX_REVEALAGE"));
+   glBindVertexArray(composite_unit("VAO_COMPOSITE"));
+   glDrawArrays(GL_TRIANGLES, 0, 3);
+   glBindVertexArray(0);
+   glBindTexture(GL_TEXTURE_2D, 0);
+   glActiveTexture(GL_TEXTURE0);
+   glBindTexture(GL_TEXTURE_2D, 0);
+   glUseProgram(0);
+   glDisable(GL_BLEND);
+   glEnable(GL_DEPTH_TEST);
+}
+
+// Rasterizes counts[i] points from each visible chunk i with the compute shader and resolves the result.
+void PointCloudWin::raster_points(const GLsizei* counts)
+//------------------------------------------------------
+{
+   const size_t pixels = static_cast<size_t>(render_width)*render_height;
+   if ( (raster_width != render_width) || (raster_height != render_height) )
+   {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, raster_unit("VBO_DEPTH"));
+      glBufferData(GL_SHADER_STORAGE_BUFFER, pixels*((is_atomic64) ? 8 : 4), nullptr, GL_DYNAMIC_COPY);
+      if (! is_atomic64)
+      {
+         glBindBuffer(GL_SHADER_STORAGE_BUFFER, raster_unit("VBO_COLOR"));
+         glBufferData(GL_SHADER_STORAGE_BUFFER, pixels*4, nullptr, GL_DYNAMIC_COPY);
+      }
+      raster_width = render_width;
+      raster_height = render_height;
+   }
+   GLsizei max_count = 0;
+   GLint* ranges = static_cast<GLint*>(ranges_stream.map_next());
+   for (size_t c = 0; c < visible.size(); c++)
+   {
+      ranges[c*2] = visible_first[c];
+      ranges[c*2 + 1] = counts[c];
+      max_count = std::max(max_count, counts[c]);
+   }
+   const size_t ranges_size = visible.size()*2*sizeof(GLint);
+   const GLintptr ranges_offset = ranges_stream.commit(ranges_size);
+   if (max_count == 0) return;
+   const GLuint cleared = 0xFFFFFFFF;
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, raster_unit("VBO_DEPTH"));
+   glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &cleared);
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VERTEX_BINDING, *cloud_buffer);
+   glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, ranges_stream.buffer(), ranges_offset, ranges_size);
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, raster_unit("VBO_DEPTH"));
+   if (! is_atomic64)
+      glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, raster_unit("VBO_COLOR"));
+
+   if (share_group() != nullptr)
+      cloud_uniforms(raster_unit);
+   else
+      raster_unit.activate();
+   glUniform2i(raster_unit.uniform("viewport"), render_width, render_height);
+   const GLuint groups = (static_cast<GLuint>(max_count) + RASTER_GROUP_SIZE - 1) / RASTER_GROUP_SIZE;
+   const int passes = (is_atomic64) ? 1 : 2;
+   for (int pass = 0; pass < passes; pass++)
+   {
+      glUniform1i(raster_unit.uniform("pass"), pass);
+      glDispatchCompute(groups, static_cast<GLuint>(visible.size()), 1);
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+   }
+
+   resolve_unit.activate();
+   glUniform2i(resolve_unit.uniform("viewport"), render_width, render_height);
+   glBindVertexArray(resolve_unit("VAO_RESOLVE"));
+   glDrawArrays(GL_TRIANGLES, 0, 3);
+   glBindVertexArray(pointcloud_unit("VAO_VERTICES"));
+   pointcloud_unit.activate();
+   ranges_stream.fence();
+}
+
+void PointCloudWin::update_draw_cost()
+//------------------------------------
+{
+   if (query_frame < QUERY_RING) return;
+   const size_t slot = query_frame % QUERY_RING; // oldest query
+   GLint available = GL_FALSE;
+   glGetQueryObjectiv(draw_queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+   if (available == GL_FALSE) return;
+   if (query_fraction[slot] > 0)
+   {
+      // GPU culled: only the GPU knows how many points were drawn
+      GLuint64 generated = 0;
+      glGetQueryObjectui64v(point_queries[slot], GL_QUERY_RESULT, &generated);
+      query_points[slot] = static_cast<size_t>(generated);
+      gpu_visible_points = static_cast<size_t>(generated / query_fraction[slot]);
+      query_fraction[slot] = 0;
+   }
+   if (query_points[slot] == 0) return;
+   GLuint64 ns = 0;
+   glGetQueryObjectui64v(draw_queries[slot], GL_QUERY_RESULT, &ns);
+   const double cost = static_cast<double>(ns) / query_points[slot];
+   ns_per_point = (ns_per_point <= 0) ? cost : ns_per_point*0.9 + cost*0.1;
+   query_points[slot] = 0;
+}
+
+bool PointCloudWin::init_cull()
+//-----------------------------
+{
+   if (! is_gl43())
+   {
+      std::cerr << "GPU culling requires OpenGL 4.3 (GLSL 430), culling on the CPU" << std::endl;
+      cull_failed = true;
+      return false;
+   }
+   filesystem::path dir = shader_directory / filesystem::path("cull");
+   std::ifstream cull_ifs((dir / filesystem::path("compute.glsl")).string()),
+                 hiz_ifs((dir / filesystem::path("hiz.glsl")).string());
+   if ( (! cull_ifs.good()) || (! hiz_ifs.good()) )
+   {
+      std::cerr << "Error loading GPU culling shaders from " << dir.string() << ", culling on the CPU" << std::endl;
+      cull_failed = true;
+      return false;
+   }
+   const std::string cull_glsl = std::string( (std::istreambuf_iterator<char>(cull_ifs)),
+                                              (std::istreambuf_iterator<char>()) );
+   const std::string hiz_glsl = std::string( (std::istreambuf_iterator<char>(hiz_ifs)),
+                                             (std::istreambuf_iterator<char>()) );
+   GLenum err;
+   std::stringstream errs;
+   err = link_compute(cull_unit, replace_ver(cull_glsl.c_str(), glsl_ver), &errs);
+   if (cull_unit)
+      err = link_compute(hiz_unit, replace_ver(hiz_glsl.c_str(), glsl_ver), &errs);
+   if ( (! cull_unit) || (! hiz_unit) )
+   {
+      std::cerr << "Error linking GPU culling shaders: " << err << ": " << errs.str() << std::endl;
+      cull_unit.del();
+      hiz_unit.del();
+      cull_failed = true;
+      return false;
+   }
+   cull_unit.resolve_uniforms();
+   hiz_unit.resolve_uniforms();
+   cull_unit.activate();
+   glUniform1i(cull_unit.uniform("hiz"), 0);
+   hiz_unit.activate();
+   glUniform1i(hiz_unit.uniform("source"), 0);
+   glUniform1i(hiz_unit.uniform("destination"), 0);
+   glUseProgram(0);
+   glGenBuffers(1, &cull_unit("VBO_CHUNKS"));
+   glGenBuffers(1, &cull_unit("VBO_COMMANDS"));
+   glGenBuffers(1, &cull_unit("VBO_COUNT"));
+   glGenQueries(QUERY_RING, point_queries);
+   if (! upload_chunks())
+   {
+      cull_unit.del();
+      hiz_unit.del();
+      cull_failed = true;
+      return false;
+   }
+#ifdef GL_ARB_indirect_parameters
+   is_indirect_count = oglutil::has_extension("GL_ARB_indirect_parameters");
+#endif
+   hiz_width = hiz_height = hiz_levels = 0;
+   is_hiz_valid = false;
+   std::cout << "GPU culling " << ((is_indirect_count) ? "with" : "without") << " indirect draw count" << std::endl;
+   initialised_cull = true;
+   return true;
+}
+
+// Uploads the bounds of the chunks of the current cloud and sizes the draw command buffer to match.
+bool PointCloudWin::upload_chunks()
+//---------------------------------
+{
+   const pcutil::AABBs& bounds = cloud->chunk_bounds;
+   const size_t n = cloud->chunk_first.size();
+   std::vector<GPUChunk> chunks(std::max<size_t>(n, 1));
+   for (size_t c = 0; c < n; c++)
+   {
+      GPUChunk& chunk = chunks[c];
+      chunk.lo[0] = bounds.minx[c]; chunk.lo[1] = bounds.miny[c]; chunk.lo[2] = bounds.minz[c];
+      chunk.lo[3] = cloud->chunk_spacing[c];
+      chunk.hi[0] = bounds.maxx[c]; chunk.hi[1] = bounds.maxy[c]; chunk.hi[2] = bounds.maxz[c]; chunk.hi[3] = 0;
+      chunk.first = static_cast<GLuint>(cloud->chunk_first[c]);
+      chunk.count = static_cast<GLuint>(cloud->chunk_count[c]);
+      chunk.pad[0] = chunk.pad[1] = 0;
+   }
+   oglutil::clearGLErrors();
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull_unit("VBO_CHUNKS"));
+   glBufferData(GL_SHADER_STORAGE_BUFFER, chunks.size()*sizeof(GPUChunk), chunks.data(), GL_STATIC_DRAW);
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull_unit("VBO_COMMANDS"));
+   glBufferData(GL_SHADER_STORAGE_BUFFER, chunks.size()*4*sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull_unit("VBO_COUNT"));
+   glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+   GLenum err;
+   std::stringstream errs;
    if (! oglutil::isGLOk(err, &errs))
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
+   {
+      std::cerr << "OpenGL error creating GPU culling buffers: " << errs.str() << std::endl;
+      return false;
+   }
+   return true;
+}
+
+// Writes the draw commands of the visible chunks (see cull/compute.glsl) for draw_points_gpu.
+void PointCloudWin::cull_gpu(const glm::mat4& MVP)
+//------------------------------------------------
+{
+   oglutil::GPUProfiler::Scope timer(gpu_profiler(), "cull");
+   // The interaction budget is applied as a fraction of each chunk of the visible points estimated from earlier
+   // frames, as the CPU does not know how many are visible.
+   visible.clear();
+   visible_points = gpu_visible_points;
+   cull_fraction = 1.0f;
+   if (is_interacting())
+   {
+      const size_t n = points_to_draw();
+      if ( (visible_points > 0) && (n < visible_points) )
+         cull_fraction = std::max(static_cast<float>(n) / visible_points, 1.0f/65536.0f);
+   }
+   float planes[6][4];
+   pcutil::frustum_planes(glm::value_ptr(MVP), planes);
+   const GLuint chunks = static_cast<GLuint>(cloud->chunk_first.size());
+   const bool is_occlusion = ( (is_occlusion_culling) && (is_hiz_valid) && (hiz_width == render_width) &&
+                               (hiz_height == render_height) );
+   const GLuint zero = 0;
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull_unit("VBO_COUNT"));
+   glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+   if (! is_indirect_count)
+   {
+      // All chunks are drawn so the commands after the compacted ones must draw nothing
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull_unit("VBO_COMMANDS"));
+      glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+   }
+   glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, cull_unit("VBO_CHUNKS"));
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, cull_unit("VBO_COMMANDS"));
+   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, cull_unit("VBO_COUNT"));
+   cull_unit.activate();
+   glUniform1ui(cull_unit.uniform("chunkCount"), chunks);
+   glUniform4fv(cull_unit.uniform("planes"), 6, &planes[0][0]);
+   glUniform3f(cull_unit.uniform("eye"), location.x, location.y, location.z);
+   glUniform1f(cull_unit.uniform("pixelsPerUnit"), static_cast<float>(render_height) / (2.0f*tanf(FOVY/2.0f)));
+   glUniform1f(cull_unit.uniform("lodError"), lod_error_px);
+   glUniform1f(cull_unit.uniform("fraction"), cull_fraction);
+   glUniform1i(cull_unit.uniform("occlusion"), (is_occlusion) ? 1 : 0);
+   if (is_occlusion)
+   {
+      glUniformMatrix4fv(cull_unit.uniform("hizMVP"), 1, GL_FALSE, glm::value_ptr(hiz_MVP));
+      glUniform2f(cull_unit.uniform("viewport"), static_cast<float>(render_width), static_cast<float>(render_height));
+      glUniform1i(cull_unit.uniform("hizLevels"), hiz_levels);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, hiz_unit("TEX_HIZ"));
+   }
+   glDispatchCompute((chunks + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+   glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+   if (is_occlusion)
+      glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Draws the commands written by cull_gpu with the draw program and vertex array bound, timed like draw_points.
+void PointCloudWin::draw_points_gpu()
+//-----------------------------------
+{
+   const size_t slot = query_frame % QUERY_RING;
+   const GLsizei chunks = static_cast<GLsizei>(cloud->chunk_first.size());
+   glBeginQuery(GL_TIME_ELAPSED, draw_queries[slot]);
+   glBeginQuery(GL_PRIMITIVES_GENERATED, point_queries[slot]);
+   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cull_unit("VBO_COMMANDS"));
+#ifdef GL_ARB_indirect_parameters
+   if (is_indirect_count)
+   {
+      glBindBuffer(GL_PARAMETER_BUFFER_ARB, cull_unit("VBO_COUNT"));
+      glMultiDrawArraysIndirectCountARB(GL_POINTS, nullptr, 0, chunks, 0);
+      glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+   }
+   else
+#endif
+      glMultiDrawArraysIndirect(GL_POINTS, nullptr, chunks, 0);
+   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+   glEndQuery(GL_PRIMITIVES_GENERATED);
+   glEndQuery(GL_TIME_ELAPSED);
+   query_points[slot] = 0;
+   query_fraction[slot] = cull_fraction;
+   query_frame++;
+   update_draw_cost();
+}
+
+// Copies the depth of the frame and reduces it to the maximum depth pyramid used by the next frame's occlusion
+// culling (see cull/hiz.glsl). Level 0 is half the render size.
+void PointCloudWin::build_hiz(const glm::mat4& MVP)
+//-------------------------------------------------
+{
+   if (hiz_resolve_failed)
+      return;
+   oglutil::GPUProfiler::Scope timer(gpu_profiler(), "hi-z");
+   if ( (hiz_width != render_width) || (hiz_height != render_height) )
+   {
+      if (hiz_unit("TEX_DEPTH") != GL_FALSE)
+      {
+         glDeleteTextures(1, &hiz_unit("TEX_DEPTH"));
+         glDeleteTextures(1, &hiz_unit("TEX_HIZ"));
+      }
+      if (hiz_unit("TEX_RESOLVE") != GL_FALSE)
+      {
+         glDeleteTextures(1, &hiz_unit("TEX_RESOLVE"));
+         glDeleteFramebuffers(1, &hiz_unit("FBO_RESOLVE"));
+         hiz_unit("TEX_RESOLVE") = hiz_unit("FBO_RESOLVE") = 0;
+      }
+      const int w = std::max(render_width/2, 1), h = std::max(render_height/2, 1);
+      hiz_levels = 1;
+      while ( ((w >> hiz_levels) > 0) || ((h >> hiz_levels) > 0) )
+         hiz_levels++;
+      glGenTextures(1, &hiz_unit("TEX_DEPTH"));
+      glBindTexture(GL_TEXTURE_2D, hiz_unit("TEX_DEPTH"));
+      glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, render_width, render_height);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glGenTextures(1, &hiz_unit("TEX_HIZ"));
+      glBindTexture(GL_TEXTURE_2D, hiz_unit("TEX_HIZ"));
+      glTexStorage2D(GL_TEXTURE_2D, hiz_levels, GL_R32F, w, h);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      hiz_width = render_width;
+      hiz_height = render_height;
+   }
+   GLint read_framebuffer = 0, draw_framebuffer = 0;
+   glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_framebuffer);
+   glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &draw_framebuffer);
+   glBindFramebuffer(GL_FRAMEBUFFER, render_target());
+   GLint sample_buffers = 0;
+   glGetIntegerv(GL_SAMPLE_BUFFERS, &sample_buffers);
+   // glCopyTexSubImage2D cannot read a multisampled framebuffer (the default framebuffer of a window, see
+   // GLFW_SAMPLES), so its depth is resolved with a blit instead.
+   GLuint depth = hiz_unit("TEX_DEPTH");
+   bool is_copied = true;
+   if (sample_buffers > 0)
+   {
+      is_copied = resolve_depth();
+      depth = hiz_unit("TEX_RESOLVE");
+   }
+   else
+   {
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, depth);
+      glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, render_width, render_height);
+   }
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, static_cast<GLuint>(read_framebuffer));
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, static_cast<GLuint>(draw_framebuffer));
+   if (! is_copied)
+   {
+      is_hiz_valid = false;
+      return;
+   }
+
+   hiz_unit.activate();
+   glActiveTexture(GL_TEXTURE0);
+   for (int level = 0; level < hiz_levels; level++)
+   {
+      glBindTexture(GL_TEXTURE_2D, (level == 0) ? depth : hiz_unit("TEX_HIZ"));
+      glUniform1i(hiz_unit.uniform("sourceLevel"), (level == 0) ? 0 : level - 1);
+      glBindImageTexture(0, hiz_unit("TEX_HIZ"), level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+      const GLuint w = static_cast<GLuint>(std::max((render_width/2) >> level, 1)),
+                   h = static_cast<GLuint>(std::max((render_height/2) >> level, 1));
+      glDispatchCompute((w + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, (h + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, 1);
+      glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+   }
+   glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+   glBindTexture(GL_TEXTURE_2D, 0);
+   glUseProgram(0);
+   hiz_MVP = MVP;
+   is_hiz_valid = true;
+}
+
+// Resolves the depth of the multisampled framebuffer bound by build_hiz into TEX_RESOLVE, which has the depth and
+// stencil sizes of the framebuffer as a depth blit requires matching formats. The resolve target is validated (with
+// its first blit) when it is created; if that fails occlusion culling is disabled rather than testing against
+// undefined depth. Later blits are per frame and, like the other passes, left to the debug callback and isFrameOk.
+bool PointCloudWin::resolve_depth()
+//---------------------------------
+{
+   if (hiz_unit("TEX_RESOLVE") != GL_FALSE)
+   {
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, hiz_unit("FBO_RESOLVE"));
+      glBlitFramebuffer(0, 0, render_width, render_height, 0, 0, render_width, render_height, GL_DEPTH_BUFFER_BIT,
+                        GL_NEAREST);
+      return true;
+   }
+
+   oglutil::clearGLErrors();
+   GLenum attachment = GL_NONE;
+   const GLenum format = depth_format(attachment);
+   GLenum status = GL_FRAMEBUFFER_UNSUPPORTED;
+   if (format != GL_NONE)
+   {
+      glGenTextures(1, &hiz_unit("TEX_RESOLVE"));
+      glBindTexture(GL_TEXTURE_2D, hiz_unit("TEX_RESOLVE"));
+      glTexStorage2D(GL_TEXTURE_2D, 1, format, render_width, render_height);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glGenFramebuffers(1, &hiz_unit("FBO_RESOLVE"));
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, hiz_unit("FBO_RESOLVE"));
+      glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, attachment, GL_TEXTURE_2D, hiz_unit("TEX_RESOLVE"), 0);
+      status = glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER);
+      if (status == GL_FRAMEBUFFER_COMPLETE)
+         glBlitFramebuffer(0, 0, render_width, render_height, 0, 0, render_width, render_height, GL_DEPTH_BUFFER_BIT,
+                           GL_NEAREST);
+   }
+   GLenum err;
+   std::stringstream errs;
+   if ( (status != GL_FRAMEBUFFER_COMPLETE) || (! oglutil::isGLOk(err, &errs)) )
+   {
+      std::cerr << "Error resolving the multisampled depth buffer (status " << std::hex << status << std::dec
+                << "), occlusion culling disabled: " << errs.str() << std::endl;
+      hiz_resolve_failed = true;
+      return false;
+   }
    return true;
 }
 
+// The internal format with the depth and stencil sizes of the framebuffer bound for reading, as a depth blit from it
+// requires, and in attachment the attachment point for that format. GL_NONE if the framebuffer has no depth buffer.
+GLenum PointCloudWin::depth_format(GLenum& attachment) const
+//----------------------------------------------------------
+{
+   GLint read_framebuffer = 0;
+   glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_framebuffer);
+   const bool is_default = (read_framebuffer == 0);
+   // Sizes of missing attachments cannot be queried (GL_INVALID_OPERATION), so their type is checked first.
+   auto bits = [](GLenum point, GLenum size) -> GLint
+   {
+      GLint type = GL_NONE, value = 0;
+      glGetFramebufferAttachmentParameteriv(GL_READ_FRAMEBUFFER, point, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &type);
+      if (type != GL_NONE)
+         glGetFramebufferAttachmentParameteriv(GL_READ_FRAMEBUFFER, point, size, &value);
+      return value;
+   };
+   const GLint depth_bits = bits((is_default) ? GL_DEPTH : GL_DEPTH_ATTACHMENT, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE),
+               stencil_bits = bits((is_default) ? GL_STENCIL : GL_STENCIL_ATTACHMENT,
+                                   GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE);
+   if (depth_bits <= 0)
+   {
+      attachment = GL_NONE;
+      return GL_NONE;
+   }
+   if (stencil_bits > 0)
+   {
+      attachment = GL_DEPTH_STENCIL_ATTACHMENT;
+      return (depth_bits > 24) ? GL_DEPTH32F_STENCIL8 : GL_DEPTH24_STENCIL8;
+   }
+   attachment = GL_DEPTH_ATTACHMENT;
+   return (depth_bits > 24) ? GL_DEPTH_COMPONENT32F
+                            : ( (depth_bits > 16) ? GL_DEPTH_COMPONENT24 : GL_DEPTH_COMPONENT16 );
+}
+
 bool PointCloudWin::init_axes()
 //----------------------------------
 {
    if (axes_unit("VAO_AXES") != GL_FALSE)
       glDeleteVertexArrays(1, &axes_unit("VAO_AXES"));
-   if (axes_unit("VBO_AXES") != GL_FALSE)
-      glDeleteBuffers(1, &axes_unit("VBO_AXES"));
 
    oglutil::clearGLErrors();
    GLfloat ax = centroid.x, ay = centroid.y, az = centroid.z;
@@ -283,14 +1101,14 @@ bool PointCloudWin::init_axes()
            ax,  miny, az, 0.0f, 1.0f, 0.0f,  ax, maxy, az, 0.0f, 1.0f, 0.0f,
            ax,  ay, minz, 0.0f, 0.0f, 1.0f,  ax, ay, maxz, 0.0f, 0.0f, 1.0f
          };
-   glGenBuffers(1, &axes_unit("VBO_AXES"));
-   glBindBuffer(GL_ARRAY_BUFFER, axes_unit("VBO_AXES"));
-   glBufferData(GL_ARRAY_BUFFER, sizeof(axes), axes, GL_STATIC_DRAW);
-   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   // Shared with windows of the share group showing the same cloud (VAOs are per context).
+   axes_buffer = static_buffer(axes, sizeof(axes));
+   if (! axes_buffer)
+      return false;
 
    glGenVertexArrays(1, &axes_unit("VAO_AXES"));
    glBindVertexArray(axes_unit("VAO_AXES"));
-   glBindBuffer(GL_ARRAY_BUFFER, axes_unit("VBO_AXES"));
+   glBindBuffer(GL_ARRAY_BUFFER, *axes_buffer);
    glEnableVertexAttribArray(0);
    glEnableVertexAttribArray (1);
    GLsizei stride = sizeof(GLfloat) * (3 + 3);
@@ -307,236 +1125,93 @@ bool PointCloudWin::init_axes()
    return true;
 }
 
-inline void _push_vertex(GLfloat*& vertices, GLfloat x, GLfloat y, GLfloat z, GLfloat w,
-                         GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+PointCloudOptions PointCloudWin::cloud_options(const std::string& plyfilename) const
+//---------------------------------------------------------------------------------
 {
-   *vertices++ = x; *vertices++ = y; *vertices++ = z; *vertices++ = w;
-   *vertices++ = r; *vertices++ = g; *vertices++ = b; *vertices++ = a;
+   PointCloudOptions options;
+   options.plyfile = plyfilename;
+   options.scale = scale;
+   options.yz_flip = yz_flip;
+   options.mean_center = mean_center;
+   options.lit = is_lit;
+   options.normal_k = normal_k;
+   options.spatial_sort = is_spatial_sort;
+   return options;
 }
 
-std::unique_ptr<GLfloat[]> PointCloudWin::load_pointcloud()
-//---------------------------------------------------------
+bool PointCloudWin::init_pointcloud()
+//-----------------------------------
 {
-   if (plyfile.empty()) return nullptr;
-   std::ifstream ifs(plyfile.c_str(), std::ios::binary);
-   if (ifs.fail())
-   {
-      std::cerr << "Could not open pointcloud file " << plyfile.filename() << std::endl;;
-      initialised_pc = false;
-      return nullptr;
-   }
-   tinyply::PlyFile file;
-   std::shared_ptr<tinyply::PlyData> verts, colors;
-   try
-   {
-      if (! file.parse_header(ifs))
-      {
-         std::cerr << "Could not parse pointcloud file header for " << plyfile.filename() << std::endl;
-         initialised_pc = false;
-         return nullptr;
-      }
-      for (auto e : file.get_elements())
-      {
-         if (e.name == "vertex")
-         {
-            for (auto p : e.properties)
-            {
-               if ( (p.name == "red") || (p.name == "green") || (p.name == "blue") )
-                  is_color_pointcloud = true;
-               if (p.name == "alpha")
-                  is_alpha_pointcloud = true;
-            }
-         }
-      }
-
-      verts = file.request_properties_from_element("vertex", { "x", "y", "z" });
-      try
-      {
-         if (is_alpha_pointcloud)
-            colors = file.request_properties_from_element("vertex", {"red", "green", "blue", "alpha"});
-         else
-            colors = file.request_properties_from_element("vertex", {"red", "green", "blue"});
-      }
-      catch (const std::exception & e)
-      {
-         is_color_pointcloud = is_alpha_pointcloud = false;
-         std::cerr << "Could not read colors from pointcloud file " << plyfile.filename() << std::endl;
-      }
-      file.read(ifs);
-   }
-   catch (const std::exception & e)
-   {
-      std::cerr << "Exception: " << e.what() << " reading ply file " << plyfile.filename() << std::endl;
-      initialised_pc = false;
-      return nullptr;
-   }
-   if ( (! verts) || (verts->count == 0) )
+   if (! pointcloud_unit) return false;
+   if (plyfile.empty()) return false;
+   std::shared_ptr<const PointCloudData> data = PointCloudCache::instance().get(cloud_options(plyfile.string()));
+   if (! data)
    {
-      std::stringstream ss;
-      ss << "No vertices in file " << plyfile.filename();
-      std::cerr << ss.str().c_str() << std::endl;
       initialised_pc = false;
-      return nullptr;
-   }
-   if ( (! colors) || (colors->count == 0) )
-      is_color_pointcloud = is_alpha_pointcloud = false;
-
-//   size_t bytes = verts->buffer.size_bytes();
-#ifdef BOUNDS_VERTICES
-   count = verts->count + 8;
-#else
-   count = verts->count;
-#endif
-   struct RGB { u_char r,g,b; };
-   struct RGBA { u_char r,g,b,a; };
-   std::vector<GLfloat> Xs, Ys, Zs;
-   auto vertdata = reinterpret_cast<float3 *>(verts->buffer.get());
-   RGB* RGBdata = nullptr;
-   RGBA* RGBAdata = nullptr;
-   if (is_color_pointcloud)
-   {
-      if (is_alpha_pointcloud)
-         RGBAdata = reinterpret_cast<RGBA *>(colors->buffer.get());
-      else
-         RGBdata = reinterpret_cast<RGB *>(colors->buffer.get());
+      return false;
    }
+   return set_cloud(data);
+}
 
-   const size_t buffer_size = count*8;
-   std::unique_ptr<GLfloat[]> vertices(new GLfloat[buffer_size]);
-   GLfloat *vertices_ptr = vertices.get();
-#ifndef NDEBUG
-   GLfloat *vertices_ptr_end = &vertices_ptr[buffer_size];
-#endif
-   const GLfloat flip = (yz_flip) ? -1 : 1;
-   double totalx = 0, totaly = 0, totalz = 0;
-   double n = 0;
-#ifdef PCW_DEBUG_SHADER
-   _vertices_.clear();
-#endif
-   if (! mean_center)
-   {
-      Xs.resize(verts->count);
-      Ys.resize(verts->count);
-      Zs.resize(verts->count);
-   }
-   GLfloat x, y, z, red =1.0f, green =0, blue =0, alpha =1.0f;
-   for (size_t i=0; i<count; i++)
-   {
-      float3 item = vertdata[i];
-      x = item.x * scale;
-      y = item.y * scale*flip;
-      z = item.z * scale*flip;
-      if ( (is_color_pointcloud) && (i < colors->count) )
-      {
-         if (is_color_pointcloud)
-         {
-            if (is_alpha_pointcloud)
-            {
-               red = static_cast<float>(RGBAdata[i].r) / 255.0f;
-               green = static_cast<float>(RGBAdata[i].g) / 255.0f;
-               blue = static_cast<float>(RGBAdata[i].b) / 255.0f;
-               alpha = static_cast<float>(RGBAdata[i].a) / 255.0f;
-            }
-            else
-            {
-               red = static_cast<float>(RGBdata[i].r) / 255.0f;
-               green = static_cast<float>(RGBdata[i].g) / 255.0f;
-               blue = static_cast<float>(RGBdata[i].b) / 255.0f;
-               alpha = 1.0f;
-            }
-         }
-      }
-      else
-      {
-         red = alpha = 1.0f;
-         green = blue = 0;
-      }
-      _push_vertex(vertices_ptr, x, y, z, 1, red, green, blue, alpha);
-#ifdef PCW_DEBUG_SHADER
-      _vertices_.emplace_back(x, y, z);
-#endif
-      if (! mean_center)
-      {
-         Xs[i] = x;
-         Ys[i] = y;
-         Zs[i] = z;
-      }
-      // std::cout << std::fixed << std::setprecision(5) << x << ", " << y << ", " << z << std::endl;
-
-      if (x < minx) minx = x;
-      if (x > maxx) maxx = x;
-      if (y < miny) miny = y;
-      if (y > maxy) maxy = y;
-      if (z < minz) minz = z;
-      if (z > maxz) maxz = z;
-      totalx += x; totaly += y; totalz += z;
-      n++;
-   }
-   assert(vertices_ptr == vertices_ptr_end);
-   rangex = fabsf(maxx - minx); rangey = fabsf(maxy - miny); rangez = fabsf(maxz - minz);
-   max_r = sqrtf(rangex*rangex + rangey*rangey + rangez*rangez);
+bool PointCloudWin::set_cloud(const std::shared_ptr<const PointCloudData>& data)
+//------------------------------------------------------------------------------
+{
+   if ( (! pointcloud_unit) || (! data) ) return false;
+   PointCloudCache& cache = PointCloudCache::instance();
+   cloud_buffer.reset();
+   cloud = data;
+   count = cloud->count;
+   minx = cloud->minx; maxx = cloud->maxx; miny = cloud->miny; maxy = cloud->maxy; minz = cloud->minz;
+   maxz = cloud->maxz;
+   rangex = cloud->rangex; rangey = cloud->rangey; rangez = cloud->rangez;
+   max_r = cloud->max_r;
+   centroid = cloud->centroid;
+   update_projection();
+   visible_first.reserve(cloud->chunk_first.size());
+   visible_count.reserve(cloud->chunk_count.size());
+   draw_count.reserve(cloud->chunk_count.size());
    if (isnanf(r))
       r = max_r/2.0f;
-   phi =PIf/2.0f; theta =0;
    cartesian();
-   vertices_ptr = vertices.get();
+#ifdef PCW_DEBUG_SHADER
+   _vertices_.clear();
+#endif
    maxDistance = std::numeric_limits<float>::lowest();
    for (size_t i=0; i<count; i++)
    {
-      GLfloat x = *vertices_ptr++;
-      GLfloat y = *vertices_ptr++;
-      GLfloat z = *vertices_ptr++;
-      glm::vec3 p(x, y, z);
+      glm::vec3 p = cloud->position(i);
       float d = glm::distance(location, p);
       if (d > maxDistance)
          maxDistance = d;
+#ifdef PCW_DEBUG_SHADER
+      _vertices_.push_back(p);
+#endif
    }
-   if (mean_center)
-   {
-      const auto meanx = static_cast<float>(totalx / n);
-      const auto meany = static_cast<float>(totaly / n);
-      const auto meanz = static_cast<float>(totalz / n);
-      centroid = glm::vec3(meanx, meany, meanz);
-   }
-   else
+
+   cloud_buffer = cache.vertex_buffer(cloud, share_handle());
+   if (! cloud_buffer)
    {
-      std::nth_element(Xs.begin(), Xs.begin() + Xs.size() / 2, Xs.end());
-      std::nth_element(Ys.begin(), Ys.begin() + Ys.size() / 2, Ys.end());
-      std::nth_element(Zs.begin(), Zs.begin() + Zs.size() / 2, Zs.end());
-      const float medianx = Xs[Xs.size() / 2];
-      const float mediany = Ys[Ys.size() / 2];
-      const float medianz = Zs[Zs.size() / 2];
-      centroid = glm::vec3(medianx, mediany, medianz);
+      initialised_pc = false;
+      return false;
    }
-   return vertices;
-}
-
-bool PointCloudWin::init_pointcloud()
-//-----------------------------------
-{
-   if (! pointcloud_unit) return false;
-   std::unique_ptr<GLfloat[]> vertices = load_pointcloud();
-   if (! vertices) return false;
    if (pointcloud_unit("VAO_VERTICES") != GL_FALSE)
       glDeleteVertexArrays(1, &pointcloud_unit("VAO_VERTICES"));
-   if (pointcloud_unit("VBO_VERTICES") != GL_FALSE)
-      glDeleteBuffers(1, &pointcloud_unit("VBO_VERTICES"));
 
    oglutil::clearGLErrors();
-   glGenBuffers(1, &pointcloud_unit("VBO_VERTICES"));
-   glBindBuffer(GL_ARRAY_BUFFER, pointcloud_unit("VBO_VERTICES"));
-   glBufferData(GL_ARRAY_BUFFER, count*8*sizeof(GLfloat), vertices.get(), GL_DYNAMIC_DRAW);
-   glBindBuffer(GL_ARRAY_BUFFER, 0);
-
    glGenVertexArrays(1, &pointcloud_unit("VAO_VERTICES"));
-   glBindVertexArray(pointcloud_unit("VAO_VERTICES"));
-   glBindBuffer(GL_ARRAY_BUFFER, pointcloud_unit("VBO_VERTICES"));
-   glEnableVertexAttribArray(0);
-   glEnableVertexAttribArray (1);
-   GLsizei stride = sizeof(GLfloat) * (4 + 4);
-   glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, stride, 0);
-   glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<const void *>(4 * sizeof (GLfloat)));
-   glBindVertexArray(0);
+   if (! is_vertex_pulling) // otherwise the VAO is empty and the vertex shader reads cloud_buffer by gl_VertexID
+   {
+      glBindVertexArray(pointcloud_unit("VAO_VERTICES"));
+      glBindBuffer(GL_ARRAY_BUFFER, *cloud_buffer);
+      glEnableVertexAttribArray(0);
+      glEnableVertexAttribArray (1);
+      GLsizei stride = sizeof(PointCloudData::PackedVertex);
+      glVertexAttribIPointer(0, 4, GL_UNSIGNED_SHORT, stride, 0);
+      glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                            reinterpret_cast<const void *>(offsetof(PointCloudData::PackedVertex, r)));
+      glBindVertexArray(0);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+   }
    std::stringstream errs;
    GLuint err;
    errs << "OpenGL error loading pointcloud vertices: ";
@@ -545,12 +1220,49 @@ bool PointCloudWin::init_pointcloud()
       std::cerr << errs.str().c_str() << std::endl;
       glDeleteVertexArrays(1, &pointcloud_unit("VAO_VERTICES"));
       pointcloud_unit("VAO_VERTICES") = GL_FALSE;
-      glDeleteBuffers(1, &pointcloud_unit("VBO_VERTICES"));
-      pointcloud_unit("VBO_VERTICES") = GL_FALSE;
+      cloud_buffer.reset();
       initialised_pc = false;
       return false;
    }
+   // Per cloud uniforms only change when the cloud is (re)loaded
+   cloud_uniforms(pointcloud_unit);
+   if (initialised_oit)
+      cloud_uniforms(oit_unit);
+   is_hiz_valid = false;
+   if ( (initialised_cull) && (! upload_chunks()) )
+      cull_failed = true;
+   if (initialised_raster)
+   {
+      cloud_uniforms(raster_unit);
+      const size_t ranges_size = std::max<size_t>(cloud->chunk_first.size(), 1)*2*sizeof(GLint);
+      if (ranges_stream.region_size() < ranges_size)
+      {
+         std::stringstream stream_errs;
+         ranges_stream.del();
+         if (! ranges_stream.create(GL_SHADER_STORAGE_BUFFER, ranges_size, 3, &stream_errs))
+         {
+            std::cerr << "Error creating compute rasterizer buffers: " << stream_errs.str() << std::endl;
+            raster_failed = true;
+         }
+      }
+   }
+   glUseProgram(0);
    initialised_pc = true;
+   if (initialised_axes) // the axes span the cloud bounds
+      initialised_axes = init_axes();
+   request_redraw();
+   return true;
+}
+
+bool PointCloudWin::init_camera_block()
+//-------------------------------------
+{
+   std::stringstream errs;
+   if (! camera_stream.create(GL_UNIFORM_BUFFER, sizeof(CameraBlock), 3, &errs))
+   {
+      std::cerr << "OpenGL error creating camera uniform buffer: " << errs.str() << std::endl;
+      return false;
+   }
    return true;
 }
 
@@ -566,6 +1278,34 @@ std::string PointCloudWin::replace_ver(const char *pch, int ver)
    return std::regex_replace (s, r, ss.str());
 }
 
+// The cloud vertex shader for the current vertex input path (see set_vertex_pulling).
+std::string PointCloudWin::cloud_vertex_source(const std::string& glsl)
+//--------------------------------------------------------------------
+{
+   const std::regex defines_regex(R"(\{\{defines\}\})");
+   return std::regex_replace(replace_ver(glsl.c_str(), glsl_ver), defines_regex,
+                             (is_vertex_pulling) ? "#define VERTEX_PULLING 1\n" : "");
+}
+
+// Sets the uniforms decoding the packed vertices of the current cloud in unit, leaving unit active.
+void PointCloudWin::cloud_uniforms(oglutil::OGLProgramUnit& unit)
+//---------------------------------------------------------------
+{
+   unit.activate();
+   glUniform3f(unit.uniform("bboxMin"), minx, miny, minz);
+   glUniform3f(unit.uniform("bboxScale"), rangex/65535.0f, rangey/65535.0f, rangez/65535.0f);
+   glUniform1f(unit.uniform("lighting"), ((is_lit) && (cloud->has_normals)) ? 1.0f : 0.0f);
+}
+
+bool PointCloudWin::is_gl43()
+//---------------------------
+{
+   GLint major = 0, minor = 0;
+   glGetIntegerv(GL_MAJOR_VERSION, &major);
+   glGetIntegerv(GL_MINOR_VERSION, &minor);
+   return ( ( (major > 4) || ( (major == 4) && (minor >= 3) ) ) && (glsl_ver >= 430) );
+}
+
 void PointCloudWin::cartesian()
 //---------------------------------
 {
@@ -577,6 +1317,7 @@ void PointCloudWin::cartesian()
    // See tangent.tex/tangent.pdf in project root.
    float r2 = r*r;
    tangent = glm::normalize(glm::vec3(-x*y/r2, -y*y/r2 + 1, -y*z/r2));
+   request_redraw();
 
 //    std::cout << std::fixed << std::setprecision(5) << "location: ("
 //              << r << ", " << glm::degrees(theta) << ", " << glm::degrees(phi) << ") = ("
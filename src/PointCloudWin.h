@@ -30,8 +30,11 @@ SOFTWARE.
 #define FIBERGL_POINTCLOUDWIN_H
 
 #include <iostream>
+#include <vector>
+#include <cstdint>
 
 #include "OGLFiberWin.hh"
+#include "PointCloudCache.h"
 
 //#define PCW_DEBUG_SHADER
 
@@ -73,9 +76,87 @@ public:
                   const std::string& plyfilename, float scale =1.0f, bool flip =false, bool is_mean_center = true,
                   int glsl_ver =440,int gl_major =4, int gl_minor = 4, bool can_resize =true);
 
-   void set_center(GLfloat x, GLfloat y, GLfloat z, GLfloat scale =1.0f) { centroid = glm::vec3(x*scale, y*scale, z*scale); }
+   void set_center(GLfloat x, GLfloat y, GLfloat z, GLfloat scale =1.0f) { centroid = glm::vec3(x*scale, y*scale, z*scale); request_redraw(); }
    void set_r(float _r) { r = _r; cartesian(); }
-   void set_point_size(GLfloat psize) { pointSize = psize; }
+   // Set the eye location in the spherical coordinate system (angles in radians, see cartesian()).
+   void set_camera(float _r, float _theta, float _phi) { r = _r; theta = _theta; phi = _phi; cartesian(); }
+   void set_point_size(GLfloat psize) { pointSize = psize; request_redraw(); }
+   /**
+    * Enable/disable Lambert shading using per-point normals. If the ply file does not contain normals (nx, ny, nz)
+    * they are estimated by PCA over the k nearest neighbours when the cloud is loaded, and cached next to the ply
+    * file in <plyfile>.normals. Must be called before the window is started.
+    */
+   void set_lighting(bool lit, int k =16) { is_lit = lit; normal_k = k; }
+   /**
+    * If true (the default) points are sorted into Morton (Z-curve) order before being uploaded so that points that
+    * are close in space are close in the vertex buffer. Must be called before the window is started.
+    */
+   void set_spatial_sort(bool is_sorted) { is_spatial_sort = is_sorted; }
+   /**
+    * Maximum number of points to draw while the user is interacting (dragging or zooming), 0 for no limit. Points
+    * are stored in a progressive order within spatial chunks (see PointCloudData), so drawing the same fraction of
+    * each visible chunk gives a uniform subsample of the visible cloud. All visible points are drawn when idle.
+    */
+   void set_point_budget(size_t budget) { point_budget = budget; }
+   /**
+    * GPU time target in milliseconds for drawing the cloud while interacting (0 to disable). The number of points is
+    * reduced based on the measured GPU cost per point so that the target is met.
+    */
+   void set_frame_time_target(float ms) { frame_time_target_ms = ms; }
+   /**
+    * Level of detail: the number of points drawn from each visible chunk is reduced so that the projected spacing
+    * between the points drawn is about pixels (using the nearest point of the chunk's bounds), which keeps the
+    * number of points drawn roughly proportional to the screen area covered instead of the cloud size. As the
+    * points in a chunk are in progressive order the points drawn are the coarser levels of an implicit
+    * hierarchy. 0 to always draw all visible points.
+    */
+   void set_lod_error(float pixels) { lod_error_px = pixels; request_redraw(); }
+   /**
+    * Draw the cloud with a compute shader rasterizer (one pixel per point, GL 4.3+) instead of GL_POINTS. Points
+    * are written to a storage buffer framebuffer with 64 bit atomicMin on packed depth and colour when
+    * GL_NV_shader_atomic_int64 is available, otherwise with a 32 bit depth pass followed by a colour pass, and then
+    * resolved to the window framebuffer. Can be changed while running; falls back to GL_POINTS if the compute
+    * shaders cannot be built.
+    */
+   void set_compute_raster(bool is_compute) { is_compute_raster = is_compute; request_redraw(); }
+   bool compute_raster() const { return ( (is_compute_raster) && (! raster_failed) ); }
+   /**
+    * Clouds with an alpha property are drawn with weighted blended order independent transparency (accumulation
+    * and revealage targets composited over the opaque axes) unless disabled here, in which case alpha is ignored.
+    * No per frame sort is needed so the cost is close to drawing opaque points. The compute rasterizer is opaque.
+    */
+   void set_transparency(bool is_transparent) { is_transparency = is_transparent; request_redraw(); }
+   /**
+    * Cull and select the level of detail of the chunks with a compute shader (GL 4.3+) that writes a compacted list
+    * of DrawArraysIndirectCommand, drawn with a single glMultiDrawArraysIndirect (glMultiDrawArraysIndirectCount
+    * with GL_ARB_indirect_parameters), so the CPU cost of a frame does not depend on the number of chunks. Chunks
+    * are also tested against a maximum depth pyramid of the previous frame when set_occlusion_culling is true (the
+    * default); a frame whose camera differs from the previous one then requests a redraw so that chunks it wrongly
+    * culled are drawn. The compute rasterizer still culls on the CPU. Falls back to CPU culling if the shaders
+    * cannot be built.
+    */
+   void set_gpu_culling(bool is_gpu) { is_gpu_culling = is_gpu; request_redraw(); }
+   void set_occlusion_culling(bool is_occlusion) { is_occlusion_culling = is_occlusion; request_redraw(); }
+   bool gpu_culling() const { return ( (is_gpu_culling) && (! cull_failed) && (! compute_raster()) ); }
+   /**
+    * If true (the default) the cloud vertex shader fetches and decodes the packed vertices from a shader storage
+    * buffer by gl_VertexID instead of through vertex attributes, so the vertex layout is defined only by the loader
+    * and the shader. Requires OpenGL 4.3, otherwise vertex attributes are used. Must be called before the window is
+    * started.
+    */
+   void set_vertex_pulling(bool is_pulling) { is_vertex_pulling = is_pulling; }
+   void show_axes(bool is_shown) { is_axes_shown = is_shown; request_redraw(); }
+   /**
+    * The options clouds are loaded with for this window (see PointCloudCache::get), so that clouds can be loaded
+    * ahead of time, eg on other threads, and then displayed with set_cloud.
+    */
+   PointCloudOptions cloud_options(const std::string& plyfilename) const;
+   /**
+    * Replace the displayed cloud with data (from PointCloudCache::get with cloud_options). Uploads the vertex buffer
+    * so must be called with the window's context current, eg from on_render. The camera is left unchanged.
+    */
+   bool set_cloud(const std::shared_ptr<const PointCloudData>& data);
+   float cloud_radius() const { return max_r; }
 
 protected:
    void on_initialize(const GLFWwindow*) override;
@@ -86,6 +167,7 @@ protected:
    void on_mouse_click(int button, int action, int mods) override;
    void on_mouse_scroll(double x, double y) override
    {
+      last_interaction = std::chrono::high_resolution_clock::now();
       r += sgn(y)*0.1f*r;
       if (r < max_r/6.0f) r = max_r/6.0f;
       if (r > max_r*1.5f) r = max_r*1.5f;
@@ -100,26 +182,73 @@ private:
    bool is_dragging = false, yz_flip = false, mean_center =true;
    std::pair<double, double> cursor_pos, drag_start;
    filesystem::path shader_directory;
-   oglutil::OGLProgramUnit axes_unit, pointcloud_unit;
-   bool initialised_axes = false, initialised_pc = false;
-   float scale = 1.0;
-   struct float3
+   oglutil::OGLProgramUnit axes_unit, pointcloud_unit, raster_unit, resolve_unit, oit_unit, composite_unit, cull_unit,
+                           hiz_unit;
+   // std140 layout of the Camera uniform block shared by the axes and cloud shaders, written once per frame to
+   // camera_stream.
+   struct CameraBlock
    {
-      float x, y, z;
-      float3(float x_, float y_, float z_) : x(x_), y(y_), z(z_) {}
+      glm::mat4 MVP, MV, P;
+      GLfloat maxDistance, pointSize, pad[2];
    };
+   static_assert(sizeof(CameraBlock) == 3*64 + 16, "CameraBlock does not match the std140 Camera block");
+   static const GLuint CAMERA_BINDING = 0;
+   static const GLuint VERTEX_BINDING = 0; // Vertices storage block in cloud/vertex.glsl and raster/compute.glsl
+   bool initialised_axes = false, initialised_pc = false, is_axes_shown = true;
+   float scale = 1.0;
+   // Shared with other windows showing the same file with the same options (see PointCloudCache). The vertex
+   // and axes buffers are not held in the units as OGLProgramUnit::del would delete them.
+   std::shared_ptr<const PointCloudData> cloud;
+   std::shared_ptr<const GLuint> cloud_buffer, axes_buffer;
    size_t count = 0;
    filesystem::path plyfile;
    float minx = std::numeric_limits<float>::max(), maxx = std::numeric_limits<float>::lowest(),
          miny = std::numeric_limits<float>::max(), maxy = std::numeric_limits<float>::lowest(),
          minz = std::numeric_limits<float>::max(), maxz = std::numeric_limits<float>::lowest(),
          rangex =0, rangey =0, rangez =0;
-   bool is_color_pointcloud =false, is_alpha_pointcloud = false;
+   bool is_lit = true, is_spatial_sort = true, is_vertex_pulling = true;
+   int normal_k = 16;
    float max_r = 0, r = std::numeric_limits<float>::quiet_NaN(), phi =PIf/2.0f, theta =0, maxDistance = 0;
    glm::vec3 location{0, 0, 0}, centroid{0, 0, 0}, tangent{0, 1, 0};
    glm::mat4 P;
    GLfloat pointSize =8.0f; // gl_pointSize equivalent uniform in shader
    GLFWcursor* rotating_cursor = nullptr;
+   size_t point_budget = 0;
+   float frame_time_target_ms = 0;
+   std::vector<uint32_t> visible; // chunks that passed frustum culling this frame
+   std::vector<GLint> visible_first;
+   std::vector<GLsizei> visible_count, draw_count;
+   size_t visible_points = 0;
+   float lod_error_px = 1.0f;
+   bool is_compute_raster = false, initialised_raster = false, raster_failed = false, is_atomic64 = false;
+   int raster_width = 0, raster_height = 0;
+   bool is_transparency = true, initialised_oit = false, oit_failed = false;
+   int oit_width = 0, oit_height = 0;
+   GLuint oit_target = 0; // render_target() the transparency depth buffer was sized for
+   bool is_oit_depth_blit = false; // the opaque depth can be blitted to the transparency depth buffer
+   bool is_gpu_culling = false, is_occlusion_culling = true, initialised_cull = false, cull_failed = false;
+   bool is_indirect_count = false, is_hiz_valid = false, hiz_resolve_failed = false;
+   int hiz_width = 0, hiz_height = 0, hiz_levels = 0;
+   glm::mat4 hiz_MVP; // view projection of the frame the depth pyramid was built from
+   float cull_fraction = 1.0f; // fraction of the points of each chunk the GPU culling draws this frame
+   size_t gpu_visible_points = 0; // estimated from the points drawn by GPU culling QUERY_RING frames ago
+   // std430 layout of Chunk in cull/compute.glsl
+   struct GPUChunk
+   {
+      GLfloat lo[4], hi[4]; // bounds, lo[3] = mean point spacing
+      GLuint first, count, pad[2];
+   };
+   static_assert(sizeof(GPUChunk) == 48, "GPUChunk does not match the std430 Chunk struct");
+   oglutil::StreamBuffer camera_stream;
+   oglutil::StreamBuffer ranges_stream; // first, count pairs of the visible chunks for the compute rasterizer
+   static const size_t QUERY_RING = 4;
+   GLuint draw_queries[QUERY_RING] = { 0 };
+   size_t query_points[QUERY_RING] = { 0 };
+   GLuint point_queries[QUERY_RING] = { 0 }; // GL_PRIMITIVES_GENERATED of GPU culled draws
+   float query_fraction[QUERY_RING] = { 0 }; // cull_fraction of GPU culled draws, 0 for CPU culled draws
+   size_t query_frame = 0;
+   double ns_per_point = 0; // moving average of measured GPU draw cost
+   std::chrono::high_resolution_clock::time_point last_interaction;
    bool has_focus = false;
    int last_button =0, last_button_action =0, last_button_mods =0;
    double last_xpos =std::numeric_limits<float>::min(), last_ypos =std::numeric_limits<float>::min();
@@ -129,16 +258,42 @@ private:
 
    bool init_pointcloud();
    bool init_axes();
-   std::unique_ptr<GLfloat[]> load_pointcloud();
+   bool init_camera_block();
+   bool init_raster();
+   void raster_points(const GLsizei* counts);
+   bool init_oit();
+   bool resize_oit();
+   void composite_oit();
    void rotation_update(double xpos, double ypos);
+   bool is_interacting();
+   void cull_chunks(const glm::mat4& MVP);
+   size_t points_to_draw();
+   void draw_points(size_t n);
+   void update_draw_cost();
+   bool init_cull();
+   bool upload_chunks();
+   void cull_gpu(const glm::mat4& MVP);
+   void draw_points_gpu();
+   void build_hiz(const glm::mat4& MVP);
+   bool resolve_depth();
+   GLenum depth_format(GLenum& attachment) const;
 
    static constexpr float angle_incr = glm::radians(0.05f);
    static constexpr float margin = 8.0f;
    static constexpr float max_phi = glm::radians(120.0f);
    static constexpr double PI = 3.14159265358979323846264338327;
    static constexpr float PIf = 3.14159265358979f;
+   static constexpr float FOVY = glm::radians(45.0f);
+   static constexpr long INTERACTION_MS = 300; // time after the last scroll event still treated as interaction
+   static const GLuint RASTER_GROUP_SIZE = 256; // local_size_x in raster/compute.glsl
+   static const GLuint CULL_GROUP_SIZE = 64; // local_size_x in cull/compute.glsl
+   static const GLuint HIZ_GROUP_SIZE = 8; // local_size_x and y in cull/hiz.glsl
    static std::string replace_ver(const char *s, int ver);
 
    void cartesian();
+   void update_projection();
+   std::string cloud_vertex_source(const std::string& glsl);
+   void cloud_uniforms(oglutil::OGLProgramUnit& unit);
+   bool is_gl43();
 };
 #endif //FIBERGL_POINTCLOUDWIN_H
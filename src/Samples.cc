@@ -63,12 +63,12 @@ void Sample::on_initialize(const GLFWwindow *)
    glEnable(GL_DEPTH_TEST);
    GLenum err;
    std::stringstream errs;
-   shader_unit.program = oglutil::compile_link_shader(replace_ver(vertex_shader(), glsl_version()), shader_unit.vertex_shader,
-                                          replace_ver(tesselation_control_shader(), glsl_version()), shader_unit.tess_control_shader,
-                                          replace_ver(tesselation_eval_shader(), glsl_version()), shader_unit.tess_eval_shader,
-                                          replace_ver(geometry_shader(), glsl_version()), shader_unit.geometry_shader,
-                                          replace_ver(fragment_shader(), glsl_version()), shader_unit.fragment_shader,
-                                          err, &errs);
+   // In a share group the default vertex shader and the quad are shared by the samples.
+   err = link_program(shader_unit, replace_ver(vertex_shader(), glsl_version()),
+                      replace_ver(fragment_shader(), glsl_version()), &errs,
+                      replace_ver(geometry_shader(), glsl_version()),
+                      replace_ver(tesselation_control_shader(), glsl_version()),
+                      replace_ver(tesselation_eval_shader(), glsl_version()));
    if (shader_unit.program ==  GL_FALSE)
    {
       std::stringstream ss;
@@ -83,14 +83,15 @@ void Sample::on_initialize(const GLFWwindow *)
            1.0f, 1.0f
          };
    oglutil::clearGLErrors();
-   GLuint quad_vbo = shader_unit(quad_vbo_name);
-   glGenBuffers(1, &quad_vbo);
-   glBindBuffer(GL_ARRAY_BUFFER, quad_vbo);
-   glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
-   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   quad_buffer = static_buffer(quad, sizeof(quad));
+   if (! quad_buffer)
+   {
+      is_good = false;
+      return;
+   }
    glGenVertexArrays(1, &shader_unit("VAO"));
    glBindVertexArray(shader_unit("VAO"));
-   glBindBuffer(GL_ARRAY_BUFFER, quad_vbo);
+   glBindBuffer(GL_ARRAY_BUFFER, *quad_buffer);
    glEnableVertexAttribArray(0);
    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
    glBindVertexArray(0);
@@ -122,45 +123,18 @@ void Sample1::on_initialize(const GLFWwindow *win)
 bool Sample1::on_render()
 //---------------------
 {
-   oglutil::clearGLErrors();
+   oglutil::clearFrameErrors();
    glClearColor(0, 0, 0, 1.0);
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-   GLenum err;
-   std::stringstream errs;
    glUseProgram(shader_unit.program);
-   if (! oglutil::isGLOk(err, &errs))
-   {
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      return false;
-   }
-   glUniform2f(resolution_uniform, width, height);
-   if (! oglutil::isGLOk(err, &errs))
-   {
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      return false;
-   }
+   glUniform2f(resolution_uniform, render_width, render_height);
    glUniform1f(time_uniform, time);
    time += 0.1;
 //   if (time > 1) time =-1;
-   if (! oglutil::isGLOk(err, &errs))
-   {
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      return false;
-   }
    glBindVertexArray(shader_unit("VAO"));
    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4); // Only for use with Sample::default_vertex_glsl
-   if (! oglutil::isGLOk(err, &errs))
-   {
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      return false;
-   }
    glUseProgram(0);
-   if (! oglutil::isGLOk(err, &errs))
-   {
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      return false;
-   }
-   return true;
+   return oglutil::isFrameOk("Sample1::on_render");
 }
 
 void Sample2::on_initialize(const GLFWwindow *win)
@@ -174,43 +148,16 @@ void Sample2::on_initialize(const GLFWwindow *win)
 bool Sample2::on_render()
 //---------------------
 {
-   oglutil::clearGLErrors();
+   oglutil::clearFrameErrors();
    glClearColor(0, 0, 0, 1.0);
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-   GLenum err;
-   std::stringstream errs;
    glUseProgram(shader_unit.program);
-   if (! oglutil::isGLOk(err, &errs))
-   {
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      return false;
-   }
-   glUniform2f(resolution_uniform, width, height);
-   if (! oglutil::isGLOk(err, &errs))
-   {
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      return false;
-   }
+   glUniform2f(resolution_uniform, render_width, render_height);
    glUniform1f(time_uniform, time);
    time += 0.1;
 //   if (time > 1) time =-1;
-   if (! oglutil::isGLOk(err, &errs))
-   {
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      return false;
-   }
    glBindVertexArray(shader_unit("VAO"));
    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4); // Only for use with Sample::default_vertex_glsl
-   if (! oglutil::isGLOk(err, &errs))
-   {
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      return false;
-   }
    glUseProgram(0);
-   if (! oglutil::isGLOk(err, &errs))
-   {
-      std::cerr << err << ": " << errs.str().c_str() << std::endl;
-      return false;
-   }
-   return true;
+   return oglutil::isFrameOk("Sample2::on_render");
 }
@@ -50,7 +50,7 @@ protected:
    static std::string replace_ver(const char *s, int ver);
 
    int width =0, height =0;
-   std::string quad_vbo_name = "VBO_quad";
+   std::shared_ptr<const GLuint> quad_buffer; // not in shader_unit which would delete it, see static_buffer
    oglutil::OGLProgramUnit shader_unit;
 //   GLuint program =0, vertexShader =0, tessControlShader =0, tessEvalShader =0, geometryShader =0,
 //          fragmentShader =0, quad_vbo =0, quad_vao =0;
@@ -65,7 +65,7 @@ void main()
 })";
 
    static const long FPS = 50;
-   static constexpr long FPS_NS = (1000000000L / (FPS >> 1));
+   static constexpr long FPS_NS = (1000000000L / FPS);
 };
 
 class Sample1 : public Sample
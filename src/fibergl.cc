@@ -49,6 +49,8 @@ int main(int argc, char *argv[])
 //-----------------------------
 {
    oglfiber::OGLFiberExecutor& gl_executor = oglfiber::OGLFiberExecutor::instance();
+   // The windows share one GL share group so common shaders and buffers are only created once.
+   oglfiber::OGLFiberExecutor::use_share_group("fibergl");
    Sample1* sample1_ptr = new Sample1("Sample 1", 1024, 768, GLSL_VER, "shaders/sample1/", OPENGL_MAJOR, OPENGL_MINOR);
    Sample2* sample2_ptr = new Sample2("Sample 2", 1024, 768, GLSL_VER, "shaders/sample2/", OPENGL_MAJOR, OPENGL_MINOR);
    PointCloudWin* penholder = new PointCloudWin("Clock Penholder", 1024, 768, "shaders/pc/", "shaders/pc/clock.ply", 100, true,
@@ -59,5 +61,12 @@ int main(int argc, char *argv[])
    bunny->set_r(20.0f);
    PointCloudWin* dode = new PointCloudWin("Dodecahedron", 1024, 768, "shaders/pc/", "shaders/pc/dodecahedron.ply");
    dode->set_point_size(15.0f);
+   // The point clouds only change when the user interacts with them
+   penholder->render_on_demand(true);
+   bunny->render_on_demand(true);
+   dode->render_on_demand(true);
+   // fibergl --capture <directory> records the bunny window
+   if ( (argc > 2) && (std::string(argv[1]) == "--capture") )
+      bunny->start_capture(argv[2]);
    gl_executor.start({sample1_ptr, sample2_ptr, dode, penholder, bunny}, false);
 }
\ No newline at end of file
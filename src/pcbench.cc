@@ -0,0 +1,191 @@
+/*
+Copyright (c) 2017 Donald Munro
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+/*
+ * Point cloud draw time benchmark. Opens the same ply file in two windows, orbits the camera and reports the GPU
+ * time per frame (GL_TIMESTAMP pairs, as PointCloudWin uses GL_TIME_ELAPSED internally) for each. The windows
+ * compare either file order against Morton order (order, the default), GL_POINTS against the compute
+ * rasterizer, both in Morton order (raster), or CPU against GPU chunk culling (cull). For a software comparison
+ * run under Mesa llvmpipe with LIBGL_ALWAYS_SOFTWARE=1.
+ * The GPU is drained before and after each timed frame so that the windows do not overlap on the GPU. The CPU time
+ * between the two drains is also reported, as software renderers such as llvmpipe defer rasterization to the flush
+ * so their timestamps only cover the commands executed when they are submitted (eg compute dispatches).
+ * The per pass breakdown from OGLFiberWindow::gpu_stats (and pipeline statistics where supported) is also printed.
+ * With threads > 1 the windows render on their own threads (OGLFiberExecutor::thread_pool) so the GPU times
+ * include contention between them, and the wall clock frame rate of each window is reported.
+ *
+ * Usage: fibergl_bench [plyfile (shaders/pc/bunny.ply)] [scale (100)] [r (20)] [frames (600)] [order|raster|cull]
+ *                      [threads (1)]
+ */
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <atomic>
+#include <chrono>
+
+#include "OGLFiberWin.hh"
+#include "PointCloudWin.h"
+
+const int OPENGL_MAJOR = 4;
+const int OPENGL_MINOR = 5;
+const int GLSL_VER = 450;
+
+class TimedPointCloudWin : public PointCloudWin
+//==============================================
+{
+public:
+   TimedPointCloudWin(std::string title, const std::string& plyfilename, float scale, float r, size_t frames,
+                      bool is_sorted, bool is_compute =false, bool is_gpu_cull =false) :
+                      PointCloudWin(title, 1024, 768, "shaders/pc/", plyfilename, scale, false, true,
+                                    GLSL_VER, OPENGL_MAJOR, OPENGL_MINOR, false),
+                                        name(title), radius(r), frames(frames)
+   {
+      set_spatial_sort(is_sorted);
+      set_lod_error(0); // Unsorted chunks overlap so LOD would only reduce the sorted window's points
+      set_compute_raster(is_compute);
+      set_gpu_culling(is_gpu_cull);
+      set_camera(radius, 0, PIf/2.0f);
+      frames_per_second(1000);
+      gpu_profiling(true, true);
+      windows++;
+   }
+
+protected:
+   void on_initialize(const GLFWwindow* win) override
+   {
+      PointCloudWin::on_initialize(win);
+      glGenQueries(2, queries);
+   }
+
+   bool on_render() override
+   //-----------------------
+   {
+      theta = add_angle(theta, 2*PIf/240.0f, 2*PIf);
+      set_camera(radius, theta, PIf/3.0f);
+      glFinish();
+      const std::chrono::steady_clock::time_point drained = std::chrono::steady_clock::now();
+      glQueryCounter(queries[0], GL_TIMESTAMP);
+      bool ok = PointCloudWin::on_render();
+      glQueryCounter(queries[1], GL_TIMESTAMP);
+      glFinish();
+      const double finish_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - drained).count();
+      GLuint64 start = 0, end = 0;
+      glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &start);
+      glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &end);
+      const GLuint64 ns = end - start;
+      frame++;
+      if (frame == WARMUP + 1)
+         started = std::chrono::steady_clock::now();
+      if ( (frame > WARMUP) && (times.size() < frames) )
+      {
+         times.push_back(ns / 1000000.0);
+         finish_times.push_back(finish_ms);
+         if (times.size() == frames)
+         {
+            report();
+            completed++;
+         }
+      }
+      return ( (ok) && (completed < windows) );
+   }
+
+private:
+   std::string name;
+   float radius, theta = 0;
+   size_t frames, frame = 0;
+   GLuint queries[2] = { 0, 0 };
+   std::vector<double> times, finish_times;
+   std::chrono::steady_clock::time_point started;
+   static int windows;
+   static std::atomic<int> completed; // windows may render on different threads
+   static const size_t WARMUP = 30;
+   static constexpr float PIf = 3.14159265358979f;
+
+   void report()
+   //-----------
+   {
+      std::vector<double> sorted(times);
+      std::sort(sorted.begin(), sorted.end());
+      std::stringstream out; // written at once as the windows may report concurrently
+      const double mean = std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+      out << std::fixed << std::setprecision(4) << name << ": " << sorted.size() << " frames, GPU ms/frame mean "
+          << mean << " median " << sorted[sorted.size()/2] << " min " << sorted.front() << " p95 "
+          << sorted[(sorted.size()*95)/100] << " ("
+          << sorted.size() / std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count()
+          << " frames/s)" << std::endl;
+      std::vector<double> finish_sorted(finish_times);
+      std::sort(finish_sorted.begin(), finish_sorted.end());
+      out << "   CPU ms/frame between glFinish calls mean "
+          << std::accumulate(finish_sorted.begin(), finish_sorted.end(), 0.0) / finish_sorted.size() << " median "
+          << finish_sorted[finish_sorted.size()/2] << " min " << finish_sorted.front() << " p95 "
+          << finish_sorted[(finish_sorted.size()*95)/100] << std::endl;
+      for (const oglutil::GPUProfiler::Stats& stats : gpu_stats())
+         out << "   " << stats.name << ": mean " << stats.mean_ms << " ms min " << stats.min_ms << " max "
+             << stats.max_ms << " (last " << stats.samples << " frames)" << std::endl;
+      const oglutil::GPUProfiler::PipelineStats pipeline = gpu_pipeline_stats();
+      if (pipeline.vertices > 0)
+         out << "   vertices " << pipeline.vertices << " fragment invocations " << pipeline.fragment_invocations
+             << " compute invocations " << pipeline.compute_invocations << std::endl;
+      std::cout << out.str() << std::flush;
+   }
+};
+
+int TimedPointCloudWin::windows = 0;
+std::atomic<int> TimedPointCloudWin::completed{0};
+
+int main(int argc, char *argv[])
+//-----------------------------
+{
+   const std::string plyfile = (argc > 1) ? argv[1] : "shaders/pc/bunny.ply";
+   const float scale = (argc > 2) ? std::stof(argv[2]) : 100.0f;
+   const float r = (argc > 3) ? std::stof(argv[3]) : 20.0f;
+   const size_t frames = (argc > 4) ? std::stoul(argv[4]) : 600;
+   oglfiber::OGLFiberExecutor& gl_executor = oglfiber::OGLFiberExecutor::instance();
+   const std::string compare = (argc > 5) ? argv[5] : "order";
+   gl_executor.thread_pool((argc > 6) ? static_cast<unsigned>(std::stoul(argv[6])) : 1);
+   TimedPointCloudWin *first, *second;
+   if (compare == "raster")
+   {
+      first = new TimedPointCloudWin("GL_POINTS", plyfile, scale, r, frames, true, false);
+      second = new TimedPointCloudWin("Compute raster", plyfile, scale, r, frames, true, true);
+   }
+   else if (compare == "cull")
+   {
+      first = new TimedPointCloudWin("CPU culling", plyfile, scale, r, frames, true, false, false);
+      second = new TimedPointCloudWin("GPU culling", plyfile, scale, r, frames, true, false, true);
+   }
+   else
+   {
+      first = new TimedPointCloudWin("File order", plyfile, scale, r, frames, false);
+      second = new TimedPointCloudWin("Morton order", plyfile, scale, r, frames, true);
+   }
+   if ( (! first->good()) || (! second->good()) )
+   {
+      std::cerr << "Error creating benchmark windows for " << plyfile << std::endl;
+      return 1;
+   }
+   gl_executor.start({first, second}, false);
+   return 0;
+}
@@ -0,0 +1,350 @@
+/*
+Copyright (c) 2017 Donald Munro
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+/*
+ * Batch point cloud thumbnail renderer. Renders each ply file from one or more viewpoints in a single window (a
+ * headless EGL context when built with FIBERGL_EGL), reusing its context and shader programs for every file. Files
+ * are loaded (and their normals estimated) by a pool of worker threads a few files ahead of the renderer, and the
+ * images are read back asynchronously through FrameCapture and encoded on its encoder thread, so the renderer only
+ * waits when the loaders fall behind.
+ *
+ * Usage: fibergl_render [options] plyfile... | --list <file of ply paths, one per line>
+ *   --view r,theta,phi  Camera in PointCloudWin's spherical coordinates with theta and phi in degrees; r of 0 fits
+ *                       the whole cloud in view. Repeat for several views (default 0,30,60).
+ *   --out <directory>   Output directory (default thumbnails). Images are named <ply stem>[_<view>].png
+ *   --size <w>x<h>      Image size (default 256x256)
+ *   --threads <n>       Loader threads (default hardware threads - 1)
+ *   --scale <s>         Point scale factor (default 1)
+ *   --point-size <px>   Point size (default 4)
+ *   --unlit             Do not estimate normals or light the points
+ *   --normal-cache <dir> Directory for estimated normals (default <plyfile>.normals beside each input file)
+ *   --raw               Write PAM instead of PNG
+ *   --shaders <dir>     Shader directory (default shaders/pc/)
+ */
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+
+#include "OGLFiberWin.hh"
+#include "PointCloudWin.h"
+#include "PointCloudCache.h"
+
+const int OPENGL_MAJOR = 4;
+const int OPENGL_MINOR = 5;
+const int GLSL_VER = 450;
+const float CAMERA_FOVY = glm::radians(45.0f); // PointCloudWin vertical field of view
+
+// Loads point clouds through PointCloudCache on a pool of threads, keeping at most lookahead loaded clouds that
+// have not been taken by the renderer.
+class CloudLoader
+//===============
+{
+public:
+   CloudLoader(const std::vector<PointCloudOptions>& options, unsigned threads, size_t lookahead) :
+         options(options), lookahead(std::max<size_t>(lookahead, 1))
+   {
+      for (unsigned i = 0; i < std::max(threads, 1U); i++)
+         workers.emplace_back(&CloudLoader::load, this);
+   }
+
+   ~CloudLoader()
+   {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         must_stop = true;
+      }
+      taken.notify_all();
+      for (std::thread& worker : workers)
+         worker.join();
+   }
+
+   // Waits for the next loaded cloud (in completion order). data is nullptr if index could not be loaded. Returns
+   // false when every file has been taken.
+   bool next(size_t& index, std::shared_ptr<const PointCloudData>& data)
+   //--------------------------------------------------------------------
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (taken_count >= options.size()) return false;
+      loaded_one.wait(lock, [this]() { return (! loaded.empty()); });
+      index = loaded.front().first;
+      data = std::move(loaded.front().second);
+      loaded.pop_front();
+      taken_count++;
+      lock.unlock();
+      taken.notify_one();
+      return true;
+   }
+
+private:
+   const std::vector<PointCloudOptions> options;
+   const size_t lookahead;
+   std::vector<std::thread> workers;
+   std::mutex mutex;
+   std::condition_variable loaded_one, taken;
+   std::deque<std::pair<size_t, std::shared_ptr<const PointCloudData>>> loaded;
+   size_t next_index = 0, in_flight = 0, taken_count = 0;
+   bool must_stop = false;
+
+   void load()
+   //---------
+   {
+      while (true)
+      {
+         size_t index;
+         {
+            std::unique_lock<std::mutex> lock(mutex);
+            taken.wait(lock, [this]() { return ( (must_stop) || (loaded.size() + in_flight < lookahead) ); });
+            if ( (must_stop) || (next_index >= options.size()) )
+               return;
+            index = next_index++;
+            in_flight++;
+         }
+         std::shared_ptr<const PointCloudData> data = PointCloudCache::instance().get(options[index]);
+         {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_flight--;
+            loaded.emplace_back(index, std::move(data));
+         }
+         loaded_one.notify_one();
+      }
+   }
+};
+
+struct View
+{
+   float r, theta, phi; // radians
+};
+
+class ThumbnailWin : public PointCloudWin
+//=======================================
+{
+public:
+   ThumbnailWin(const std::vector<std::string>& files, const std::vector<View>& views, const std::string& directory,
+                int w, int h, const std::string& shader_dir, float scale, bool is_lit, FrameCapture::Format format,
+                unsigned threads) : PointCloudWin("fibergl_render", w, h, shader_dir, files.front(), scale, false, true,
+                                                  GLSL_VER, OPENGL_MAJOR, OPENGL_MINOR, false),
+                                    files(files), views(views), directory(directory), format(format), threads(threads)
+   {
+      set_lighting(is_lit);
+      set_lod_error(0);
+      show_axes(false);
+      frames_per_second(1000);
+   }
+
+   size_t images() const { return writer.written(); }
+   size_t failed() const { return failures; }
+
+protected:
+   void on_initialize(const GLFWwindow* win) override
+   //------------------------------------------------
+   {
+      PointCloudWin::on_initialize(win);
+      if (! good())
+         return;
+      std::stringstream errs;
+      if (! writer.start(directory, "", format, 3, 8, &errs))
+      {
+         std::cerr << "Error starting image writer for " << directory << ": " << errs.str() << std::endl;
+         is_good = false;
+         return;
+      }
+      writer.set_lossless(true);
+      std::vector<PointCloudOptions> options;
+      for (const std::string& file : files)
+         options.push_back(cloud_options(file));
+      loader.reset(new CloudLoader(options, threads, 2*threads));
+   }
+
+   bool on_render() override
+   //-----------------------
+   {
+      if (! loader) return false;
+      while (view >= views.size())
+      {
+         size_t index;
+         std::shared_ptr<const PointCloudData> data;
+         if (! loader->next(index, data))
+         {
+            writer.finish();
+            writer.stop();
+            return false;
+         }
+         if ( (data) && (set_cloud(data)) )
+         {
+            name = filesystem::path(files[index]).stem().string();
+            view = 0;
+            is_file_failed = false;
+         }
+         else
+         {
+            std::cerr << "Skipping " << files[index] << std::endl;
+            failures++;
+         }
+      }
+      const View& v = views[view];
+      // r of 0 frames the cloud's bounding sphere (radius cloud_radius()/2) with a margin
+      set_camera((v.r > 0) ? v.r : 1.1f*cloud_radius()/(2.0f*sinf(CAMERA_FOVY/2.0f)), v.theta, v.phi);
+      const std::string image = (views.size() > 1) ? name + "_" + std::to_string(view) : name;
+      view++;
+      if (! PointCloudWin::on_render())
+      {
+         // A file is counted once however many of its views fail.
+         std::cerr << "Error rendering " << image << std::endl;
+         if (! is_file_failed)
+            failures++;
+         is_file_failed = true;
+         return true;
+      }
+      writer.capture(render_target(), render_width, render_height, image);
+      return true;
+   }
+
+   void on_exit() override { loader.reset(); }
+
+private:
+   std::vector<std::string> files;
+   std::vector<View> views;
+   std::string directory, name;
+   FrameCapture::Format format;
+   unsigned threads;
+   FrameCapture writer; // one image per view, named after the file
+   std::unique_ptr<CloudLoader> loader;
+   size_t view = std::numeric_limits<size_t>::max(), failures = 0;
+   bool is_file_failed = false;
+};
+
+int main(int argc, char *argv[])
+//-----------------------------
+{
+   std::vector<std::string> files;
+   std::vector<View> views;
+   std::string directory = "thumbnails", shader_dir = "shaders/pc/";
+   int width = 256, height = 256;
+   unsigned threads = std::max(std::thread::hardware_concurrency(), 2U) - 1;
+   float scale = 1.0f, point_size = 4.0f;
+   bool is_lit = true;
+   FrameCapture::Format format = FrameCapture::Format::PNG;
+   const float degrees = 3.14159265358979f/180.0f;
+   for (int i = 1; i < argc; i++)
+   {
+      const std::string arg = argv[i];
+      const bool has_value = (i + 1 < argc);
+      if ( (arg == "--list") && (has_value) )
+      {
+         std::ifstream ifs(argv[++i]);
+         if (! ifs.good())
+         {
+            std::cerr << "Cannot read file list " << argv[i] << std::endl;
+            return 1;
+         }
+         std::string line;
+         while (std::getline(ifs, line))
+            if (! line.empty())
+               files.push_back(line);
+      }
+      else if ( (arg == "--view") && (has_value) )
+      {
+         View v;
+         char c1, c2;
+         std::stringstream ss(argv[++i]);
+         if ( (! (ss >> v.r >> c1 >> v.theta >> c2 >> v.phi)) || (c1 != ',') || (c2 != ',') )
+         {
+            std::cerr << "Invalid view " << argv[i] << " (expected r,theta,phi)" << std::endl;
+            return 1;
+         }
+         v.theta *= degrees;
+         v.phi *= degrees;
+         views.push_back(v);
+      }
+      else if ( (arg == "--out") && (has_value) )
+         directory = argv[++i];
+      else if ( (arg == "--size") && (has_value) )
+      {
+         char x;
+         std::stringstream ss(argv[++i]);
+         if ( (! (ss >> width >> x >> height)) || (x != 'x') || (width <= 0) || (height <= 0) )
+         {
+            std::cerr << "Invalid size " << argv[i] << " (expected <width>x<height>)" << std::endl;
+            return 1;
+         }
+      }
+      else if ( (arg == "--threads") && (has_value) )
+         threads = static_cast<unsigned>(std::max(std::stoi(argv[++i]), 1));
+      else if ( (arg == "--scale") && (has_value) )
+         scale = std::stof(argv[++i]);
+      else if ( (arg == "--point-size") && (has_value) )
+         point_size = std::stof(argv[++i]);
+      else if ( (arg == "--shaders") && (has_value) )
+         shader_dir = argv[++i];
+      else if ( (arg == "--normal-cache") && (has_value) )
+         PointCloudCache::instance().normal_cache_directory(argv[++i]);
+      else if (arg == "--unlit")
+         is_lit = false;
+      else if (arg == "--raw")
+         format = FrameCapture::Format::RAW;
+      else if ( (arg.size() > 2) && (arg.compare(0, 2, "--") == 0) )
+      {
+         std::cerr << "Unknown option " << arg << std::endl;
+         return 1;
+      }
+      else
+         files.push_back(arg);
+   }
+   if (files.empty())
+   {
+      std::cerr << "Usage: fibergl_render [--view r,theta,phi]... [--out dir] [--size WxH] [--threads n] [--scale s] "
+                   "[--point-size px] [--unlit] [--normal-cache dir] [--raw] [--shaders dir] plyfile... | --list file" << std::endl;
+      return 1;
+   }
+   if (views.empty())
+      views.push_back(View{0, 30*degrees, 60*degrees});
+
+#ifdef FIBERGL_EGL
+   oglfiber::OGLFiberExecutor::use_headless(true);
+#endif
+   oglfiber::OGLFiberExecutor& gl_executor = oglfiber::OGLFiberExecutor::instance();
+   ThumbnailWin* renderer = new ThumbnailWin(files, views, directory, width, height, shader_dir, scale, is_lit, format,
+                                             threads);
+   if (! renderer->good())
+   {
+      std::cerr << "Error creating renderer" << std::endl;
+      return 1;
+   }
+   renderer->set_point_size(point_size);
+   const auto start = std::chrono::steady_clock::now();
+   gl_executor.start({renderer}, false);
+   const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   const size_t rendered = files.size() - renderer->failed();
+   std::cout << std::fixed << std::setprecision(2) << rendered << " files (" << renderer->images() << " images, "
+             << renderer->failed() << " failed) in " << seconds << "s: " << rendered/seconds << " files/s"
+             << std::endl;
+   return (renderer->failed() == 0) ? 0 : 2;
+}